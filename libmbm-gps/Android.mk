@@ -31,6 +31,10 @@ LOCAL_SRC_FILES := \
 	src/gpsctrl/misc.c \
 	src/gpsctrl/misc.h
 
+# The hex codec is built once, in mbm-ril
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../mbm-ril
+LOCAL_STATIC_LIBRARIES := libmbm-hexcodec
+
 LOCAL_SHARED_LIBRARIES := \
 	libutils \
 	libcutils \
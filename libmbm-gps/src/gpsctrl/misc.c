@@ -25,6 +25,7 @@
 #include <errno.h>
 
 #include "misc.h"
+#include "hexcodec.h"
 
 /** Returns 1 if line starts with prefix, 0 if it does not. */
 int strStartsWith(const char *line, const char *prefix)
@@ -99,57 +100,31 @@ char *getFirstElementValue(const char* document,
 
 char char2nib(char c)
 {
-    if (c >= 0x30 && c <= 0x39)
-        return c - 0x30;
-
-    if (c >= 0x41 && c <= 0x46)
-        return c - 0x41 + 0xA;
-
-    if (c >= 0x61 && c <= 0x66)
-        return c - 0x61 + 0xA;
-
-    return 0;
+    return HEX_NIBBLE(c);
 }
 
 int stringToBinary(/*in*/ const char *string,
                    /*in*/ size_t len,
                    /*out*/ unsigned char *binary)
 {
-    int pos;
-    const char *it;
     const char *end = &string[len];
 
     if (end < string)
         return -EINVAL;
 
-    if (len & 1)
-        return -EINVAL;
-
-    for (pos = 0, it = string; it != end; ++pos, it += 2) {
-        binary[pos] = char2nib(it[0]) << 4 | char2nib(it[1]);
-    }
-    return 0;
+    return hexDecode(string, len, binary);
 }
 
 int binaryToString(/*in*/ const unsigned char *binary,
                    /*in*/ size_t len,
                    /*out*/ char *string)
 {
-    int pos;
-    const unsigned char *it;
     const unsigned char *end = &binary[len];
-    static const char nibbles[] =
-        {'0', '1', '2', '3', '4', '5', '6', '7',
-         '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
 
     if (end < binary)
         return -EINVAL;
 
-    for (pos = 0, it = binary; it != end; ++it, pos += 2) {
-        string[pos + 0] = nibbles[*it >> 4];
-        string[pos + 1] = nibbles[*it & 0x0f];
-    }
-    string[pos] = 0;
+    hexEncode(binary, len, string);
     return 0;
 }
 
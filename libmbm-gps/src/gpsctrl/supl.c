@@ -25,6 +25,7 @@
 #include "at_tok.h"
 #include "gps_ctrl.h"
 #include "supl.h"
+#include "hexcodec.h"
 
 #define LOG_TAG "libgpsctrl-supl"
 #include "../log.h"
@@ -156,32 +157,6 @@ int supl_send_ni_reply (int msg_id, int allow)
     return 0;
 }
 
-/**
- * Returns a pointer to allocated memory filled with AT command
- * UCS-2 formatted string corresponding to the input string.
- * Note: Caller need to take care of freeing the
- *  allocated memory by calling free( ) when the
- *  created string is no longer used.
- */
-static char *ucs2StringCreate(const char *iString)
-{
-    int slen = 0;
-    int idx = 0;
-    char *ucs2String = NULL;
-
-    /* In case of NULL input, create an empty string as output */
-    if (NULL == iString)
-        slen = 0;
-    else
-        slen = strlen(iString);
-
-    ucs2String = (char *)malloc(sizeof(char)*(slen*4+1));
-    for (idx = 0; idx < slen; idx++)
-        sprintf(&ucs2String[idx*4], "%04x", iString[idx]);
-    ucs2String[idx*4] = '\0';
-    return ucs2String;
-}
-
 static int setCharEncoding(const char *enc){
     int err;
     err = at_send_command("AT+CSCS=\"%s\"", enc);
@@ -280,8 +255,8 @@ static int networkAuth(const char *authentication, const char *user, const char
         oldenc = getCharEncoding();
         setCharEncoding("UCS2");
 
-        atUser = ucs2StringCreate(user);
-        atPass = ucs2StringCreate(pass);
+        atUser = utf8ToUcs2Hex(user);
+        atPass = utf8ToUcs2Hex(pass);
         /* Even if sending of the command below would be erroneous, we should still
          * try to change back the character set to the original.
          */
@@ -290,7 +265,7 @@ static int networkAuth(const char *authentication, const char *user, const char
         free(atUser);
 
         /* Set back to the original character set */
-        chSet = ucs2StringCreate(oldenc);
+        chSet = utf8ToUcs2Hex(oldenc);
         setCharEncoding(chSet);
         free(chSet);
         free(oldenc);
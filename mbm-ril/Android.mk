@@ -8,6 +8,15 @@
 # XXX using libutils for simulator build only...
 #
 LOCAL_PATH:= $(call my-dir)
+
+# Hex and UCS-2 codec, linked into libmbm-ril and the GPS HAL
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= hexcodec.c
+LOCAL_CFLAGS := -Wall
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= libmbm-hexcodec
+include $(BUILD_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
@@ -17,14 +26,20 @@ LOCAL_SRC_FILES:= \
     u300-ril-messaging.h \
     u300-ril-network.c \
     u300-ril-network.h \
+    u300-ril-cellinfo.c \
+    u300-ril-cellinfo.h \
     u300-ril-pdp.c \
     u300-ril-pdp.h \
+    u300-ril-datamon.c \
+    u300-ril-datamon.h \
     u300-ril-requestdatahandler.c \
     u300-ril-requestdatahandler.h \
     u300-ril-device.c \
     u300-ril-device.h \
     u300-ril-sim.c \
     u300-ril-sim.h \
+    u300-ril-simcache.c \
+    u300-ril-simcache.h \
     u300-ril-oem.c \
     u300-ril-oem.h \
     u300-ril-error.c \
@@ -35,6 +50,9 @@ LOCAL_SRC_FILES:= \
     atchannel.h \
     misc.c \
     misc.h \
+    hexcodec.h \
+    ber_tlv.c \
+    ber_tlv.h \
     fcp_parser.c \
     fcp_parser.h \
     at_tok.c \
@@ -46,6 +64,8 @@ LOCAL_SHARED_LIBRARIES := \
     libcutils libutils libril
 # libnetutils
 
+LOCAL_STATIC_LIBRARIES := libmbm-hexcodec
+
 # For asprinf
 LOCAL_CFLAGS := -D_GNU_SOURCE
 
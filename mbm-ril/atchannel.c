@@ -1247,6 +1247,14 @@ void at_set_timeout_msec(int timeout)
     ac->timeoutMsec = timeout;
 }
 
+/** Returns the timeout currently used for commands on this channel. */
+int at_get_timeout_msec(void)
+{
+    struct atcontext *ac = getAtContext();
+
+    return ac->timeoutMsec;
+}
+
 /** This callback is invoked on the command thread. */
 void at_set_on_timeout(void (*onTimeout)(void))
 {
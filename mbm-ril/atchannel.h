@@ -92,6 +92,9 @@ void at_close(void);
  */
 void at_set_timeout_msec(int timeout);
 
+/* Returns the timeout currently used for commands on this channel. */
+int at_get_timeout_msec(void);
+
 /* 
  * This callback is invoked on the command thread.
  * You should reset or handshake here to avoid getting out of sync.
@@ -0,0 +1,156 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Modified for ST-Ericsson U300 modems.
+*/
+
+#include <errno.h>
+
+#include "ber_tlv.h"
+
+#define BER_TLV_MAX_TAG_BYTES 4
+#define BER_TLV_MAX_LEN_BYTES 3
+
+void berTlvInit(struct berTlvIter *it, const void *data, size_t len,
+                int flags)
+{
+    it->pos = data;
+    it->end = &it->pos[len];
+    it->flags = flags;
+}
+
+void berTlvEnter(struct berTlvIter *it, const struct berTlv *tlv, int flags)
+{
+    it->pos = tlv->value;
+    it->end = tlv->end;
+    it->flags = (tlv->flags & BER_TLV_HEX) | flags;
+}
+
+/* Reads the next byte, returns -1 past the end. */
+static int getByte(struct berTlvIter *it)
+{
+    int b;
+
+    if (it->flags & BER_TLV_HEX) {
+        if (it->end - it->pos < 2)
+            return -1;
+        b = HEX_NIBBLE(it->pos[0]) << 4 | HEX_NIBBLE(it->pos[1]);
+        it->pos += 2;
+    } else {
+        if (it->pos >= it->end)
+            return -1;
+        b = (unsigned char) *it->pos++;
+    }
+    return b;
+}
+
+static int getTag(struct berTlvIter *it, unsigned int *tag)
+{
+    int b = getByte(it);
+    int i;
+
+    if (b < 0)
+        return -1;
+    *tag = b;
+
+    if (it->flags & BER_TLV_COMPREHENSION) {
+        /* TS 102 223, 7.1.1.2: 0x7F is followed by two more bytes. */
+        if (b != 0x7F)
+            return 0;
+        for (i = 0; i < 2; i++) {
+            if ((b = getByte(it)) < 0)
+                return -1;
+            *tag = *tag << 8 | b;
+        }
+        return 0;
+    }
+
+    /* ISO/IEC 7816-4, 5.2.2.1: low five bits set, more bytes follow. */
+    if ((b & 0x1F) != 0x1F)
+        return 0;
+    for (i = 1; i < BER_TLV_MAX_TAG_BYTES; i++) {
+        if ((b = getByte(it)) < 0)
+            return -1;
+        *tag = *tag << 8 | b;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static int getLength(struct berTlvIter *it, size_t *len)
+{
+    int b = getByte(it);
+    int n;
+
+    if (b < 0)
+        return -1;
+    if (b < 0x80) {
+        *len = b;
+        return 0;
+    }
+
+    /* 0x81 to 0x83: that many length bytes follow. */
+    n = b & 0x7F;
+    if (n == 0 || n > BER_TLV_MAX_LEN_BYTES)
+        return -1;
+    *len = 0;
+    while (n-- > 0) {
+        if ((b = getByte(it)) < 0)
+            return -1;
+        *len = *len << 8 | b;
+    }
+    return 0;
+}
+
+int berTlvNext(struct berTlvIter *it, struct berTlv *tlv)
+{
+    size_t size;
+
+    if (it->pos >= it->end)
+        return 0;
+
+    if (getTag(it, &tlv->tag) < 0 || getLength(it, &tlv->len) < 0)
+        goto malformed;
+
+    size = it->flags & BER_TLV_HEX ? tlv->len * 2 : tlv->len;
+    if (size > (size_t) (it->end - it->pos))
+        goto malformed;
+
+    tlv->value = it->pos;
+    tlv->end = &it->pos[size];
+    tlv->flags = it->flags;
+    it->pos = tlv->end;
+    return 1;
+
+malformed:
+    /* Nothing more can be made out of the rest. */
+    it->pos = it->end;
+    return -EINVAL;
+}
+
+int berTlvFind(struct berTlvIter *it, unsigned int tag, struct berTlv *tlv)
+{
+    int ret;
+
+    while ((ret = berTlvNext(it, tlv)) > 0)
+        if (tlv->tag == tag)
+            return 1;
+    return ret;
+}
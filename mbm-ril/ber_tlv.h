@@ -0,0 +1,87 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Modified for ST-Ericsson U300 modems.
+*/
+
+#ifndef MBM_BER_TLV_H
+#define MBM_BER_TLV_H 1
+
+#include <stddef.h>
+
+#include "hexcodec.h"
+
+/*
+ * Walks the TLVs of a buffer in place, be it hex digits as the modem
+ * gives them or bytes. Nothing is copied or converted ahead: a TLV
+ * points into the buffer and its value bytes are read as needed.
+ *
+ * Tags follow ISO/IEC 7816-4 (BER, up to 4 bytes), or with
+ * BER_TLV_COMPREHENSION ETSI TS 102 223 (COMPREHENSION-TLV, 1 or 3
+ * bytes). Lengths take 1 to 4 bytes. Anything running past the end of
+ * the buffer or its parent TLV is refused.
+ */
+enum {
+    BER_TLV_HEX = 1,            /* Two hex digits per byte */
+    BER_TLV_COMPREHENSION = 2   /* Simple TLVs inside a proactive command */
+};
+
+struct berTlvIter {
+    const char *pos;
+    const char *end;
+    int flags;
+};
+
+struct berTlv {
+    unsigned int tag;           /* All tag bytes, the first one highest */
+    size_t len;                 /* Of the value, in bytes */
+    const char *value;          /* Into the buffer */
+    const char *end;            /* Just past the value */
+    int flags;
+};
+
+/** Starts at data, len bytes or hex digits long. */
+void berTlvInit(struct berTlvIter *it, const void *data, size_t len,
+                int flags);
+
+/** Starts at the value of a constructed TLV, which holds more TLVs. */
+void berTlvEnter(struct berTlvIter *it, const struct berTlv *tlv, int flags);
+
+/**
+ * Gets the next TLV. Returns 1 if there was one, 0 at the end and
+ * -EINVAL for a TLV that does not fit or is malformed.
+ */
+int berTlvNext(struct berTlvIter *it, struct berTlv *tlv);
+
+/**
+ * Gets the next TLV with tag, skipping others. Returns 1 if found, 0
+ * if not and -EINVAL as berTlvNext().
+ */
+int berTlvFind(struct berTlvIter *it, unsigned int tag, struct berTlv *tlv);
+
+/** Returns value byte i of tlv, which must be below tlv->len. */
+static inline unsigned int berTlvByte(const struct berTlv *tlv, size_t i)
+{
+    if (tlv->flags & BER_TLV_HEX)
+        return HEX_NIBBLE(tlv->value[i * 2]) << 4 |
+            HEX_NIBBLE(tlv->value[i * 2 + 1]);
+    return (unsigned char) tlv->value[i];
+}
+
+#endif
@@ -29,14 +29,15 @@
 #include <utils/Log.h>
 
 #include "fcp_parser.h"
-#include "misc.h"
+#include "ber_tlv.h"
 
 int fcp_to_ts_51011(/*in*/ const char *stream, /*in*/ size_t len,
         /*out*/ struct ts_51011_921_resp *out)
 {
-    const char *end = &stream[len];
-    struct tlv fcp;
-    int ret = parseTlv(stream, end, &fcp);
+    struct berTlvIter it;
+    struct berTlv fcp;
+    struct berTlv tlv;
+    int ret;
     const char *what = NULL;
 #define FCP_CVT_THROW(_ret, _what)  \
     do {                    \
@@ -45,8 +46,10 @@ int fcp_to_ts_51011(/*in*/ const char *stream, /*in*/ size_t len,
         goto except;        \
     } while (0)
 
-    if (ret < 0)
-        FCP_CVT_THROW(ret, "ETSI TS 102 221, 11.1.1.3: FCP template TLV structure");
+    berTlvInit(&it, stream, len, BER_TLV_HEX);
+    ret = berTlvNext(&it, &fcp);
+    if (ret <= 0)
+        FCP_CVT_THROW(-EINVAL, "ETSI TS 102 221, 11.1.1.3: FCP template TLV structure");
     if (fcp.tag != 0x62)
         FCP_CVT_THROW(-EINVAL, "ETSI TS 102 221, 11.1.1.3: FCP template tag");
 
@@ -57,14 +60,10 @@ int fcp_to_ts_51011(/*in*/ const char *stream, /*in*/ size_t len,
      */
 
     memset(out, 0, sizeof(*out));
-    while (fcp.data < fcp.end) {
+    berTlvEnter(&it, &fcp, 0);
+    while ((ret = berTlvNext(&it, &tlv)) > 0) {
         unsigned char fdbyte;
-        size_t property_size;
-        struct tlv tlv;
-        ret = parseTlv(fcp.data, end, &tlv);
-        if (ret < 0)
-            FCP_CVT_THROW(ret, "ETSI TS 102 221, 11.1.1.3: FCP property TLV structure");
-        property_size = (tlv.end - tlv.data) / 2;
+        size_t property_size = tlv.len;
 
         switch (tlv.tag) {
             case 0x80: /* File size, ETSI TS 102 221, 11.1.1.4.1 */
@@ -72,22 +71,22 @@ int fcp_to_ts_51011(/*in*/ const char *stream, /*in*/ size_t len,
                 if (property_size != 2)
                     FCP_CVT_THROW(-ENOTSUP, "3GPP TS 51 011, 9.2.1: Unsupported file size");
                 /* be16 on both sides */
-                ((char*)&out->file_size)[0] = TLV_DATA(tlv, 0);
-                ((char*)&out->file_size)[1] = TLV_DATA(tlv, 1);
+                ((char*)&out->file_size)[0] = berTlvByte(&tlv, 0);
+                ((char*)&out->file_size)[1] = berTlvByte(&tlv, 1);
                 break;
             case 0x83: /* File identifier, ETSI TS 102 221, 11.1.1.4.4 */
                 /* Sanity check */
                 if (property_size != 2)
                     FCP_CVT_THROW(-EINVAL, "ETSI TS 102 221, 11.1.1.4.4: Invalid file identifier");
                 /* be16 on both sides */
-                ((char*)&out->file_id)[0] = TLV_DATA(tlv, 0);
-                ((char*)&out->file_id)[1] = TLV_DATA(tlv, 1);
+                ((char*)&out->file_id)[0] = berTlvByte(&tlv, 0);
+                ((char*)&out->file_id)[1] = berTlvByte(&tlv, 1);
                 break;
             case 0x82: /* File descriptior, ETSI TS 102 221, 11.1.1.4.3 */
                 /* Sanity check */
                 if (property_size < 2)
                     FCP_CVT_THROW(-EINVAL, "ETSI TS 102 221, 11.1.1.4.3: Invalid file descriptor");
-                fdbyte = TLV_DATA(tlv, 0);
+                fdbyte = berTlvByte(&tlv, 0);
                 /* ETSI TS 102 221, Table 11.5 for FCP fields */
                 /* 3GPP TS 51 011, 9.2.1 and 9.3 for 'out' fields */
                 if ((fdbyte & 0xBF) == 0x38) {
@@ -102,7 +101,7 @@ int fcp_to_ts_51011(/*in*/ const char *stream, /*in*/ size_t len,
                         if (property_size < 5)
                             FCP_CVT_THROW(-EINVAL, "ETSI TS 102 221, 11.1.1.4.3: Invalid non-transparent file descriptor");
                         ++out->data_size; /* record_size field is valid */
-                        out->record_size = TLV_DATA(tlv, 3);
+                        out->record_size = berTlvByte(&tlv, 3);
                         if ((fdbyte & 0x07) == 0x06) {
                             out->file_structure = 3; /* Cyclic */
                         } else if ((fdbyte & 0x07) == 0x02) {
@@ -116,8 +115,9 @@ int fcp_to_ts_51011(/*in*/ const char *stream, /*in*/ size_t len,
                 }
                 break;
         }
-        fcp.data = tlv.end;
     }
+    if (ret < 0)
+        FCP_CVT_THROW(ret, "ETSI TS 102 221, 11.1.1.3: FCP property TLV structure");
 
  finally:
     return ret;
@@ -127,3 +127,16 @@ int fcp_to_ts_51011(/*in*/ const char *stream, /*in*/ size_t len,
     LOGE("%s() FCP to TS 510 11: Specification violation: %s.", __func__, what);
     goto finally;
 }
+
+int fcp_to_ts_51011_hex(/*in*/ const char *stream, /*in*/ size_t len,
+        /*out*/ char *out)
+{
+    struct ts_51011_921_resp resp;
+    int ret = fcp_to_ts_51011(stream, len, &resp);
+
+    if (ret < 0)
+        return ret;
+
+    hexEncode((const unsigned char *) &resp, sizeof(resp), out);
+    return 0;
+}
@@ -44,4 +44,15 @@ int fcp_to_ts_51011(/*in*/ const char *stream,
                     /*in*/ size_t len,
                     /*out*/ struct ts_51011_921_resp *out);
 
+/* Hex digits and NUL of a ts_51011_921_resp. */
+#define TS_51011_921_RESP_HEX_LEN (2 * sizeof(struct ts_51011_921_resp) + 1)
+
+/*
+ * As fcp_to_ts_51011, but writes the response as hex digits into out,
+ * TS_51011_921_RESP_HEX_LEN characters long.
+ */
+int fcp_to_ts_51011_hex(/*in*/ const char *stream,
+                        /*in*/ size_t len,
+                        /*out*/ char *out);
+
 #endif
@@ -0,0 +1,372 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Modified for ST-Ericsson U300 modems.
+*/
+
+/*
+ * Hex and UCS-2 hex conversion. Blocks of 16 bytes go through NEON or
+ * SSE2 where the compiler targets them, the rest through the tables.
+ * Both give the same output for any input, invalid digits included.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HEXCODEC_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HEXCODEC_SSE2 1
+#endif
+
+#include "hexcodec.h"
+
+#define N(c) [c] = c - '0'
+#define U(c) [c] = c - 'A' + 10
+#define L(c) [c] = c - 'a' + 10
+
+const unsigned char hexNibbleTable[256] = {
+    N('0'), N('1'), N('2'), N('3'), N('4'),
+    N('5'), N('6'), N('7'), N('8'), N('9'),
+    U('A'), U('B'), U('C'), U('D'), U('E'), U('F'),
+    L('a'), L('b'), L('c'), L('d'), L('e'), L('f'),
+};
+
+#undef N
+#undef U
+#undef L
+
+static const char s_upperDigits[] = "0123456789ABCDEF";
+static const char s_lowerDigits[] = "0123456789abcdef";
+
+#if defined(HEXCODEC_NEON)
+
+/* Nibble values of 16 characters, 0 where not a hex digit. */
+static inline uint8x16_t nibblesNeon(uint8x16_t c)
+{
+    uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t alpha = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)),
+                                vdupq_n_u8('a'));
+    uint8x16_t isDigit = vcltq_u8(digit, vdupq_n_u8(10));
+    uint8x16_t isAlpha = vcltq_u8(alpha, vdupq_n_u8(6));
+
+    return vorrq_u8(vandq_u8(isDigit, digit),
+                    vandq_u8(isAlpha, vaddq_u8(alpha, vdupq_n_u8(10))));
+}
+
+/* Hex digits of 16 nibbles, with A to F from base 'A' or 'a'. */
+static inline uint8x16_t digitsNeon(uint8x16_t n, uint8_t alphaBase)
+{
+    uint8x16_t letter = vcgtq_u8(n, vdupq_n_u8(9));
+
+    return vaddq_u8(vaddq_u8(n, vdupq_n_u8('0')),
+                    vandq_u8(letter, vdupq_n_u8(alphaBase - '0' - 10)));
+}
+
+static size_t hexDecodeBlocks(const char *hex, size_t len,
+                              unsigned char *binary)
+{
+    size_t done;
+
+    for (done = 0; done + 32 <= len; done += 32) {
+        uint8x16x2_t c = vld2q_u8((const uint8_t *) &hex[done]);
+
+        vst1q_u8(&binary[done / 2],
+                 vorrq_u8(vshlq_n_u8(nibblesNeon(c.val[0]), 4),
+                          nibblesNeon(c.val[1])));
+    }
+    return done;
+}
+
+static size_t hexEncodeBlocks(const unsigned char *binary, size_t len,
+                              char *hex)
+{
+    size_t done;
+
+    for (done = 0; done + 16 <= len; done += 16) {
+        uint8x16_t b = vld1q_u8(&binary[done]);
+        uint8x16x2_t d;
+
+        d.val[0] = digitsNeon(vshrq_n_u8(b, 4), 'A');
+        d.val[1] = digitsNeon(vandq_u8(b, vdupq_n_u8(0x0F)), 'A');
+        vst2q_u8((uint8_t *) &hex[done * 2], d);
+    }
+    return done;
+}
+
+/* ASCII only: each byte becomes "00" and its two lower case digits. */
+static size_t ucs2EncodeBlocks(const unsigned char *ascii, size_t len,
+                               char *hex)
+{
+    size_t done;
+
+    for (done = 0; done + 16 <= len; done += 16) {
+        uint8x16_t b = vld1q_u8(&ascii[done]);
+        uint8x16x4_t d;
+        uint64x2_t high;
+
+        high = vreinterpretq_u64_u8(vandq_u8(b, vdupq_n_u8(0x80)));
+        if (vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1))
+            break;
+        d.val[0] = vdupq_n_u8('0');
+        d.val[1] = vdupq_n_u8('0');
+        d.val[2] = digitsNeon(vshrq_n_u8(b, 4), 'a');
+        d.val[3] = digitsNeon(vandq_u8(b, vdupq_n_u8(0x0F)), 'a');
+        vst4q_u8((uint8_t *) &hex[done * 4], d);
+    }
+    return done;
+}
+
+#elif defined(HEXCODEC_SSE2)
+
+/* Nibble values of 16 characters, 0 where not a hex digit. */
+static inline __m128i nibblesSse2(__m128i c)
+{
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                                 _mm_set1_epi8('a'));
+    /* Unsigned x < n as x == min(x, n - 1). */
+    __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)),
+                                     digit);
+    __m128i isAlpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)),
+                                     alpha);
+
+    return _mm_or_si128(_mm_and_si128(isDigit, digit),
+                        _mm_and_si128(isAlpha,
+                                      _mm_add_epi8(alpha,
+                                                   _mm_set1_epi8(10))));
+}
+
+/* Hex digits of 16 nibbles, with A to F from base 'A' or 'a'. */
+static inline __m128i digitsSse2(__m128i n, char alphaBase)
+{
+    __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+                        _mm_and_si128(letter,
+                                      _mm_set1_epi8(alphaBase - '0' - 10)));
+}
+
+static size_t hexDecodeBlocks(const char *hex, size_t len,
+                              unsigned char *binary)
+{
+    const __m128i lowByte = _mm_set1_epi16(0x00FF);
+    size_t done;
+
+    for (done = 0; done + 32 <= len; done += 32) {
+        __m128i a = nibblesSse2(_mm_loadu_si128((const __m128i *) &hex[done]));
+        __m128i b = nibblesSse2(_mm_loadu_si128((const __m128i *)
+                                                &hex[done + 16]));
+
+        /* Each 16 bit lane holds the high nibble first, low one second. */
+        a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, lowByte), 4),
+                         _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, lowByte), 4),
+                         _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *) &binary[done / 2],
+                         _mm_packus_epi16(a, b));
+    }
+    return done;
+}
+
+static size_t hexEncodeBlocks(const unsigned char *binary, size_t len,
+                              char *hex)
+{
+    const __m128i lowNibble = _mm_set1_epi8(0x0F);
+    size_t done;
+
+    for (done = 0; done + 16 <= len; done += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) &binary[done]);
+        __m128i hi = digitsSse2(_mm_and_si128(_mm_srli_epi16(b, 4),
+                                              lowNibble), 'A');
+        __m128i lo = digitsSse2(_mm_and_si128(b, lowNibble), 'A');
+
+        _mm_storeu_si128((__m128i *) &hex[done * 2],
+                         _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) &hex[done * 2 + 16],
+                         _mm_unpackhi_epi8(hi, lo));
+    }
+    return done;
+}
+
+/* ASCII only: each byte becomes "00" and its two lower case digits. */
+static size_t ucs2EncodeBlocks(const unsigned char *ascii, size_t len,
+                               char *hex)
+{
+    const __m128i lowNibble = _mm_set1_epi8(0x0F);
+    const __m128i zeros = _mm_set1_epi8('0');
+    size_t done;
+
+    for (done = 0; done + 16 <= len; done += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) &ascii[done]);
+        __m128i hi, lo, pairsLo, pairsHi;
+        char *out = &hex[done * 4];
+
+        if (_mm_movemask_epi8(b) != 0)
+            break;
+        hi = digitsSse2(_mm_and_si128(_mm_srli_epi16(b, 4), lowNibble), 'a');
+        lo = digitsSse2(_mm_and_si128(b, lowNibble), 'a');
+        pairsLo = _mm_unpacklo_epi8(hi, lo);
+        pairsHi = _mm_unpackhi_epi8(hi, lo);
+        _mm_storeu_si128((__m128i *) &out[0],
+                         _mm_unpacklo_epi16(zeros, pairsLo));
+        _mm_storeu_si128((__m128i *) &out[16],
+                         _mm_unpackhi_epi16(zeros, pairsLo));
+        _mm_storeu_si128((__m128i *) &out[32],
+                         _mm_unpacklo_epi16(zeros, pairsHi));
+        _mm_storeu_si128((__m128i *) &out[48],
+                         _mm_unpackhi_epi16(zeros, pairsHi));
+    }
+    return done;
+}
+
+#else
+
+static size_t hexDecodeBlocks(const char *hex, size_t len,
+                              unsigned char *binary)
+{
+    (void) hex; (void) len; (void) binary;
+    return 0;
+}
+
+static size_t hexEncodeBlocks(const unsigned char *binary, size_t len,
+                              char *hex)
+{
+    (void) binary; (void) len; (void) hex;
+    return 0;
+}
+
+static size_t ucs2EncodeBlocks(const unsigned char *ascii, size_t len,
+                               char *hex)
+{
+    (void) ascii; (void) len; (void) hex;
+    return 0;
+}
+
+#endif
+
+int hexDecode(const char *hex, size_t len, unsigned char *binary)
+{
+    size_t pos;
+
+    if (len & 1)
+        return -EINVAL;
+
+    for (pos = hexDecodeBlocks(hex, len, binary); pos < len; pos += 2)
+        binary[pos / 2] = HEX_NIBBLE(hex[pos]) << 4 | HEX_NIBBLE(hex[pos + 1]);
+    return 0;
+}
+
+void hexEncode(const unsigned char *binary, size_t len, char *hex)
+{
+    size_t pos;
+
+    for (pos = hexEncodeBlocks(binary, len, hex); pos < len; pos++) {
+        hex[pos * 2 + 0] = s_upperDigits[binary[pos] >> 4];
+        hex[pos * 2 + 1] = s_upperDigits[binary[pos] & 0x0F];
+    }
+    hex[len * 2] = '\0';
+}
+
+/*
+ * Decodes the UTF-8 sequence at s, of at most len bytes, into *ch.
+ * Returns the number of bytes taken, 1 with *ch '?' for anything
+ * invalid or outside the BMP.
+ */
+static size_t utf8Next(const unsigned char *s, size_t len, unsigned int *ch)
+{
+    unsigned int c = s[0];
+    size_t n, i;
+
+    if (c < 0x80) {
+        *ch = c;
+        return 1;
+    }
+
+    if ((c & 0xE0) == 0xC0) {
+        n = 2;
+        c &= 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+        n = 3;
+        c &= 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+        n = 4;
+        c &= 0x07;
+    } else
+        goto invalid;
+
+    if (n > len)
+        goto invalid;
+
+    for (i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80)
+            goto invalid;
+        c = c << 6 | (s[i] & 0x3F);
+    }
+
+    /* Overlong forms and surrogates. */
+    if ((n == 2 && c < 0x80) || (n == 3 && c < 0x800) ||
+        (n == 4 && c < 0x10000) || (c >= 0xD800 && c <= 0xDFFF))
+        goto invalid;
+
+    /* A whole character UCS-2 has no room for. */
+    *ch = c <= 0xFFFF ? c : '?';
+    return n;
+
+invalid:
+    *ch = '?';
+    return 1;
+}
+
+char *utf8ToUcs2Hex(const char *utf8)
+{
+    const unsigned char *s = (const unsigned char *) utf8;
+    size_t len = utf8 != NULL ? strlen(utf8) : 0;
+    size_t pos = 0;
+    char *hex, *out;
+
+    /* No character takes less than one byte. */
+    hex = malloc(len * 4 + 1);
+    if (hex == NULL)
+        return NULL;
+
+    out = hex;
+    while (pos < len) {
+        unsigned int ch;
+        size_t done = ucs2EncodeBlocks(&s[pos], len - pos, out);
+
+        pos += done;
+        out += done * 4;
+        if (pos == len)
+            break;
+
+        pos += utf8Next(&s[pos], len - pos, &ch);
+        out[0] = s_lowerDigits[(ch >> 12) & 0x0F];
+        out[1] = s_lowerDigits[(ch >> 8) & 0x0F];
+        out[2] = s_lowerDigits[(ch >> 4) & 0x0F];
+        out[3] = s_lowerDigits[ch & 0x0F];
+        out += 4;
+    }
+    *out = '\0';
+
+    return hex;
+}
@@ -0,0 +1,52 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Modified for ST-Ericsson U300 modems.
+*/
+
+#ifndef MBM_HEXCODEC_H
+#define MBM_HEXCODEC_H 1
+
+#include <stddef.h>
+
+/* Nibble value of each character, 0 for those that are not hex digits. */
+extern const unsigned char hexNibbleTable[256];
+
+#define HEX_NIBBLE(c) (hexNibbleTable[(unsigned char) (c)])
+
+/**
+ * Decodes len hex digits into len / 2 bytes. Characters that are not
+ * hex digits decode as 0. Returns -EINVAL if len is odd.
+ */
+int hexDecode(const char *hex, size_t len, unsigned char *binary);
+
+/**
+ * Encodes len bytes as upper case hex digits followed by a NUL, into
+ * 2 * len + 1 characters.
+ */
+void hexEncode(const unsigned char *binary, size_t len, char *hex);
+
+/**
+ * Returns the AT command UCS-2 form, four lower case hex digits per
+ * character, of a UTF-8 string, allocated. Invalid sequences and
+ * characters outside the BMP come out as '?'. NULL comes out empty.
+ */
+char *utf8ToUcs2Hex(const char *utf8);
+
+#endif
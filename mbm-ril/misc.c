@@ -21,10 +21,14 @@
 ** Author: Christian Bejram <christian.bejram@stericsson.com>
 */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <cutils/properties.h>
 
 #include "misc.h"
+#include "hexcodec.h"
 
 /** Returns 1 if line starts with prefix, 0 if it does not. */
 int strStartsWith(const char *line, const char *prefix)
@@ -92,84 +96,104 @@ char *getFirstElementValue(const char* document,
 
 char char2nib(char c)
 {
-    if (c >= 0x30 && c <= 0x39)
-        return c - 0x30;
-
-    if (c >= 0x41 && c <= 0x46)
-        return c - 0x41 + 0xA;
-
-    if (c >= 0x61 && c <= 0x66)
-        return c - 0x61 + 0xA;
-
-    return 0;
+    return HEX_NIBBLE(c);
 }
 
 int stringToBinary(/*in*/ const char *string,
                    /*in*/ size_t len,
                    /*out*/ unsigned char *binary)
 {
-    int pos;
-    const char *it;
     const char *end = &string[len];
 
     if (end < string)
         return -EINVAL;
 
-    if (len & 1)
-        return -EINVAL;
-
-    for (pos = 0, it = string; it != end; ++pos, it += 2) {
-        binary[pos] = char2nib(it[0]) << 4 | char2nib(it[1]);
-    }
-    return 0;
+    return hexDecode(string, len, binary);
 }
 
 int binaryToString(/*in*/ const unsigned char *binary,
                    /*in*/ size_t len,
                    /*out*/ char *string)
 {
-    int pos;
-    const unsigned char *it;
     const unsigned char *end = &binary[len];
-    static const char nibbles[] =
-        {'0', '1', '2', '3', '4', '5', '6', '7',
-         '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
 
     if (end < binary)
         return -EINVAL;
 
-    for (pos = 0, it = binary; it != end; ++it, pos += 2) {
-        string[pos + 0] = nibbles[*it >> 4];
-        string[pos + 1] = nibbles[*it & 0x0f];
-    }
-    string[pos] = 0;
+    hexEncode(binary, len, string);
     return 0;
 }
 
-int parseTlv(/*in*/ const char *stream,
-             /*in*/ const char *end,
-             /*out*/ struct tlv *tlv)
+/** Returns the number of milliseconds from start to end. */
+long long timespecDiffMsec(const struct timespec *start,
+                           const struct timespec *end)
 {
-#define TLV_STREAM_GET(stream, end, p)  \
-    do {                                \
-        if (stream + 1 >= end)          \
-            goto underflow;             \
-        p = ((unsigned)char2nib(stream[0]) << 4)  \
-          | ((unsigned)char2nib(stream[1]) << 0); \
-        stream += 2;                    \
-    } while (0)
-
-    size_t size;
-
-    TLV_STREAM_GET(stream, end, tlv->tag);
-    TLV_STREAM_GET(stream, end, size);
-    if (stream + size * 2 > end)
-        goto underflow;
-    tlv->data = &stream[0];
-    tlv->end  = &stream[size * 2];
-    return 0;
+    return (long long) (end->tv_sec - start->tv_sec) * 1000 +
+           (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/** Returns the integer value of a system property, or defaultValue. */
+int getPropertyInt(const char *key, int defaultValue)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char *end;
+    long l;
+
+    if (property_get(key, value, NULL) <= 0)
+        return defaultValue;
 
-underflow:
-    return -EINVAL;
-#undef TLV_STREAM_GET
+    l = strtol(value, &end, 10);
+    if (end == value)
+        return defaultValue;
+
+    return (int) l;
+}
+
+void latencyHistogramAdd(struct latencyHistogram *h, long long msec)
+{
+    int i;
+
+    if (msec < 0)
+        msec = 0;
+
+    for (i = 0; i < LATENCY_HISTOGRAM_BUCKETS - 1; i++)
+        if (msec < (long long) LATENCY_HISTOGRAM_BASE_MSEC << i)
+            break;
+
+    h->buckets[i]++;
+    h->count++;
+    h->sumMsec += msec;
+    if (msec > h->maxMsec)
+        h->maxMsec = msec;
+}
+
+/** Returns the upper bucket bound below which pct percent of samples fall. */
+long long latencyHistogramPercentile(const struct latencyHistogram *h,
+                                     int pct)
+{
+    unsigned int seen = 0;
+    unsigned int target;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    target = (h->count * pct + 99) / 100;
+    for (i = 0; i < LATENCY_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= target)
+            return (long long) LATENCY_HISTOGRAM_BASE_MSEC << i;
+    }
+    return h->maxMsec;
+}
+
+/** Formats count, mean, p50/p90/p99 and max into buf. */
+void latencyHistogramFormat(const struct latencyHistogram *h,
+                            char *buf, size_t len)
+{
+    snprintf(buf, len, "n=%u mean=%lld p50<%lld p90<%lld p99<%lld max=%lld",
+             h->count, h->count ? h->sumMsec / h->count : 0,
+             latencyHistogramPercentile(h, 50),
+             latencyHistogramPercentile(h, 90),
+             latencyHistogramPercentile(h, 99), h->maxMsec);
 }
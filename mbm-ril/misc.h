@@ -24,11 +24,7 @@
 #ifndef _U300_RIL_MISC_H
 #define _U300_RIL_MISC_H 1
 
-struct tlv {
-    unsigned    tag;
-    const char *data;
-    const char *end;
-};
+#include <time.h>
 
 /** Returns 1 if line starts with prefix, 0 if it does not. */
 int strStartsWith(const char *line, const char *prefix);
@@ -48,11 +44,36 @@ int binaryToString(/*in*/ const unsigned char *binary,
                    /*in*/ size_t len,
                    /*out*/ char *string);
 
-int parseTlv(/*in*/ const char *stream,
-             /*in*/ const char *end,
-             /*out*/ struct tlv *tlv);
-#define TLV_DATA(tlv, pos) (((unsigned)char2nib(tlv.data[(pos) * 2 + 0]) << 4) | \
-                            ((unsigned)char2nib(tlv.data[(pos) * 2 + 1]) << 0))
+/** Returns the number of milliseconds from start to end. */
+long long timespecDiffMsec(const struct timespec *start,
+                           const struct timespec *end);
+
+/** Returns the integer value of a system property, or defaultValue. */
+int getPropertyInt(const char *key, int defaultValue);
+
+/*
+ * Latency histogram with power of two buckets, bucket i counting
+ * samples below LATENCY_HISTOGRAM_BASE_MSEC << i, the last one the rest.
+ */
+#define LATENCY_HISTOGRAM_BUCKETS 12
+#define LATENCY_HISTOGRAM_BASE_MSEC 25
+
+struct latencyHistogram {
+    unsigned int buckets[LATENCY_HISTOGRAM_BUCKETS];
+    unsigned int count;
+    long long sumMsec;
+    long long maxMsec;
+};
+
+void latencyHistogramAdd(struct latencyHistogram *h, long long msec);
+
+/** Returns the upper bucket bound below which pct percent of samples fall. */
+long long latencyHistogramPercentile(const struct latencyHistogram *h,
+                                     int pct);
+
+/** Formats count, mean, p50/p90/p99 and max into buf. */
+void latencyHistogramFormat(const struct latencyHistogram *h,
+                            char *buf, size_t len);
 
 #define NUM_ELEMS(x) (sizeof(x) / sizeof(x[0]))
 
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -27,15 +28,14 @@
 #include <arpa/inet.h>
 
 #include <linux/if.h>
-#include <linux/sockios.h>
-#include <linux/route.h>
-#include <linux/wireless.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/time.h>
 
 #define LOG_TAG "mbm-netutils"
 #include <cutils/log.h>
 #include <cutils/properties.h>
-
-static int ifc_ctl_sock = -1;
+#include "net-utils.h"
 
 static const char *ipaddr_to_string(in_addr_t addr)
 {
@@ -45,112 +45,487 @@ static const char *ipaddr_to_string(in_addr_t addr)
     return inet_ntoa(in_addr);
 }
 
-int ifc_init(void)
+/*
+ * Interface configuration over a persistent rtnetlink socket. All the
+ * changes needed are sent as one batch of requests and acknowledged
+ * together.
+ */
+#define NL_BUFSIZE 8192
+#define NL_MAX_ADDRS 8
+#define NL_RECV_TIMEOUT_SEC 2
+
+struct nl_batch {
+    char buf[NL_BUFSIZE];
+    size_t len;
+    int count;
+    unsigned int firstSeq;
+};
+
+struct ifc_state {
+    int index;
+    unsigned int flags;
+    int mtu;
+    int naddrs;
+    in_addr_t addrs[NL_MAX_ADDRS];
+    int prefixlens[NL_MAX_ADDRS];
+};
+
+static pthread_mutex_t ifc_nl_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ifc_nl_sock = -1;
+static unsigned int ifc_nl_seq = 0;
+
+static int nl_open(void)
 {
-    if (ifc_ctl_sock == -1) {
-	ifc_ctl_sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (ifc_ctl_sock < 0)
-	    LOGE("%s() socket() failed: %s", __func__, strerror(errno));
+    struct sockaddr_nl snl;
+    struct timeval tv = { NL_RECV_TIMEOUT_SEC, 0 };
+
+    if (ifc_nl_sock != -1)
+	return 0;
+
+    ifc_nl_sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+    if (ifc_nl_sock < 0) {
+	LOGE("%s() socket() failed: %s", __func__, strerror(errno));
+	return -1;
     }
-    return ifc_ctl_sock < 0 ? -1 : 0;
-}
 
-void ifc_close(void)
-{
-    if (ifc_ctl_sock != -1) {
-	(void) close(ifc_ctl_sock);
-	ifc_ctl_sock = -1;
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    if (bind(ifc_nl_sock, (struct sockaddr *) &snl, sizeof(snl)) < 0) {
+	LOGE("%s() bind() failed: %s", __func__, strerror(errno));
+	close(ifc_nl_sock);
+	ifc_nl_sock = -1;
+	return -1;
     }
+
+    setsockopt(ifc_nl_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return 0;
 }
 
-static void ifc_init_ifr(const char *name, struct ifreq *ifr)
+static void nl_batch_init(struct nl_batch *b)
 {
-    memset(ifr, 0, sizeof(struct ifreq));
-    strncpy(ifr->ifr_name, name, IFNAMSIZ);
-    ifr->ifr_name[IFNAMSIZ - 1] = 0;
+    b->len = 0;
+    b->count = 0;
+    b->firstSeq = ifc_nl_seq + 1;
 }
 
-static int ifc_set_flags(const char *name, unsigned set, unsigned clr)
+static struct nlmsghdr *nl_batch_add(struct nl_batch *b, int type, int flags,
+                                     const void *payload, size_t size)
 {
-    struct ifreq ifr;
-    ifc_init_ifr(name, &ifr);
+    struct nlmsghdr *nh;
 
-    if (ioctl(ifc_ctl_sock, SIOCGIFFLAGS, &ifr) < 0)
-	return -1;
-    ifr.ifr_flags = (ifr.ifr_flags & (~clr)) | set;
-    return ioctl(ifc_ctl_sock, SIOCSIFFLAGS, &ifr);
+    if (b->len + NLMSG_SPACE(size) > sizeof(b->buf))
+	return NULL;
+
+    nh = (struct nlmsghdr *) (b->buf + b->len);
+    memset(nh, 0, NLMSG_SPACE(size));
+    nh->nlmsg_len = NLMSG_LENGTH(size);
+    nh->nlmsg_type = type;
+    nh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nh->nlmsg_seq = ++ifc_nl_seq;
+    memcpy(NLMSG_DATA(nh), payload, size);
+
+    b->len += NLMSG_ALIGN(nh->nlmsg_len);
+    b->count++;
+    return nh;
 }
 
-int ifc_up(const char *name)
+/* Appends an attribute to nh, which must be the last message of b. */
+static int nl_add_attr(struct nl_batch *b, struct nlmsghdr *nh, int type,
+                       const void *data, size_t size)
 {
-    return ifc_set_flags(name, IFF_UP | IFF_NOARP, 0);
+    struct rtattr *rta;
+
+    if (nh == NULL ||
+	NLMSG_ALIGN(nh->nlmsg_len) + RTA_SPACE(size) >
+	sizeof(b->buf) - ((char *) nh - b->buf))
+	return -1;
+
+    rta = (struct rtattr *) ((char *) nh + NLMSG_ALIGN(nh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(size);
+    memcpy(RTA_DATA(rta), data, size);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_SPACE(size);
+
+    b->len = ((char *) nh - b->buf) + NLMSG_ALIGN(nh->nlmsg_len);
+    return 0;
 }
 
-int ifc_down(const char *name)
+/*
+ * Sends the batch and waits for each request to be answered by an
+ * acknowledgement, error, end of dump or single reply. Replies are
+ * passed to handler. Returns 0 or the first negative errno reported.
+ */
+static int nl_transact(struct nl_batch *b,
+                       void (*handler)(struct nlmsghdr *nh, void *arg),
+                       void *arg)
 {
-    return ifc_set_flags(name, 0, IFF_UP);
+    struct sockaddr_nl snl;
+    char buf[NL_BUFSIZE];
+    int pending = b->count;
+    int result = 0;
+
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+
+    if (sendto(ifc_nl_sock, b->buf, b->len, 0,
+	       (struct sockaddr *) &snl, sizeof(snl)) < 0)
+	return -errno;
+
+    while (pending > 0) {
+	struct nlmsghdr *nh;
+	int len = recv(ifc_nl_sock, buf, sizeof(buf), 0);
+
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -errno;
+	}
+
+	for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len);
+	     nh = NLMSG_NEXT(nh, len)) {
+	    /* Skip answers to an earlier, timed out batch. */
+	    if (nh->nlmsg_seq - b->firstSeq >= (unsigned int) b->count)
+		continue;
+
+	    if (nh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *e = (struct nlmsgerr *) NLMSG_DATA(nh);
+
+		if (e->error && result == 0)
+		    result = e->error;
+		pending--;
+	    } else if (nh->nlmsg_type == NLMSG_DONE)
+		pending--;
+	    else {
+		if (handler != NULL)
+		    handler(nh, arg);
+		if (!(nh->nlmsg_flags & NLM_F_MULTI))
+		    pending--;
+	    }
+	}
+    }
+
+    return result;
 }
 
-static void init_sockaddr_in(struct sockaddr *sa, in_addr_t addr)
+static void ifc_parse_state(struct nlmsghdr *nh, void *arg)
 {
-    struct sockaddr_in *sin = (struct sockaddr_in *) sa;
-    sin->sin_family = AF_INET;
-    sin->sin_port = 0;
-    sin->sin_addr.s_addr = addr;
+    struct ifc_state *state = (struct ifc_state *) arg;
+    struct rtattr *rta;
+    int len;
+
+    if (nh->nlmsg_type == RTM_NEWLINK) {
+	struct ifinfomsg *ifi = (struct ifinfomsg *) NLMSG_DATA(nh);
+
+	state->index = ifi->ifi_index;
+	state->flags = ifi->ifi_flags;
+	len = IFLA_PAYLOAD(nh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	    if (rta->rta_type == IFLA_MTU)
+		state->mtu = *(int *) RTA_DATA(rta);
+    } else if (nh->nlmsg_type == RTM_NEWADDR) {
+	struct ifaddrmsg *ifa = (struct ifaddrmsg *) NLMSG_DATA(nh);
+
+	if ((int) ifa->ifa_index != state->index ||
+	    ifa->ifa_family != AF_INET || state->naddrs == NL_MAX_ADDRS)
+	    return;
+	len = IFA_PAYLOAD(nh);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	    if (rta->rta_type == IFA_LOCAL) {
+		state->addrs[state->naddrs] = *(in_addr_t *) RTA_DATA(rta);
+		state->prefixlens[state->naddrs] = ifa->ifa_prefixlen;
+		state->naddrs++;
+	    }
+    }
 }
 
-int ifc_set_addr(const char *name, in_addr_t addr)
+/* Reads link flags, MTU and IPv4 addresses of ifname. */
+static int ifc_get_state(const char *ifname, struct ifc_state *state)
 {
-    struct ifreq ifr;
+    struct nl_batch b;
+    struct ifinfomsg ifi;
+    struct ifaddrmsg ifa;
+    struct nlmsghdr *nh;
+    int err;
+
+    memset(state, 0, sizeof(*state));
+    state->index = -1;
+
+    nl_batch_init(&b);
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    nh = nl_batch_add(&b, RTM_GETLINK, 0, &ifi, sizeof(ifi));
+    if (nl_add_attr(&b, nh, IFLA_IFNAME, ifname, strlen(ifname) + 1))
+	return -1;
+
+    err = nl_transact(&b, ifc_parse_state, state);
+    if (err < 0 || state->index < 0) {
+	LOGE("%s() Failed to get link %s: %s", __func__, ifname,
+	     strerror(-err));
+	return -1;
+    }
 
-    ifc_init_ifr(name, &ifr);
-    init_sockaddr_in(&ifr.ifr_addr, addr);
+    nl_batch_init(&b);
+    memset(&ifa, 0, sizeof(ifa));
+    ifa.ifa_family = AF_INET;
+    nl_batch_add(&b, RTM_GETADDR, NLM_F_DUMP, &ifa, sizeof(ifa));
+
+    err = nl_transact(&b, ifc_parse_state, state);
+    if (err < 0) {
+	LOGE("%s() Failed to get addresses of %s: %s", __func__, ifname,
+	     strerror(-err));
+	return -1;
+    }
 
-    return ioctl(ifc_ctl_sock, SIOCSIFADDR, &ifr);
+    return 0;
 }
 
-int ifc_set_mask(const char *name, in_addr_t mask)
+static int ifc_nl_configure(const char *ifname,
+        in_addr_t address,
+        in_addr_t gateway,
+        int mtu,
+        int defaultRoute)
 {
-    struct ifreq ifr;
+    struct ifc_state state;
+    struct nl_batch b;
+    struct nlmsghdr *nh;
+    struct ifaddrmsg ifa;
+    struct ifinfomsg ifi;
+    struct rtmsg rtm;
+    unsigned int flags = IFF_UP | IFF_NOARP;
+    int configured = 0;
+    int i, err;
+    (void) gateway;
 
-    ifc_init_ifr(name, &ifr);
-    init_sockaddr_in(&ifr.ifr_addr, mask);
+    if (nl_open() || ifc_get_state(ifname, &state))
+	return -1;
+
+    for (i = 0; i < state.naddrs; i++)
+	if (state.addrs[i] == address && state.prefixlens[i] == 32)
+	    configured = 1;
 
-    return ioctl(ifc_ctl_sock, SIOCSIFNETMASK, &ifr);
+    /*
+     * A default route is sent anyway, it may have been lost while the
+     * address stayed, and replacing it with itself changes nothing.
+     */
+    if (configured && state.naddrs == 1 &&
+	(state.flags & flags) == flags && (mtu <= 0 || state.mtu == mtu)) {
+	LOGD("%s() %s already configured with %s", __func__, ifname,
+	     ipaddr_to_string(address));
+	if (!defaultRoute)
+	    return 0;
+    }
+
+    nl_batch_init(&b);
+
+    /* Drop addresses left from an earlier connection. */
+    memset(&ifa, 0, sizeof(ifa));
+    ifa.ifa_family = AF_INET;
+    ifa.ifa_index = state.index;
+    for (i = 0; i < state.naddrs; i++) {
+	if (state.addrs[i] == address && state.prefixlens[i] == 32)
+	    continue;
+	ifa.ifa_prefixlen = state.prefixlens[i];
+	nh = nl_batch_add(&b, RTM_DELADDR, NLM_F_ACK, &ifa, sizeof(ifa));
+	nl_add_attr(&b, nh, IFA_LOCAL, &state.addrs[i], sizeof(in_addr_t));
+    }
+
+    if (!configured) {
+	ifa.ifa_prefixlen = 32;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	nh = nl_batch_add(&b, RTM_NEWADDR,
+			  NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE,
+			  &ifa, sizeof(ifa));
+	if (nl_add_attr(&b, nh, IFA_LOCAL, &address, sizeof(address)) ||
+	    nl_add_attr(&b, nh, IFA_ADDRESS, &address, sizeof(address)))
+	    return -1;
+    }
+
+    if ((state.flags & flags) != flags || (mtu > 0 && state.mtu != mtu)) {
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = state.index;
+	ifi.ifi_flags = flags;
+	ifi.ifi_change = flags;
+	nh = nl_batch_add(&b, RTM_NEWLINK, NLM_F_ACK, &ifi, sizeof(ifi));
+	if (nh == NULL ||
+	    (mtu > 0 && nl_add_attr(&b, nh, IFLA_MTU, &mtu, sizeof(mtu))))
+	    return -1;
+    }
+
+    /* Default route through the link, replacing any earlier one. */
+    if (defaultRoute) {
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = AF_INET;
+	rtm.rtm_table = RT_TABLE_MAIN;
+	rtm.rtm_protocol = RTPROT_BOOT;
+	rtm.rtm_scope = RT_SCOPE_LINK;
+	rtm.rtm_type = RTN_UNICAST;
+	nh = nl_batch_add(&b, RTM_NEWROUTE,
+			  NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE,
+			  &rtm, sizeof(rtm));
+	if (nl_add_attr(&b, nh, RTA_OIF, &state.index, sizeof(state.index)))
+	    return -1;
+    }
+
+    err = nl_transact(&b, NULL, NULL);
+    if (err < 0) {
+	LOGE("%s() Failed to configure %s with %s: %s", __func__, ifname,
+	     ipaddr_to_string(address), strerror(-err));
+	return -1;
+    }
+
+    return 0;
 }
 
+/*
+ * Configures address, link state, MTU and, if defaultRoute, the default
+ * route of ifname. There is one default route, only the data call the
+ * framework uses by default should take it. When ifname is already up
+ * with only this address and the MTU, only the default route is set
+ * again, if asked for. A mtu of 0 leaves the MTU as is. The gateway is
+ * not used, the link is point to point.
+ */
 int ifc_configure(const char *ifname,
         in_addr_t address,
-        in_addr_t gateway)
+        in_addr_t gateway,
+        int mtu,
+        int defaultRoute)
 {
-    in_addr_t netmask = ~0;
-    (void) gateway;
+    int ret;
 
-    ifc_init();
+    pthread_mutex_lock(&ifc_nl_lock);
+    ret = ifc_nl_configure(ifname, address, gateway, mtu, defaultRoute);
+    pthread_mutex_unlock(&ifc_nl_lock);
 
-    if (ifc_up(ifname)) {
-	LOGE("%s() Failed to turn on interface %s: %s", __func__,
-	     ifname,
-	     strerror(errno));
-	ifc_close();
+    return ret;
+}
+
+static int ifc_nl_deconfigure(const char *ifname)
+{
+    struct ifc_state state;
+    struct nl_batch b;
+    struct nlmsghdr *nh;
+    struct ifaddrmsg ifa;
+    struct ifinfomsg ifi;
+    int i, err;
+
+    if (nl_open() || ifc_get_state(ifname, &state))
 	return -1;
+
+    if (!(state.flags & IFF_UP) && state.naddrs == 0)
+	return 0;
+
+    nl_batch_init(&b);
+
+    memset(&ifa, 0, sizeof(ifa));
+    ifa.ifa_family = AF_INET;
+    ifa.ifa_index = state.index;
+    for (i = 0; i < state.naddrs; i++) {
+	ifa.ifa_prefixlen = state.prefixlens[i];
+	nh = nl_batch_add(&b, RTM_DELADDR, NLM_F_ACK, &ifa, sizeof(ifa));
+	nl_add_attr(&b, nh, IFA_LOCAL, &state.addrs[i], sizeof(in_addr_t));
     }
-    if (ifc_set_addr(ifname, address)) {
-	LOGE("%s() Failed to set ipaddr %s: %s", __func__,
-	     ipaddr_to_string(address), strerror(errno));
-	ifc_down(ifname);
-	ifc_close();
-	return -1;
+
+    /* Taking the link down drops its routes as well. */
+    if (state.flags & IFF_UP) {
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = state.index;
+	ifi.ifi_change = IFF_UP;
+	if (nl_batch_add(&b, RTM_NEWLINK, NLM_F_ACK, &ifi, sizeof(ifi)) == NULL)
+	    return -1;
     }
-    if (ifc_set_mask(ifname, netmask)) {
-	LOGE("%s() failed to set netmask %s: %s", __func__,
-	     ipaddr_to_string(netmask), strerror(errno));
-	ifc_down(ifname);
-	ifc_close();
+
+    err = nl_transact(&b, NULL, NULL);
+    if (err < 0) {
+	LOGE("%s() Failed to take down %s: %s", __func__, ifname,
+	     strerror(-err));
 	return -1;
     }
 
-    ifc_close();
-
     return 0;
 }
+
+/*
+ * Removes the IPv4 addresses of ifname and takes it down, over the
+ * netlink socket kept open for ifc_configure().
+ */
+int ifc_deconfigure(const char *ifname)
+{
+    int ret;
+
+    pthread_mutex_lock(&ifc_nl_lock);
+    ret = ifc_nl_deconfigure(ifname);
+    pthread_mutex_unlock(&ifc_nl_lock);
+
+    return ret;
+}
+
+static void ifc_parse_stats(struct nlmsghdr *nh, void *arg)
+{
+    struct ifc_stats *stats = (struct ifc_stats *) arg;
+    struct ifinfomsg *ifi = (struct ifinfomsg *) NLMSG_DATA(nh);
+    struct rtattr *rta;
+    int len = IFLA_PAYLOAD(nh);
+    int have64 = 0;
+
+    if (nh->nlmsg_type != RTM_NEWLINK)
+	return;
+
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+	if (rta->rta_type == IFLA_STATS64 &&
+	    RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats64)) {
+	    struct rtnl_link_stats64 s64;
+
+	    /* The attribute is only 4 byte aligned. */
+	    memcpy(&s64, RTA_DATA(rta), sizeof(s64));
+	    stats->rx_bytes = s64.rx_bytes;
+	    stats->tx_bytes = s64.tx_bytes;
+	    stats->rx_packets = s64.rx_packets;
+	    stats->tx_packets = s64.tx_packets;
+	    have64 = 1;
+	} else if (rta->rta_type == IFLA_STATS && !have64 &&
+		   RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats)) {
+	    struct rtnl_link_stats *s32 = RTA_DATA(rta);
+
+	    stats->rx_bytes = s32->rx_bytes;
+	    stats->tx_bytes = s32->tx_bytes;
+	    stats->rx_packets = s32->rx_packets;
+	    stats->tx_packets = s32->tx_packets;
+	}
+    }
+    stats->valid = 1;
+}
+
+/* Reads the traffic counters of ifname. */
+int ifc_get_stats(const char *ifname, struct ifc_stats *stats)
+{
+    struct nl_batch b;
+    struct ifinfomsg ifi;
+    struct nlmsghdr *nh;
+    int err = -1;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&ifc_nl_lock);
+    if (nl_open())
+	goto finally;
+
+    nl_batch_init(&b);
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    nh = nl_batch_add(&b, RTM_GETLINK, 0, &ifi, sizeof(ifi));
+    if (nl_add_attr(&b, nh, IFLA_IFNAME, ifname, strlen(ifname) + 1))
+	goto finally;
+
+    err = nl_transact(&b, ifc_parse_stats, stats);
+    if (err < 0 || !stats->valid) {
+	LOGE("%s() Failed to get statistics of %s: %s", __func__, ifname,
+	     strerror(-err));
+	err = -1;
+    }
+
+finally:
+    pthread_mutex_unlock(&ifc_nl_lock);
+    return err;
+}
@@ -17,15 +17,20 @@
 #ifndef MBM_NET_UTILS_H
 #define MBM_NET_UTILS_H 1
 
-int ifc_init(void);
-void ifc_close(void);
-int ifc_up(const char *name);
-int ifc_down(const char *name);
-int ifc_set_addr(const char *name, in_addr_t addr);
-int ifc_set_mask(const char *name, in_addr_t mask);
-int ifc_add_host_route(const char *name);
+struct ifc_stats {
+    int valid;
+    unsigned long long rx_bytes;
+    unsigned long long tx_bytes;
+    unsigned long long rx_packets;
+    unsigned long long tx_packets;
+};
+
 int ifc_configure(const char *ifname,
         in_addr_t address,
-        in_addr_t gateway);
+        in_addr_t gateway,
+        int mtu,
+        int defaultRoute);
+int ifc_deconfigure(const char *ifname);
+int ifc_get_stats(const char *ifname, struct ifc_stats *stats);
 
 #endif
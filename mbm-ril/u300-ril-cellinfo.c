@@ -0,0 +1,524 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Heavily modified for ST-Ericsson U300 modems.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <telephony/ril.h>
+#include "atchannel.h"
+#include "at_tok.h"
+#include "misc.h"
+#include "u300-ril.h"
+#include "u300-ril-cellinfo.h"
+#include "u300-ril-device.h"
+#include "u300-ril-oem.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+/*
+ * Serving and neighbouring cells are sampled every
+ * CELL_SAMPLING_INTERVAL_PROPERTY seconds while the screen is on, and
+ * kept in a ring of the last CELL_HISTORY_SIZE snapshots. A value of 0
+ * disables sampling, RIL_REQUEST_GET_NEIGHBORING_CELL_IDS then samples
+ * on demand.
+ */
+#define CELL_SAMPLING_INTERVAL_PROPERTY "mbm.ril.cellinfo.interval"
+#define DEFAULT_CELL_SAMPLING_INTERVAL_SEC 30
+#define CELL_HISTORY_SIZE 32
+
+/* The AT specification allows 16 cells, including the current cell. */
+#define MAX_CELL_MEASUREMENTS (MAX_NUM_NEIGHBOR_CELLS + 1)
+
+enum cellRat {
+    CELL_RAT_NONE = 0,          /* Not registered */
+    CELL_RAT_GSM  = 1,          /* *EGNCI */
+    CELL_RAT_UMTS = 2           /* *EWNCI */
+};
+
+struct cellMeasurement {
+    char plmn[8];               /* GSM only */
+    int lac;                    /* GSM only */
+    int cid;                    /* GSM cell id or UMTS PSC */
+    int channel;                /* ARFCN or UARFCN */
+    int bsic;                   /* GSM only */
+    int level;                  /* RxLev or RSCP */
+    int ecno;                   /* UMTS only */
+    int pathloss;               /* UMTS only */
+};
+
+struct cellSnapshot {
+    struct timespec timestamp;
+    enum cellRat rat;
+    int servingLac;
+    int servingCid;
+    int numCells;
+    int dropped;
+    struct cellMeasurement cells[MAX_CELL_MEASUREMENTS];
+};
+
+static pthread_mutex_t s_cellMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cellSnapshot s_cellHistory[CELL_HISTORY_SIZE];
+static int s_cellHistoryNext = 0;
+static int s_cellHistoryCount = 0;
+static int s_cellSamplingActive = 0;
+static unsigned int s_cellsLeftOut = 0;
+
+static const char *cellRatToString(enum cellRat rat)
+{
+    switch (rat) {
+    case CELL_RAT_GSM:
+        return "GSM";
+    case CELL_RAT_UMTS:
+        return "UMTS";
+    default:
+        return "NONE";
+    }
+}
+
+static int getCellSamplingInterval(void)
+{
+    return getPropertyInt(CELL_SAMPLING_INTERVAL_PROPERTY,
+                          DEFAULT_CELL_SAMPLING_INTERVAL_SEC);
+}
+
+/**
+ * Determines network radio access technology (AcT) from +COPS?.
+ */
+static int getCellRat(enum cellRat *rat)
+{
+    int err;
+    int dummy = 0;
+    int network = -1;
+    char *dummyStr = NULL;
+    char *line = NULL;
+    ATResponse *cops_resp = NULL;
+
+    err = at_send_command_singleline("AT+COPS?", "+COPS:", &cops_resp);
+    if (err != AT_NOERROR)
+        goto error;
+
+    line = cops_resp->p_intermediates->line;
+
+    err = at_tok_start(&line);
+    if (err < 0) goto error;
+    /* Mode */
+    err = at_tok_nextint(&line, &dummy);
+    if (err < 0) goto error;
+    /* Check to see if not registered */
+    if (!at_tok_hasmore(&line)) {
+        *rat = CELL_RAT_NONE;
+        goto finally;
+    }
+    /* Format */
+    err = at_tok_nextint(&line, &dummy);
+    if (err < 0) goto error;
+    /* Operator */
+    err = at_tok_nextstr(&line, &dummyStr);
+    if (err < 0) goto error;
+    /* Network */
+    err = at_tok_nextint(&line, &network);
+    if (err < 0) goto error;
+
+    switch (network) {
+    case 0:                    /* GSM (GPRS,2G)*/
+    case 3:                    /* GSM w/EGPRS (EDGE, 2.75G)*/
+        *rat = CELL_RAT_GSM;
+        break;
+    case 2:                    /* UTRAN (WCDMA/UMTS, 3G)*/
+    case 4:                    /* UTRAN w/HSDPA (HSDPA,3G)*/
+    case 5:                    /* UTRAN w/HSUPA (HSUPA,3G)*/
+    case 6:                    /* UTRAN w/HSDPA and HSUPA (HSPA,3G)*/
+        *rat = CELL_RAT_UMTS;
+        break;
+    case 1:                    /* GSM Compact (Not supported)*/
+    default:
+        goto error;
+    }
+
+finally:
+    at_response_free(cops_resp);
+    return 0;
+
+error:
+    at_response_free(cops_resp);
+    return -1;
+}
+
+/**
+ * Reads the serving LAC and cell id from +CREG?. They are only reported
+ * while +CREG=2 is set, i.e. when the screen is on.
+ */
+static void getServingCell(struct cellSnapshot *snap)
+{
+    int err;
+    int dummy;
+    char *lac = NULL;
+    char *cid = NULL;
+    char *line = NULL;
+    ATResponse *creg_resp = NULL;
+
+    err = at_send_command_singleline("AT+CREG?", "+CREG:", &creg_resp);
+    if (err != AT_NOERROR)
+        goto finally;
+
+    line = creg_resp->p_intermediates->line;
+
+    /* +CREG: <n>,<stat>[,<lac>,<ci>[,<AcT>]] */
+    if (at_tok_start(&line) < 0 ||
+        at_tok_nextint(&line, &dummy) < 0 ||
+        at_tok_nextint(&line, &dummy) < 0 ||
+        !at_tok_hasmore(&line) ||
+        at_tok_nextstr(&line, &lac) < 0 ||
+        at_tok_nextstr(&line, &cid) < 0)
+        goto finally;
+
+    snap->servingLac = strtol(lac, NULL, 16);
+    snap->servingCid = strtol(cid, NULL, 16);
+
+finally:
+    at_response_free(creg_resp);
+}
+
+/**
+ * GSM Network (GPRS, 2G) Neighborhood Cell IDs
+ */
+static int sampleGsmCells(struct cellSnapshot *snap)
+{
+    int err;
+    ATLine *tmp = NULL;
+    ATResponse *gnci_resp = NULL;
+
+    err = at_send_command_multiline("AT*EGNCI", "*EGNCI:", &gnci_resp);
+    if (err != AT_NOERROR)
+        goto error;
+
+    for (tmp = gnci_resp->p_intermediates; tmp != NULL; tmp = tmp->p_next) {
+        char *line = tmp->line;
+        char *plmn = NULL;
+        char *lac = NULL;
+        char *cid = NULL;
+        struct cellMeasurement *cell;
+
+        if (snap->numCells == MAX_CELL_MEASUREMENTS) {
+            snap->dropped++;
+            continue;
+        }
+        cell = &snap->cells[snap->numCells];
+
+        err = at_tok_start(&line);
+        if (err < 0) goto error;
+        /* PLMN */
+        err = at_tok_nextstr(&line, &plmn);
+        if (err < 0) goto error;
+        /* LAC */
+        err = at_tok_nextstr(&line, &lac);
+        if (err < 0) goto error;
+        /* CellID */
+        err = at_tok_nextstr(&line, &cid);
+        if (err < 0) goto error;
+        /* ARFCN */
+        err = at_tok_nextint(&line, &cell->channel);
+        if (err < 0) goto error;
+        /* BSIC */
+        err = at_tok_nextint(&line, &cell->bsic);
+        if (err < 0) goto error;
+        /* RxLevel */
+        err = at_tok_nextint(&line, &cell->level);
+        if (err < 0) goto error;
+
+        strncpy(cell->plmn, plmn, sizeof(cell->plmn) - 1);
+        cell->lac = strtol(lac, NULL, 16);
+        cell->cid = strtol(cid, NULL, 16);
+        cell->ecno = -1;
+        cell->pathloss = -1;
+        snap->numCells++;
+    }
+
+    at_response_free(gnci_resp);
+    return 0;
+
+error:
+    at_response_free(gnci_resp);
+    return -1;
+}
+
+/**
+ * WCDMA Network (UTMS, 3G) Neighborhood Cell IDs
+ */
+static int sampleUmtsCells(struct cellSnapshot *snap)
+{
+    int err;
+    ATLine *tmp = NULL;
+    ATResponse *wnci_resp = NULL;
+
+    err = at_send_command_multiline("AT*EWNCI", "*EWNCI:", &wnci_resp);
+    if (err != AT_NOERROR)
+        goto error;
+
+    for (tmp = wnci_resp->p_intermediates; tmp != NULL; tmp = tmp->p_next) {
+        char *line = tmp->line;
+        struct cellMeasurement *cell;
+
+        if (snap->numCells == MAX_CELL_MEASUREMENTS) {
+            snap->dropped++;
+            continue;
+        }
+        cell = &snap->cells[snap->numCells];
+
+        err = at_tok_start(&line);
+        if (err < 0) goto error;
+        /* UARFCN */
+        err = at_tok_nextint(&line, &cell->channel);
+        if (err < 0) goto error;
+        /* PSC */
+        err = at_tok_nextint(&line, &cell->cid);
+        if (err < 0) goto error;
+        /* RSCP */
+        err = at_tok_nextint(&line, &cell->level);
+        if (err < 0) goto error;
+        /* ECNO */
+        err = at_tok_nextint(&line, &cell->ecno);
+        if (err < 0) goto error;
+        /* PathLoss */
+        err = at_tok_nextint(&line, &cell->pathloss);
+        if (err < 0) goto error;
+
+        cell->lac = -1;
+        cell->bsic = -1;
+        snap->numCells++;
+    }
+
+    at_response_free(wnci_resp);
+    return 0;
+
+error:
+    at_response_free(wnci_resp);
+    return -1;
+}
+
+/**
+ * Measures the serving and neighbouring cells and stores the result as
+ * the latest snapshot of the history.
+ */
+static int sampleCells(struct cellSnapshot *snap)
+{
+    int err = 0;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->servingLac = -1;
+    snap->servingCid = -1;
+
+    if (getCellRat(&snap->rat) < 0)
+        return -1;
+
+    if (snap->rat == CELL_RAT_GSM)
+        err = sampleGsmCells(snap);
+    else if (snap->rat == CELL_RAT_UMTS)
+        err = sampleUmtsCells(snap);
+    if (err < 0)
+        return -1;
+
+    if (snap->rat != CELL_RAT_NONE)
+        getServingCell(snap);
+
+    if (snap->dropped > 0)
+        LOGW("%s() Dropped %d cells above the limit of %d", __func__,
+             snap->dropped, MAX_CELL_MEASUREMENTS);
+
+    clock_gettime(CLOCK_MONOTONIC, &snap->timestamp);
+
+    pthread_mutex_lock(&s_cellMutex);
+    s_cellHistory[s_cellHistoryNext] = *snap;
+    s_cellHistoryNext = (s_cellHistoryNext + 1) % CELL_HISTORY_SIZE;
+    if (s_cellHistoryCount < CELL_HISTORY_SIZE)
+        s_cellHistoryCount++;
+    pthread_mutex_unlock(&s_cellMutex);
+
+    return 0;
+}
+
+/**
+ * Returns a copy of the latest snapshot if it is younger than maxAgeMsec.
+ */
+static int getLatestSnapshot(struct cellSnapshot *snap, long long maxAgeMsec)
+{
+    struct timespec now;
+    int found = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_cellMutex);
+    if (s_cellHistoryCount > 0) {
+        int latest = (s_cellHistoryNext + CELL_HISTORY_SIZE - 1) %
+                     CELL_HISTORY_SIZE;
+
+        if (timespecDiffMsec(&s_cellHistory[latest].timestamp, &now) <
+            maxAgeMsec) {
+            *snap = s_cellHistory[latest];
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&s_cellMutex);
+
+    return found;
+}
+
+/**
+ * Periodic sampling, re-enqueued every CELL_SAMPLING_INTERVAL_PROPERTY
+ * seconds. Nothing is sent to the module while the screen or the
+ * radio is off.
+ */
+static void pollCellInfo(void *param)
+{
+    struct cellSnapshot snap;
+    struct timespec interval = { 0, 0 };
+    RIL_RadioState state = getRadioState();
+    (void) param;
+
+    if (getScreenState() && state != RADIO_STATE_OFF &&
+        state != RADIO_STATE_UNAVAILABLE)
+        sampleCells(&snap);
+
+    interval.tv_sec = getCellSamplingInterval();
+    if (interval.tv_sec <= 0) {
+        LOGD("%s() Cell sampling disabled", __func__);
+        s_cellSamplingActive = 0;
+        return;
+    }
+
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, pollCellInfo, NULL, &interval);
+}
+
+/**
+ * Starts periodic cell sampling, unless disabled or already running.
+ */
+void startCellSampling(void)
+{
+    struct timespec interval = { 0, 0 };
+
+    interval.tv_sec = getCellSamplingInterval();
+    if (interval.tv_sec <= 0 || s_cellSamplingActive)
+        return;
+
+    s_cellSamplingActive = 1;
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, pollCellInfo, NULL, &interval);
+}
+
+/**
+ * RIL_REQUEST_NEIGHBORINGCELL_IDS
+ *
+ * Answered from the latest snapshot while it is younger than the
+ * sampling interval, otherwise the cells are sampled now. A snapshot
+ * holds up to MAX_CELL_MEASUREMENTS cells, on GSM the serving cell among
+ * them, which is not a neighbour and is left out. Neighbours beyond
+ * MAX_NUM_NEIGHBOR_CELLS are logged and counted.
+ */
+void requestNeighboringCellIDs(void *data, size_t datalen, RIL_Token t)
+{
+    (void) data; (void) datalen;
+    struct cellSnapshot snap;
+    RIL_NeighboringCell cells[MAX_NUM_NEIGHBOR_CELLS];
+    RIL_NeighboringCell *ptr_cells[MAX_NUM_NEIGHBOR_CELLS];
+    char cids[MAX_NUM_NEIGHBOR_CELLS][9];
+    int interval = getCellSamplingInterval();
+    int leftOut = 0;
+    int i, n;
+
+    if (interval <= 0 || !getLatestSnapshot(&snap, interval * 1000LL)) {
+        if (sampleCells(&snap) < 0) {
+            RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+            return;
+        }
+    }
+
+    /* Not registered or unknown network gives an empty list. */
+    for (i = 0, n = 0; i < snap.numCells; i++) {
+        struct cellMeasurement *cell = &snap.cells[i];
+
+        if (snap.rat == CELL_RAT_GSM && cell->lac == snap.servingLac &&
+            cell->cid == snap.servingCid)
+            continue;
+        if (n == MAX_NUM_NEIGHBOR_CELLS) {
+            leftOut++;
+            continue;
+        }
+
+        if (snap.rat == CELL_RAT_GSM)
+            sprintf(cids[n], "%08x", ((cell->lac << 16) + cell->cid));
+        else
+            sprintf(cids[n], "%08x", cell->cid);
+        cells[n].cid = cids[n];
+        cells[n].rssi = cell->level;
+        ptr_cells[n] = &cells[n];
+        n++;
+    }
+
+    if (leftOut > 0) {
+        LOGW("%s() Left out %d cells above the limit of %d", __func__,
+             leftOut, MAX_NUM_NEIGHBOR_CELLS);
+        pthread_mutex_lock(&s_cellMutex);
+        s_cellsLeftOut += leftOut;
+        pthread_mutex_unlock(&s_cellMutex);
+    }
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, ptr_cells,
+                          n * sizeof(RIL_NeighboringCell *));
+}
+
+/**
+ * Dumps the snapshot history, oldest first, for positioning and drive
+ * test analysis.
+ */
+void cellInfoDiagnostics(struct oemDiagnostics *diag)
+{
+    struct timespec now;
+    int i, j;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_cellMutex);
+    oemDiagPrintf(diag, "interval=%d snapshots=%d left_out=%u",
+                  getCellSamplingInterval(), s_cellHistoryCount,
+                  s_cellsLeftOut);
+    for (i = 0; i < s_cellHistoryCount; i++) {
+        int index = (s_cellHistoryNext + CELL_HISTORY_SIZE -
+                     s_cellHistoryCount + i) % CELL_HISTORY_SIZE;
+        struct cellSnapshot *snap = &s_cellHistory[index];
+
+        oemDiagPrintf(diag, "age=%lld rat=%s lac=%x cid=%x cells=%d dropped=%d",
+                      timespecDiffMsec(&snap->timestamp, &now),
+                      cellRatToString(snap->rat), snap->servingLac,
+                      snap->servingCid, snap->numCells, snap->dropped);
+        for (j = 0; j < snap->numCells; j++) {
+            struct cellMeasurement *cell = &snap->cells[j];
+
+            oemDiagPrintf(diag, " plmn=%s lac=%x cid=%x ch=%d bsic=%d"
+                          " level=%d ecno=%d pathloss=%d",
+                          cell->plmn, cell->lac, cell->cid, cell->channel,
+                          cell->bsic, cell->level, cell->ecno,
+                          cell->pathloss);
+        }
+    }
+    pthread_mutex_unlock(&s_cellMutex);
+}
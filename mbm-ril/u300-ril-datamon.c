@@ -0,0 +1,289 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Heavily modified for ST-Ericsson U300 modems.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <telephony/ril.h>
+#include "misc.h"
+#include "net-utils.h"
+#include "u300-ril.h"
+#include "u300-ril-datamon.h"
+#include "u300-ril-oem.h"
+#include "u300-ril-pdp.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+/*
+ * While a data call is up the link statistics of its interface are
+ * sampled every DATAMON_INTERVAL_PROPERTY seconds, 0 disables this.
+ * Packets sent without any received for DATAMON_STALL_PROPERTY
+ * seconds count as a stall, which is recovered from as selected by
+ * DATAMON_RECOVERY_PROPERTY.
+ */
+#define DATAMON_INTERVAL_PROPERTY "mbm.ril.datamon.interval"
+#define DATAMON_STALL_PROPERTY "mbm.ril.datamon.stall"
+#define DATAMON_RECOVERY_PROPERTY "mbm.ril.datamon.recovery"
+#define DEFAULT_DATAMON_INTERVAL_SEC 10
+#define DEFAULT_DATAMON_STALL_SEC 60
+
+enum datamonRecovery {
+    DATAMON_RECOVERY_NONE = 0,          /* Only count and log */
+    DATAMON_RECOVERY_RECONNECT = 1      /* Drop the data call */
+};
+
+struct linkMonitor {
+    int cid;
+    const char *ifname;
+    int sampled;
+    struct timespec timestamp;
+    struct ifc_stats stats;
+    unsigned long long rxRate;          /* bytes per second */
+    unsigned long long txRate;
+    int stalled;
+    struct timespec txOnlySince;        /* valid while txOnly */
+    int txOnly;
+    unsigned int stalls;
+    unsigned int recoveries;
+};
+
+static pthread_mutex_t s_datamonMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct linkMonitor s_links[MAX_PDP_CONTEXTS];
+static int s_datamonActive = 0;
+
+static int getDatamonInterval(void)
+{
+    return getPropertyInt(DATAMON_INTERVAL_PROPERTY,
+                          DEFAULT_DATAMON_INTERVAL_SEC);
+}
+
+/* Must be called with s_datamonMutex held. */
+static struct linkMonitor *findLink(int cid, const char *ifname)
+{
+    struct linkMonitor *unused = NULL;
+    int i;
+
+    for (i = 0; i < MAX_PDP_CONTEXTS; i++) {
+        if (s_links[i].cid == cid && s_links[i].ifname == ifname)
+            return &s_links[i];
+        if (unused == NULL && s_links[i].ifname == NULL)
+            unused = &s_links[i];
+    }
+
+    if (unused != NULL) {
+        memset(unused, 0, sizeof(*unused));
+        unused->cid = cid;
+        unused->ifname = ifname;
+    }
+    return unused;
+}
+
+/*
+ * Updates rates and stall state of link from a new sample. Returns 1
+ * when a stall has just been detected.
+ */
+static int updateLink(struct linkMonitor *link, const struct ifc_stats *stats,
+                      const struct timespec *now, int stallSec)
+{
+    long long elapsed;
+    int rxMoved, txMoved;
+
+    if (!link->sampled) {
+        link->sampled = 1;
+        link->stats = *stats;
+        link->timestamp = *now;
+        return 0;
+    }
+
+    elapsed = timespecDiffMsec(&link->timestamp, now);
+    if (elapsed <= 0)
+        return 0;
+
+    /* Counters restart when the interface is recreated. */
+    rxMoved = stats->rx_packets != link->stats.rx_packets;
+    txMoved = stats->tx_packets != link->stats.tx_packets;
+    link->rxRate = stats->rx_bytes >= link->stats.rx_bytes ?
+        (stats->rx_bytes - link->stats.rx_bytes) * 1000 / elapsed : 0;
+    link->txRate = stats->tx_bytes >= link->stats.tx_bytes ?
+        (stats->tx_bytes - link->stats.tx_bytes) * 1000 / elapsed : 0;
+    link->stats = *stats;
+    link->timestamp = *now;
+
+    if (rxMoved) {
+        if (link->stalled)
+            LOGI("%s() %s receives again", __func__, link->ifname);
+        link->txOnly = 0;
+        link->stalled = 0;
+        return 0;
+    }
+
+    /* Idle, the next tx only sample starts the window over. */
+    if (!txMoved) {
+        link->txOnly = 0;
+        return 0;
+    }
+
+    if (!link->txOnly) {
+        link->txOnly = 1;
+        link->txOnlySince = *now;
+    }
+
+    if (link->stalled || stallSec <= 0 ||
+        timespecDiffMsec(&link->txOnlySince, now) < stallSec * 1000LL)
+        return 0;
+
+    link->stalled = 1;
+    link->stalls++;
+    return 1;
+}
+
+static void pollDataMonitor(void *param)
+{
+    int cids[MAX_PDP_CONTEXTS];
+    const char *ifnames[MAX_PDP_CONTEXTS];
+    int stalledCids[MAX_PDP_CONTEXTS];
+    int seen[MAX_PDP_CONTEXTS];
+    struct timespec interval = { 0, 0 };
+    struct timespec now;
+    int stallSec = getPropertyInt(DATAMON_STALL_PROPERTY,
+                                  DEFAULT_DATAMON_STALL_SEC);
+    int recovery = getPropertyInt(DATAMON_RECOVERY_PROPERTY,
+                                  DATAMON_RECOVERY_NONE);
+    int n, i, j, numStalled = 0;
+    (void) param;
+
+    n = getConnectedPDPContexts(cids, ifnames, MAX_PDP_CONTEXTS);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < n; i++) {
+        struct ifc_stats stats;
+        struct linkMonitor *link;
+
+        if (ifc_get_stats(ifnames[i], &stats) < 0)
+            continue;
+
+        pthread_mutex_lock(&s_datamonMutex);
+        link = findLink(cids[i], ifnames[i]);
+        if (link != NULL) {
+            seen[link - s_links] = 1;
+            if (updateLink(link, &stats, &now, stallSec)) {
+                LOGW("%s() %s sent without receiving for %d s", __func__,
+                     link->ifname, stallSec);
+                stalledCids[numStalled++] = link->cid;
+            }
+        }
+        pthread_mutex_unlock(&s_datamonMutex);
+    }
+
+    /* Forget links whose data call is gone, keeping their counters. */
+    pthread_mutex_lock(&s_datamonMutex);
+    for (j = 0; j < MAX_PDP_CONTEXTS; j++)
+        if (!seen[j] && s_links[j].ifname != NULL) {
+            s_links[j].sampled = 0;
+            s_links[j].rxRate = 0;
+            s_links[j].txRate = 0;
+            s_links[j].txOnly = 0;
+            s_links[j].stalled = 0;
+        }
+    pthread_mutex_unlock(&s_datamonMutex);
+
+    for (i = 0; i < numStalled; i++) {
+        if (recovery != DATAMON_RECOVERY_RECONNECT)
+            continue;
+        if (resetPDPContext(stalledCids[i]) == 0) {
+            pthread_mutex_lock(&s_datamonMutex);
+            for (j = 0; j < MAX_PDP_CONTEXTS; j++)
+                if (s_links[j].cid == stalledCids[i])
+                    s_links[j].recoveries++;
+            pthread_mutex_unlock(&s_datamonMutex);
+        }
+    }
+
+    interval.tv_sec = getDatamonInterval();
+    if (n == 0 || interval.tv_sec <= 0) {
+        LOGD("%s() Data monitor stopped", __func__);
+        pthread_mutex_lock(&s_datamonMutex);
+        s_datamonActive = 0;
+        pthread_mutex_unlock(&s_datamonMutex);
+        return;
+    }
+
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, pollDataMonitor, NULL, &interval);
+}
+
+/**
+ * Starts sampling the interfaces of the connected data calls, unless
+ * disabled or already running. Stops by itself when no call is left.
+ */
+void startDataMonitor(void)
+{
+    struct timespec interval = { 0, 0 };
+
+    interval.tv_sec = getDatamonInterval();
+    if (interval.tv_sec <= 0)
+        return;
+
+    pthread_mutex_lock(&s_datamonMutex);
+    if (s_datamonActive) {
+        pthread_mutex_unlock(&s_datamonMutex);
+        return;
+    }
+    s_datamonActive = 1;
+    pthread_mutex_unlock(&s_datamonMutex);
+
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, pollDataMonitor, NULL, &interval);
+}
+
+/**
+ * Dumps link rates and stall counters.
+ */
+void dataMonitorDiagnostics(struct oemDiagnostics *diag)
+{
+    int i;
+
+    pthread_mutex_lock(&s_datamonMutex);
+    oemDiagPrintf(diag, "interval=%d stall=%d recovery=%d active=%d",
+                  getDatamonInterval(),
+                  getPropertyInt(DATAMON_STALL_PROPERTY,
+                                 DEFAULT_DATAMON_STALL_SEC),
+                  getPropertyInt(DATAMON_RECOVERY_PROPERTY,
+                                 DATAMON_RECOVERY_NONE),
+                  s_datamonActive);
+    for (i = 0; i < MAX_PDP_CONTEXTS; i++) {
+        struct linkMonitor *link = &s_links[i];
+
+        if (link->ifname == NULL)
+            continue;
+        oemDiagPrintf(diag, "cid=%d if=%s rx_bps=%llu tx_bps=%llu "
+                      "rx_bytes=%llu tx_bytes=%llu stalled=%d stalls=%u "
+                      "recoveries=%u", link->cid, link->ifname,
+                      link->rxRate * 8, link->txRate * 8,
+                      link->stats.rx_bytes, link->stats.tx_bytes,
+                      link->stalled, link->stalls, link->recoveries);
+    }
+    pthread_mutex_unlock(&s_datamonMutex);
+}
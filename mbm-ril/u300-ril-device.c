@@ -28,6 +28,7 @@
 #include "u300-ril-messaging.h"
 #include "u300-ril-sim.h"
 #include "u300-ril-network.h"
+#include "u300-ril-pdp.h"
 #include "u300-ril.h"
 
 #define LOG_TAG "RIL"
@@ -255,6 +256,9 @@ void onSIMReady(void *p)
      */
     at_send_command("AT+CGEREP=1,0");
 
+    /* Reporting now differs from what the screen state last applied. */
+    invalidateScreenProfile();
+
     /* Configure Short Message (SMS) Format
      *  mode = 0 - PDU mode.
      */
@@ -276,6 +280,12 @@ void onSIMReady(void *p)
      *             and data when TA is in on-line data mode.
      */
     at_send_command("AT+CMER=3,0,0,1");
+
+    /* Define the context of the last used APN ahead of a data call. */
+    prestagePDPContext();
+
+    /* Read the files the framework is about to ask for. */
+    prefetchSimFilesOnReady();
 }
 
 static const char *radioStateToString(RIL_RadioState radioState)
@@ -340,6 +350,10 @@ void setRadioState(RIL_RadioState newState)
         LOGE("%s() failed to release state mutex: %s!", __func__, strerror(err));
 
     /* Do these outside of the mutex. */
+    if (sState == RADIO_STATE_OFF || sState == RADIO_STATE_UNAVAILABLE ||
+        sState == RADIO_STATE_SIM_NOT_READY)
+        invalidateSimStatus();
+
     if (sState != oldState || sState == RADIO_STATE_SIM_LOCKED_OR_ABSENT) {
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
                                   NULL, 0);
@@ -123,7 +123,7 @@
 #define ENAP_T_CONNECTED     1
 #define ENAP_T_CONN_IN_PROG  2
 
-void mbm_check_error_cause(void);
+void mbm_check_error_cause(int e2napState, int e2napCause);
 
 const char *errorCauseToString(int cause);
 const char *e2napStateToString(int state);
@@ -27,6 +27,7 @@
 #include "at_tok.h"
 #include "misc.h"
 #include "u300-ril.h"
+#include "u300-ril-simcache.h"
 
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
@@ -41,6 +42,9 @@ static char s_outstanding_acknowledge = 0;
 
 #define BSM_LENGTH 88
 
+/* Messages stored on the SIM are records of EF_SMS, which may be cached. */
+#define EF_SMS 0x6F3C
+
 struct held_pdu {
     char type;
     char *sms_pdu;
@@ -250,6 +254,7 @@ void onNewSmsOnSIM(const char *s)
     if (err < 0)
         goto error;
 
+    simCacheInvalidateFile(EF_SMS);
     RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_NEW_SMS_ON_SIM,
                               &index, sizeof(int *));
 
@@ -628,6 +633,9 @@ void requestWriteSmsToSim(void *data, size_t datalen, RIL_Token t)
     free(cmd);
     free(pdu);
 
+    /* Whatever the outcome, what is cached may be stale now. */
+    simCacheInvalidateFile(EF_SMS);
+
     if (err != AT_NOERROR)
         goto error;
 
@@ -663,6 +671,7 @@ void requestDeleteSmsOnSim(void *data, size_t datalen, RIL_Token t)
     (void) data; (void) datalen;
 
     err = at_send_command("AT+CMGD=%d", ((int *) data)[0]);
+    simCacheInvalidateFile(EF_SMS);
     if (err != AT_NOERROR)
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     else
@@ -24,6 +24,9 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <telephony/ril.h>
 #include <assert.h>
 #include "atchannel.h"
@@ -35,24 +38,60 @@
 #include "u300-ril-network.h"
 #include "u300-ril-sim.h"
 #include "u300-ril-pdp.h"
+#include "u300-ril-oem.h"
 
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
 #include <cutils/properties.h>
 
-#define REPOLL_OPERATOR_SELECTED 30     /* 30 * 2 = 1M = ok? */
-#define MAX_NITZ_LENGTH 32
-
+static const struct timespec TIMEVAL_OPERATOR_SELECT_TIMEOUT = { 60, 0 };
 static const struct timespec TIMEVAL_OPERATOR_SELECT_POLL = { 2, 0 };
+static const struct timespec TIMEVAL_NITZ_CLOCK_SYNC = { 5, 0 };
 
-static char last_nitz_time[MAX_NITZ_LENGTH];
+/*
+ * A NITZ within NITZ_TOLERANCE_SEC of the time predicted from the
+ * previous one, with unchanged time zone and DST, is not forwarded,
+ * unless nothing was forwarded for NITZ_RESEND_SEC. The module clock
+ * is only set when it is more than CCLK_DRIFT_THRESHOLD_SEC off.
+ */
+#define NITZ_TOLERANCE_SEC 2
+#define NITZ_RESEND_SEC (60 * 60)
+#define CCLK_DRIFT_THRESHOLD_SEC 2
+
+static struct {
+    pthread_mutex_t mutex;
+    /* Module clock minus system clock, and its drift since last sync */
+    long long offset;
+    long long syncedOffset;
+    long long driftPpm;
+    struct timespec sampleTime;
+    int samples;
+    int updates;
+    /* Last NITZ received and forwarded */
+    long long nitzTime;
+    struct timespec nitzReceiveTime;
+    struct timespec nitzForwardTime;
+    int nitzTz;
+    int nitzDst;
+    int nitzForwarded;
+    int nitzSuppressed;
+} s_clock = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
 
-static void pollOperatorSelected(void *params);
+/*
+ * Pending RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, completed by
+ * onNetworkRegistrationChanged() or onOperatorSelectTimeout(). The
+ * generation tells a stale timeout event from the current one.
+ */
+static pthread_mutex_t s_opSelectMutex = PTHREAD_MUTEX_INITIALIZER;
+static RIL_Token s_opSelectToken = NULL;
+static int s_opSelectGeneration = 0;
 
 
 /*
  * s_registrationDeniedReason is used to keep track of registration deny
- * reason for which is called by pollOperatorSelected from
+ * reason for which is checked by onNetworkRegistrationChanged for
  * RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC, so that in case
  * of invalid SIM/ME, Android will not continuously poll for operator.
  *
@@ -73,11 +112,53 @@ static Reg_Deny_DetailReason s_registrationDeniedReason = DEFAULT_VALUE;
 
 static int pref_net_type = PREF_NET_TYPE_3G;
 
-struct operatorPollParams {
-    RIL_Token t;
-    int loopcount;
+/*
+ * Result of the last AT+COPS=? scan, blocks of QUERY_NW_NUM_PARAMS
+ * strings per network, and the requests waiting for a running scan.
+ */
+#define QUERY_NW_NUM_PARAMS 4
+#define NETWORK_SCAN_CACHE_TTL_SEC 60
+#define TIMEOUT_NETWORK_SCAN_MSEC (3 * 60 * 1000)
+#define MAX_PENDING_NETWORK_SCANS 4
+
+static struct {
+    pthread_mutex_t mutex;
+    char **list;
+    int count;
+    struct timespec timestamp;
+    int scanning;
+    RIL_Token pending[MAX_PENDING_NETWORK_SCANS];
+    int numPending;
+} s_nwScan = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .list = NULL,
+    .count = 0,
+    .scanning = 0,
+    .numPending = 0
+};
+
+static void invalidateNetworkScanCache(void);
+
+/*
+ * Long, short and numeric operator name, refreshed on screen on and
+ * dropped on registration changes. A query that overlapped a drop, as
+ * told by the generation, does not store its now stale result.
+ */
+#define OPERATOR_NUM_NAMES 3
+#define OPERATOR_CACHE_TTL_SEC 10
+
+static struct {
+    pthread_mutex_t mutex;
+    char *names[OPERATOR_NUM_NAMES];
+    struct timespec timestamp;
+    int valid;
+    unsigned int generation;
+} s_operatorCache = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
+static void invalidateOperatorCache(void);
+
 /* +CGREG AcT values */
 enum CREG_AcT {
     CGREG_ACT_GSM               = 0,
@@ -112,27 +193,55 @@ enum ERINFO_umts {
 #define E2REG_REGISTERED          5
 
 /**
- * Poll +COPS? and return a success, or if the loop counter reaches
- * REPOLL_OPERATOR_SELECTED, return generic failure.
+ * Converts a broken down UTC date to seconds since the epoch, without
+ * depending on the process time zone.
  */
-static void pollOperatorSelected(void *params)
+static long long civilToEpoch(int year, int mon, int day,
+                              int hour, int min, int sec)
 {
-    int err = 0;
-    int response = 0;
-    char *line = NULL;
-    ATResponse *atresponse = NULL;
-    struct operatorPollParams *poll_params;
-    RIL_Token t;
+    long long days;
+    int era, yoe, doy, doe;
+
+    year -= mon <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    days = (long long) era * 146097 + doe - 719468;
 
-    assert(params != NULL);
+    return days * 86400 + hour * 3600 + min * 60 + sec;
+}
 
-    poll_params = (struct operatorPollParams *) params;
-    t = poll_params->t;
+/**
+ * Parses "yy/MM/dd,hh:mm:ss" into seconds since the epoch.
+ */
+static int parseClockString(const char *s, long long *epoch)
+{
+    int year, mon, day, hour, min, sec;
 
-    if (poll_params->loopcount >= REPOLL_OPERATOR_SELECTED)
-        goto error;
+    if (sscanf(s, "%d/%d/%d,%d:%d:%d", &year, &mon, &day,
+               &hour, &min, &sec) != 6)
+        return -1;
 
-    err = at_send_command_singleline("AT+COPS?", "+COPS:", &atresponse);
+    *epoch = civilToEpoch(2000 + year % 100, mon, day, hour, min, sec);
+    return 0;
+}
+
+/**
+ * Reads the module clock with AT+CCLK? and returns its offset from the
+ * system clock in seconds.
+ */
+static int getModemClockOffset(long long *offset)
+{
+    int err;
+    int tzq = 0;
+    char *line;
+    char *cclk;
+    char *tz;
+    long long modemTime;
+    ATResponse *atresponse = NULL;
+
+    err = at_send_command_singleline("AT+CCLK?", "+CCLK:", &atresponse);
     if (err != AT_NOERROR)
         goto error;
 
@@ -142,40 +251,32 @@ static void pollOperatorSelected(void *params)
     if (err < 0)
         goto error;
 
-    err = at_tok_nextint(&line, &response);
+    /* +CCLK: "yy/MM/dd,hh:mm:ss±zz", local time, zz in quarters of hours */
+    err = at_tok_nextstr(&line, &cclk);
     if (err < 0)
         goto error;
 
-    /* If we don't get more than the COPS: {0-4} we are not registered.
-       Loop and try again. */
-    if (!at_tok_hasmore(&line)) {
-        switch (s_registrationDeniedReason) {
-        case IMSI_UNKNOWN_IN_HLR: /* fall through */
-        case ILLEGAL_ME:
-            RIL_onRequestComplete(t, RIL_E_ILLEGAL_SIM_OR_ME, NULL, 0);
-            free(poll_params);
-            break;
-        default:
-            poll_params->loopcount++;
-            enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollOperatorSelected,
-                            poll_params, &TIMEVAL_OPERATOR_SELECT_POLL);
-        }
-    } else {
-        /* We got operator, throw a success! */
-        RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
-        free(poll_params);
-    }
+    if (parseClockString(cclk, &modemTime) < 0)
+        goto error;
+
+    tz = strpbrk(cclk + 9, "+-");
+    if (tz != NULL)
+        tzq = atoi(tz);
+
+    *offset = modemTime - tzq * 15 * 60 - (long long) time(NULL);
 
     at_response_free(atresponse);
-    return;
+    return 0;
 
 error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    free(poll_params);
     at_response_free(atresponse);
-    return;
+    return -1;
 }
 
+/**
+ * Updates the module clock from the system clock, but only when the
+ * module clock has drifted more than CCLK_DRIFT_THRESHOLD_SEC from it.
+ */
 void sendTime(void *p)
 {
     time_t t;
@@ -185,8 +286,35 @@ void sendTime(void *p)
     int num[4];
     int tzi;
     int i;
+    long long offset;
+    struct timespec now;
     (void) p;
 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (getModemClockOffset(&offset) == 0) {
+        pthread_mutex_lock(&s_clock.mutex);
+        if (s_clock.samples > 0) {
+            long long elapsed = timespecDiffMsec(&s_clock.sampleTime, &now);
+
+            if (elapsed > 0)
+                s_clock.driftPpm = (offset - s_clock.syncedOffset) *
+                                   1000LL * 1000000LL / elapsed;
+        }
+        s_clock.offset = offset;
+        s_clock.syncedOffset = offset;
+        s_clock.sampleTime = now;
+        s_clock.samples++;
+        pthread_mutex_unlock(&s_clock.mutex);
+
+        if (llabs(offset) <= CCLK_DRIFT_THRESHOLD_SEC) {
+            LOGD("%s() Module clock offset %llds, not updated", __func__,
+                 offset);
+            return;
+        }
+        LOGD("%s() Module clock offset %llds, updating", __func__, offset);
+    }
+
     tzset();
     t = time(NULL);
 
@@ -201,7 +329,38 @@ void sendTime(void *p)
     /* convert timezone hours to timezone quarters of hours */
     tzi = (num[0] * 10 + num[1]) * 4 + (num[2] * 10 + num[3]) / 15;
     strftime(str, 20, "%y/%m/%d,%T", &tm);
-    at_send_command("at+cclk=\"%s%c%02d\"", str, tz[0], tzi);
+    if (at_send_command("at+cclk=\"%s%c%02d\"", str, tz[0], tzi) !=
+        AT_NOERROR)
+        return;
+
+    pthread_mutex_lock(&s_clock.mutex);
+    s_clock.syncedOffset = 0;
+    s_clock.updates++;
+    pthread_mutex_unlock(&s_clock.mutex);
+}
+
+/**
+ * Returns 1 if a NITZ carries nothing the framework does not already
+ * have, i.e. its time is what the previous NITZ predicts and the time
+ * zone and DST are unchanged.
+ */
+static int isNitzRedundant(long long nitzTime, int tz, int dst,
+                           const struct timespec *now)
+{
+    long long predicted;
+
+    if (s_clock.nitzForwarded == 0 || tz != s_clock.nitzTz ||
+        dst != s_clock.nitzDst)
+        return 0;
+
+    if (timespecDiffMsec(&s_clock.nitzForwardTime, now) >=
+        NITZ_RESEND_SEC * 1000LL)
+        return 0;
+
+    predicted = s_clock.nitzTime +
+                timespecDiffMsec(&s_clock.nitzReceiveTime, now) / 1000;
+
+    return llabs(nitzTime - predicted) <= NITZ_TOLERANCE_SEC;
 }
 
 /**
@@ -220,6 +379,9 @@ void onNetworkTimeReceived(const char *s)
 
     char *line, *tok, *response, *time, *timestamp;
     int tz, dst;
+    int redundant = 0;
+    long long nitzTime;
+    struct timespec now;
 
     tok = line = strdup(s);
     if (NULL == tok) {
@@ -241,28 +403,60 @@ void onNetworkTimeReceived(const char *s)
             dst = 0;
             LOGD("%s() MBM does not support dst, set dst=0", __func__); 
         }
-        if (!(asprintf(&response, "%s%+03d,%02d", time + 2, tz + (dst * 4), dst))) {
+        if (asprintf(&response, "%s%+03d,%02d", time + 2, tz + (dst * 4), dst) < 0) {
             free(line);
             LOGE("%s() Failed to allocate string", __func__);
             return;
         }
 
-        if (strncmp(response, last_nitz_time, strlen(response)) != 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&s_clock.mutex);
+        if (parseClockString(time + 2, &nitzTime) == 0) {
+            redundant = isNitzRedundant(nitzTime, tz, dst, &now);
+            s_clock.nitzTime = nitzTime;
+            s_clock.nitzReceiveTime = now;
+        }
+        if (redundant)
+            s_clock.nitzSuppressed++;
+        else {
+            s_clock.nitzTz = tz;
+            s_clock.nitzDst = dst;
+            s_clock.nitzForwardTime = now;
+            s_clock.nitzForwarded++;
+        }
+        pthread_mutex_unlock(&s_clock.mutex);
+
+        if (!redundant) {
             RIL_onUnsolicitedResponse(RIL_UNSOL_NITZ_TIME_RECEIVED,
                                       response, sizeof(char *));
-            strncpy(last_nitz_time, response, strlen(response));
+            /* Let the framework apply the NITZ before reading it back. */
+            enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, sendTime,
+                            NULL, &TIMEVAL_NITZ_CLOCK_SYNC);
         } else
-            LOGD("%s() Discarding NITZ since it hasn't changed since last update",
+            LOGD("%s() Discarding NITZ since it carries no new information",
 	         __func__);
 
         free(response);
-        enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, sendTime,
-                        NULL, NULL);
     }
 
     free(line);
 }
 
+/**
+ * Dumps the module clock offset and drift, and NITZ statistics.
+ */
+void clockDiagnostics(struct oemDiagnostics *diag)
+{
+    pthread_mutex_lock(&s_clock.mutex);
+    oemDiagPrintf(diag, "offset=%lld drift_ppm=%lld samples=%d updates=%d",
+                  s_clock.offset, s_clock.driftPpm, s_clock.samples,
+                  s_clock.updates);
+    oemDiagPrintf(diag, "nitz_forwarded=%d nitz_suppressed=%d",
+                  s_clock.nitzForwarded, s_clock.nitzSuppressed);
+    pthread_mutex_unlock(&s_clock.mutex);
+}
+
 int getSignalStrength(RIL_SignalStrength_v6 *signalStrength){
     ATResponse *atresponse = NULL;
     int err;
@@ -422,6 +616,209 @@ error:
     free(line);
 }
 
+/**
+ * Returns 1 if +COPS? reports a selected operator, 0 if not and -1 on
+ * error.
+ */
+static int isOperatorSelected(void)
+{
+    int err;
+    int response = 0;
+    int selected = -1;
+    char *line = NULL;
+    ATResponse *atresponse = NULL;
+
+    err = at_send_command_singleline("AT+COPS?", "+COPS:", &atresponse);
+    if (err != AT_NOERROR)
+        goto finally;
+
+    line = atresponse->p_intermediates->line;
+
+    err = at_tok_start(&line);
+    if (err < 0)
+        goto finally;
+
+    err = at_tok_nextint(&line, &response);
+    if (err < 0)
+        goto finally;
+
+    /* If we don't get more than the COPS: {0-4} we are not registered. */
+    selected = at_tok_hasmore(&line) ? 1 : 0;
+
+finally:
+    at_response_free(atresponse);
+    return selected;
+}
+
+/**
+ * Completes the pending network selection request, if any.
+ */
+static void completeOperatorSelected(RIL_Errno e)
+{
+    pthread_mutex_lock(&s_opSelectMutex);
+    if (s_opSelectToken != NULL) {
+        RIL_onRequestComplete(s_opSelectToken, e, NULL, 0);
+        s_opSelectToken = NULL;
+    }
+    pthread_mutex_unlock(&s_opSelectMutex);
+}
+
+/**
+ * Fallback for a network selection that no +CREG/+CGREG URC has
+ * completed within TIMEVAL_OPERATOR_SELECT_TIMEOUT. Checks +COPS? one
+ * last time and fails the request if no operator is selected.
+ */
+static void onOperatorSelectTimeout(void *param)
+{
+    int generation = (int) (intptr_t) param;
+    int selected;
+
+    pthread_mutex_lock(&s_opSelectMutex);
+    if (s_opSelectToken == NULL || generation != s_opSelectGeneration) {
+        pthread_mutex_unlock(&s_opSelectMutex);
+        return;
+    }
+    pthread_mutex_unlock(&s_opSelectMutex);
+
+    /* Do not hold the mutex over AT, the reader thread takes it. */
+    selected = isOperatorSelected();
+
+    pthread_mutex_lock(&s_opSelectMutex);
+    if (s_opSelectToken != NULL && generation == s_opSelectGeneration) {
+        LOGD("%s() Network selection %s after timeout", __func__,
+             selected > 0 ? "completed" : "failed");
+        RIL_onRequestComplete(s_opSelectToken, selected > 0 ?
+                              RIL_E_SUCCESS : RIL_E_GENERIC_FAILURE, NULL, 0);
+        s_opSelectToken = NULL;
+    }
+    pthread_mutex_unlock(&s_opSelectMutex);
+}
+
+/**
+ * With the screen off +CREG/+CGREG are disabled and no URC completes
+ * the network selection, so +COPS? is polled instead. Polling goes on
+ * if the screen comes back on meanwhile: turning the URCs back on does
+ * not report a registration that is already there.
+ */
+static void pollOperatorSelected(void *param)
+{
+    int generation = (int) (intptr_t) param;
+
+    pthread_mutex_lock(&s_opSelectMutex);
+    if (s_opSelectToken == NULL || generation != s_opSelectGeneration) {
+        pthread_mutex_unlock(&s_opSelectMutex);
+        return;
+    }
+    pthread_mutex_unlock(&s_opSelectMutex);
+
+    if (isOperatorSelected() > 0) {
+        pthread_mutex_lock(&s_opSelectMutex);
+        if (s_opSelectToken != NULL && generation == s_opSelectGeneration) {
+            RIL_onRequestComplete(s_opSelectToken, RIL_E_SUCCESS, NULL, 0);
+            s_opSelectToken = NULL;
+        }
+        pthread_mutex_unlock(&s_opSelectMutex);
+        return;
+    }
+
+    enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollOperatorSelected, param,
+                    &TIMEVAL_OPERATOR_SELECT_POLL);
+}
+
+/**
+ * Called on +CREG/+CGREG URCs, on the reader thread. Drops the cached
+ * operator names and completes a pending network selection as soon as
+ * the modem reports registration, or a denial that will not resolve by
+ * waiting.
+ */
+void onNetworkRegistrationChanged(const char *s)
+{
+    int err;
+    int stat;
+    char *line = NULL, *tok = NULL;
+
+    invalidateOperatorCache();
+
+    pthread_mutex_lock(&s_opSelectMutex);
+    if (s_opSelectToken == NULL) {
+        pthread_mutex_unlock(&s_opSelectMutex);
+        return;
+    }
+    pthread_mutex_unlock(&s_opSelectMutex);
+
+    tok = line = strdup(s);
+    if (tok == NULL)
+        return;
+
+    err = at_tok_start(&tok);
+    if (err < 0)
+        goto finally;
+
+    /* +CREG: <stat>[,<lac>,<ci>[,<AcT>]] */
+    err = at_tok_nextint(&tok, &stat);
+    if (err < 0)
+        goto finally;
+
+    switch (stat) {
+    case CGREG_STAT_REG_HOME_NET:
+    case CGREG_STAT_ROAMING:
+        completeOperatorSelected(RIL_E_SUCCESS);
+        break;
+    case CGREG_STAT_REG_DENIED:
+        switch (s_registrationDeniedReason) {
+        case IMSI_UNKNOWN_IN_HLR: /* fall through */
+        case ILLEGAL_ME:
+            completeOperatorSelected(RIL_E_ILLEGAL_SIM_OR_ME);
+            break;
+        default:
+            /* Automatic mode may still find another network. */
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+
+finally:
+    free(line);
+}
+
+/**
+ * Waits for the network selection started by AT+COPS=0 to complete.
+ * The request is completed by onNetworkRegistrationChanged() or, if no
+ * URC arrives, by onOperatorSelectTimeout().
+ */
+static void waitForOperatorSelected(RIL_Token t)
+{
+    int generation;
+
+    pthread_mutex_lock(&s_opSelectMutex);
+    if (s_opSelectToken != NULL) {
+        LOGD("%s() Superseding pending network selection", __func__);
+        RIL_onRequestComplete(s_opSelectToken, RIL_E_GENERIC_FAILURE,
+                              NULL, 0);
+    }
+    s_opSelectToken = t;
+    generation = ++s_opSelectGeneration;
+    pthread_mutex_unlock(&s_opSelectMutex);
+
+    /* No URC comes if we are already registered. */
+    if (isOperatorSelected() > 0) {
+        completeOperatorSelected(RIL_E_SUCCESS);
+        return;
+    }
+
+    enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, onOperatorSelectTimeout,
+                    (void *) (intptr_t) generation,
+                    &TIMEVAL_OPERATOR_SELECT_TIMEOUT);
+
+    /* The screen-off profile has turned the registration URCs off. */
+    if (!getScreenState())
+        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollOperatorSelected,
+                        (void *) (intptr_t) generation,
+                        &TIMEVAL_OPERATOR_SELECT_POLL);
+}
+
 /**
  * RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC
  *
@@ -437,11 +834,6 @@ void requestSetNetworkSelectionAutomatic(void *data, size_t datalen,
     int skip;
     char *line;
     char *operator = NULL;
-    struct operatorPollParams *poll_params = NULL;
-
-    poll_params = malloc(sizeof(struct operatorPollParams));
-    if (NULL == poll_params)
-        goto error;
 
     /* First check if we are already scanning or in manual mode */
     err = at_send_command_singleline("AT+COPS=3,2;+COPS?", "+COPS:", &atresponse);
@@ -586,21 +978,19 @@ do_auto:
     if (err != AT_NOERROR)
         goto error;
 
+    invalidateNetworkScanCache();
+    invalidateOperatorCache();
+
 finish_scan:
 
     at_response_free(atresponse);
     atresponse = NULL;
 
-    poll_params->loopcount = 0;
-    poll_params->t = t;
-
-    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, pollOperatorSelected,
-                    poll_params, &TIMEVAL_OPERATOR_SELECT_POLL);
+    waitForOperatorSelected(t);
 
     return;
 
 error:
-    free(poll_params);
     at_response_free(atresponse);
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     return;
@@ -639,6 +1029,9 @@ void requestSetNetworkSelectionManual(void *data, size_t datalen,
     if (err != AT_NOERROR)
         goto error;
 
+    invalidateNetworkScanCache();
+    invalidateOperatorCache();
+
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     return;
 
@@ -647,14 +1040,59 @@ error:
 }
 
 /**
- * RIL_REQUEST_QUERY_AVAILABLE_NETWORKS
- *
- * Scans for available networks.
-*/
-void requestQueryAvailableNetworks(void *data, size_t datalen, RIL_Token t)
+ * Frees a list of available networks, blocks of QUERY_NW_NUM_PARAMS
+ * strings per network.
+ */
+static void freeNetworkList(char **list, int count)
 {
-    #define QUERY_NW_NUM_PARAMS 4
+    int i;
 
+    if (list == NULL)
+        return;
+
+    for (i = 0; i < count * QUERY_NW_NUM_PARAMS; i++)
+        free(list[i]);
+    free(list);
+}
+
+/**
+ * Drops the cached network scan, e.g. after a network selection
+ * change made the <stat> fields stale.
+ */
+static void invalidateNetworkScanCache(void)
+{
+    pthread_mutex_lock(&s_nwScan.mutex);
+    freeNetworkList(s_nwScan.list, s_nwScan.count);
+    s_nwScan.list = NULL;
+    s_nwScan.count = 0;
+    pthread_mutex_unlock(&s_nwScan.mutex);
+}
+
+/**
+ * Returns the end of the parenthesized tuple starting at p, skipping
+ * over quoted operator names, or NULL if the tuple is not terminated.
+ */
+static char *findTupleEnd(char *p)
+{
+    int quoted = 0;
+
+    for (p++; *p != '\0'; p++) {
+        if (*p == '"')
+            quoted = !quoted;
+        else if (*p == ')' && !quoted)
+            return p;
+    }
+    return NULL;
+}
+
+/**
+ * Parses an AT+COPS=? response line in place into a newly allocated
+ * list, blocks of QUERY_NW_NUM_PARAMS strings per network.
+ *
+ * Returns the number of networks, or -1 on error.
+ */
+static int parseAvailableNetworks(char *line, char ***list)
+{
     /*
      * AT+COPS=?
      *   +COPS: [list of supported (<stat>,long alphanumeric <oper>
@@ -667,107 +1105,198 @@ void requestQueryAvailableNetworks(void *data, size_t datalen, RIL_Token t)
      *     2 = current
      *     3 = forbidden
      */
-    (void) data; (void) datalen;
-    int err = 0;
-    ATResponse *atresponse = NULL;
-    const char *statusTable[] =
+    static const char *statusTable[] =
         { "unknown", "available", "current", "forbidden" };
     char **responseArray = NULL;
-    char *p;
+    char *p = line;
+    int err;
     int n = 0;
     int i = 0;
 
-    err = at_send_command_multiline("AT+COPS=?", "+COPS:", &atresponse);
-    if (err != AT_NOERROR)
+    err = at_tok_start(&p);
+    if (err < 0)
         goto error;
 
-    p = atresponse->p_intermediates->line;
-
-    /* count number of '('. */
+    /* Number of '(' is an upper bound of the number of networks. */
     err = at_tok_charcounter(p, '(', &n);
-    if (err < 0) goto error;
+    if (err < 0)
+        goto error;
 
-    /* Allocate array of strings, blocks of 4 strings. */
-    responseArray = alloca(n * QUERY_NW_NUM_PARAMS * sizeof(char *));
+    responseArray = calloc(n * QUERY_NW_NUM_PARAMS + 1, sizeof(char *));
+    if (responseArray == NULL)
+        goto error;
 
-    /* Loop and collect response information into the response array. */
-    for (i = 0; i < n; i++) {
+    while (i < n) {
         int status = 0;
-        char *line = NULL;
-        char *s = NULL;
+        char *tuple;
+        char *end;
         char *longAlphaNumeric = NULL;
         char *shortAlphaNumeric = NULL;
         char *numeric = NULL;
-        char *remaining = NULL;
+        char **entry = &responseArray[i * QUERY_NW_NUM_PARAMS];
 
-        s = line = getFirstElementValue(p, "(", ")", &remaining);
-        p = remaining;
+        while (*p == ' ')
+            p++;
 
-        if (line == NULL) {
-            LOGE("%s() Null pointer while parsing COPS response."
-	         "This should not happen.", __func__);
+        /* An empty element ends the list of networks. */
+        if (*p != '(')
             break;
+
+        end = findTupleEnd(p);
+        if (end == NULL) {
+            LOGE("%s() Unterminated network in COPS response", __func__);
+            goto error;
         }
+        *end = '\0';
+        tuple = p + 1;
+        p = end + 1;
+        if (*p == ',')
+            p++;
+
         /* <stat> */
-        err = at_tok_nextint(&line, &status);
+        err = at_tok_nextint(&tuple, &status);
         if (err < 0)
             goto error;
 
         /* long alphanumeric <oper> */
-        err = at_tok_nextstr(&line, &longAlphaNumeric);
+        err = at_tok_nextstr(&tuple, &longAlphaNumeric);
         if (err < 0)
             goto error;
 
         /* short alphanumeric <oper> */
-        err = at_tok_nextstr(&line, &shortAlphaNumeric);
+        err = at_tok_nextstr(&tuple, &shortAlphaNumeric);
         if (err < 0)
             goto error;
 
         /* numeric <oper> */
-        err = at_tok_nextstr(&line, &numeric);
+        err = at_tok_nextstr(&tuple, &numeric);
         if (err < 0)
             goto error;
 
-        responseArray[i * QUERY_NW_NUM_PARAMS + 0] = alloca(strlen(longAlphaNumeric) + 1);
-        strcpy(responseArray[i * QUERY_NW_NUM_PARAMS + 0], longAlphaNumeric);
-
-        responseArray[i * QUERY_NW_NUM_PARAMS + 1] = alloca(strlen(shortAlphaNumeric) + 1);
-        strcpy(responseArray[i * QUERY_NW_NUM_PARAMS + 1], shortAlphaNumeric);
-
-        responseArray[i * QUERY_NW_NUM_PARAMS + 2] = alloca(strlen(numeric) + 1);
-        strcpy(responseArray[i * QUERY_NW_NUM_PARAMS + 2], numeric);
-
-        free(s);
+        if (status < 0 || status >= (int) NUM_ELEMS(statusTable))
+            status = 0;
 
         /*
          * Check if modem returned an empty string, and fill it with MNC/MMC
          * if that's the case.
          */
-        if (responseArray[i * QUERY_NW_NUM_PARAMS + 0] && strlen(responseArray[i * QUERY_NW_NUM_PARAMS + 0]) == 0) {
-            responseArray[i * QUERY_NW_NUM_PARAMS + 0] = alloca(strlen(responseArray[i * QUERY_NW_NUM_PARAMS + 2]) + 1);
-            strcpy(responseArray[i * QUERY_NW_NUM_PARAMS + 0], responseArray[i * QUERY_NW_NUM_PARAMS + 2]);
-        }
+        entry[0] = strdup(*longAlphaNumeric ? longAlphaNumeric : numeric);
+        entry[1] = strdup(*shortAlphaNumeric ? shortAlphaNumeric : numeric);
+        entry[2] = strdup(numeric);
+        entry[3] = strdup(statusTable[status]);
+        i++;
+    }
 
-        if (responseArray[i * QUERY_NW_NUM_PARAMS + 1] && strlen(responseArray[i * QUERY_NW_NUM_PARAMS + 1]) == 0) {
-            responseArray[i * QUERY_NW_NUM_PARAMS + 1] = alloca(strlen(responseArray[i * QUERY_NW_NUM_PARAMS + 2]) + 1);
-            strcpy(responseArray[i * QUERY_NW_NUM_PARAMS + 1], responseArray[i * QUERY_NW_NUM_PARAMS + 2]);
-        }
+    *list = responseArray;
+    return i;
+
+error:
+    freeNetworkList(responseArray, i);
+    return -1;
+}
+
+/**
+ * Runs the AT+COPS=? scan and completes every request that has been
+ * waiting for it. Enqueued on the scan queue, as a scan can take
+ * minutes and the prio queue has to stay free for short commands. Runs
+ * on the normal queue when no scan channel is configured.
+ */
+static void scanAvailableNetworks(void *param)
+{
+    int err;
+    int i;
+    int count = -1;
+    int timeout;
+    long long scanMsec;
+    char **list = NULL;
+    ATResponse *atresponse = NULL;
+    struct timespec start;
+    struct timespec end;
+    (void) param;
+
+    /* Whichever channel runs it, a scan needs the full timeout. */
+    timeout = at_get_timeout_msec();
+    at_set_timeout_msec(TIMEOUT_NETWORK_SCAN_MSEC);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = at_send_command_multiline("AT+COPS=?", "+COPS:", &atresponse);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    at_set_timeout_msec(timeout);
+
+    scanMsec = timespecDiffMsec(&start, &end);
+    if (err == AT_NOERROR)
+        count = parseAvailableNetworks(atresponse->p_intermediates->line,
+                                       &list);
 
-       /* Add status */
-        responseArray[i * QUERY_NW_NUM_PARAMS + 3] = alloca(strlen(statusTable[status]) + 1);
-        sprintf(responseArray[i * QUERY_NW_NUM_PARAMS + 3], "%s", statusTable[status]);
+    LOGI("%s() Scan took %lld ms, found %d networks", __func__,
+         scanMsec, count);
+
+    pthread_mutex_lock(&s_nwScan.mutex);
+    if (count >= 0) {
+        freeNetworkList(s_nwScan.list, s_nwScan.count);
+        s_nwScan.list = list;
+        s_nwScan.count = count;
+        s_nwScan.timestamp = end;
     }
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, responseArray,
-                          i * QUERY_NW_NUM_PARAMS * sizeof(char *));
+    for (i = 0; i < s_nwScan.numPending; i++) {
+        if (count >= 0)
+            RIL_onRequestComplete(s_nwScan.pending[i], RIL_E_SUCCESS, list,
+                                  count * QUERY_NW_NUM_PARAMS * sizeof(char *));
+        else
+            RIL_onRequestComplete(s_nwScan.pending[i],
+                                  RIL_E_GENERIC_FAILURE, NULL, 0);
+    }
+    s_nwScan.numPending = 0;
+    s_nwScan.scanning = 0;
+    pthread_mutex_unlock(&s_nwScan.mutex);
 
-finally:
     at_response_free(atresponse);
-    return;
+}
 
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    goto finally;
+/**
+ * RIL_REQUEST_QUERY_AVAILABLE_NETWORKS
+ *
+ * Scans for available networks. A scan younger than
+ * NETWORK_SCAN_CACHE_TTL_SEC is answered from the cache, otherwise the
+ * request is completed by scanAvailableNetworks(). Requests arriving
+ * while a scan is running share its result.
+*/
+void requestQueryAvailableNetworks(void *data, size_t datalen, RIL_Token t)
+{
+    (void) data; (void) datalen;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_nwScan.mutex);
+    if (s_nwScan.list != NULL && !s_nwScan.scanning &&
+        timespecDiffMsec(&s_nwScan.timestamp, &now) <
+        NETWORK_SCAN_CACHE_TTL_SEC * 1000) {
+        LOGD("%s() Using cached scan of %d networks", __func__,
+             s_nwScan.count);
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, s_nwScan.list,
+                              s_nwScan.count * QUERY_NW_NUM_PARAMS *
+                              sizeof(char *));
+        goto finally;
+    }
+
+    if (s_nwScan.numPending >= (int) NUM_ELEMS(s_nwScan.pending)) {
+        LOGE("%s() Too many pending network scans", __func__);
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        goto finally;
+    }
+
+    s_nwScan.pending[s_nwScan.numPending++] = t;
+    if (!s_nwScan.scanning) {
+        s_nwScan.scanning = 1;
+        enqueueRILEvent(RIL_EVENT_QUEUE_SCAN, scanAvailableNetworks,
+                        NULL, NULL);
+    }
+
+finally:
+    pthread_mutex_unlock(&s_nwScan.mutex);
 }
 
 /*
@@ -1476,23 +2005,43 @@ error:
 }
 
 /**
- * RIL_REQUEST_OPERATOR
- *
- * Request current operator ONS or EONS.
+ * Drops the cached operator names.
  */
-void requestOperator(void *data, size_t datalen, RIL_Token t)
+static void invalidateOperatorCache(void)
+{
+    int i;
+
+    pthread_mutex_lock(&s_operatorCache.mutex);
+    for (i = 0; i < OPERATOR_NUM_NAMES; i++) {
+        free(s_operatorCache.names[i]);
+        s_operatorCache.names[i] = NULL;
+    }
+    s_operatorCache.valid = 0;
+    s_operatorCache.generation++;
+    pthread_mutex_unlock(&s_operatorCache.mutex);
+}
+
+/**
+ * Queries the long, short and numeric operator names into the cache,
+ * and into names, allocated, unless NULL. Those stay valid whatever
+ * happens to the cache meanwhile.
+ */
+static int queryOperator(char **names)
 {
-    (void) data; (void) datalen;
     int err;
     int i;
     int skip;
+    unsigned int generation;
     ATLine *cursor;
-    static const int num_resp_lines = 3;
-    char *response[num_resp_lines];
+    char *response[OPERATOR_NUM_NAMES];
     ATResponse *atresponse = NULL;
 
     memset(response, 0, sizeof(response));
 
+    pthread_mutex_lock(&s_operatorCache.mutex);
+    generation = s_operatorCache.generation;
+    pthread_mutex_unlock(&s_operatorCache.mutex);
+
     err = at_send_command_multiline
         ("AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?", "+COPS:",
          &atresponse);
@@ -1506,7 +2055,7 @@ void requestOperator(void *data, size_t datalen, RIL_Token t)
      * +COPS: 0,2,"310170"
      */
     for (i = 0, cursor = atresponse->p_intermediates;
-         cursor != NULL && i < num_resp_lines;
+         cursor != NULL && i < OPERATOR_NUM_NAMES;
          cursor = cursor->p_next, i++) {
         char *line = cursor->line;
 
@@ -1544,263 +2093,97 @@ void requestOperator(void *data, size_t datalen, RIL_Token t)
             goto error;
     }
 
-    if (i != num_resp_lines)
+    if (i != OPERATOR_NUM_NAMES)
         goto error;
 
     /*
      * Check if modem returned an empty string, and fill it with MNC/MMC
      * if that's the case.
      */
-    if (response[2] && response[0] && strlen(response[0]) == 0) {
-        response[0] = alloca(strlen(response[2]) + 1);
-        strcpy(response[0], response[2]);
-    }
-
-    if (response[2] && response[1] && strlen(response[1]) == 0) {
-        response[1] = alloca(strlen(response[2]) + 1);
-        strcpy(response[1], response[2]);
-    }
-
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
+    if (response[2] && response[0] && strlen(response[0]) == 0)
+        response[0] = response[2];
+
+    if (response[2] && response[1] && strlen(response[1]) == 0)
+        response[1] = response[2];
+
+    if (names != NULL)
+        for (i = 0; i < OPERATOR_NUM_NAMES; i++)
+            names[i] = response[i] ? strdup(response[i]) : NULL;
+
+    pthread_mutex_lock(&s_operatorCache.mutex);
+    if (generation == s_operatorCache.generation) {
+        for (i = 0; i < OPERATOR_NUM_NAMES; i++) {
+            free(s_operatorCache.names[i]);
+            s_operatorCache.names[i] =
+                response[i] ? strdup(response[i]) : NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &s_operatorCache.timestamp);
+        s_operatorCache.valid = 1;
+    } else
+        LOGD("%s() Registration changed meanwhile, not cached", __func__);
+    pthread_mutex_unlock(&s_operatorCache.mutex);
 
-finally:
     at_response_free(atresponse);
-    return;
+    return 0;
 
 error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    goto finally;
+    at_response_free(atresponse);
+    return -1;
 }
 
 /**
- * RIL_REQUEST_NEIGHBORINGCELL_IDS
+ * Refreshes operator and signal strength in one go on screen on, so
+ * that the queries the framework makes right after are answered from
+ * fresh data.
  */
-void requestNeighboringCellIDs(void *data, size_t datalen, RIL_Token t)
+void prefetchNetworkState(void)
 {
-    (void) data; (void) datalen;
-    int network = -1;
-    int dummy = 0;
-    char *dummyStr = NULL;
-    int err = 0;
-    ATResponse *cops_resp = NULL;
-    char *line = NULL;
-
-    /* Determine network radio access technology (AcT) */
-    err = at_send_command_singleline("AT+COPS?", "+COPS:", &cops_resp);
-    if (err < 0 || cops_resp->success == 0) goto error;
-
-    line = cops_resp->p_intermediates->line;
-
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
-    /* Mode */
-    err = at_tok_nextint(&line, &dummy);
-    if (err < 0) goto error;
-    /* Check to see if not registered */
-    if (!at_tok_hasmore(&line)) {
-        No_NCIs(t);
-        goto finally;
-    }
-    /* Format */
-    err = at_tok_nextint(&line, &dummy);
-    if (err < 0) goto error;
-    /* Operator */
-    err = at_tok_nextstr(&line, &dummyStr);
-    if (err < 0) goto error;
-    /* Network */
-    err = at_tok_nextint(&line, &network);
-    if (err < 0) goto error;
-
-    switch (network) {
-    case 0:                    /* GSM (GPRS,2G)*/
-    case 3:                    /* GSM w/EGPRS (EDGE, 2.75G)*/
-        Get_GSM_NCIs(t);
-        break;
-    case 1:                    /* GSM Compact (Not supported)*/
-        goto error;
-        break;
-    case 2:                    /* UTRAN (WCDMA/UMTS, 3G)*/
-    case 4:                    /* UTRAN w/HSDPA (HSDPA,3G)*/
-    case 5:                    /* UTRAN w/HSUPA (HSUPA,3G)*/
-    case 6:                    /* UTRAN w/HSDPA and HSUPA (HSPA,3G)*/
-        Get_WCDMA_NCIs(t);
-        break;
-    default:
-        goto error;
-    }
-
-finally:
-    at_response_free(cops_resp);
-    return;
+    if (queryOperator(NULL) < 0)
+        LOGW("%s() Failed to prefetch operator", __func__);
 
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    goto finally;
+    pollSignalStrength((void *)-1);
 }
 
 /**
- * GSM Network (GPRS, 2G) Neighborhood Cell IDs
+ * RIL_REQUEST_OPERATOR
+ *
+ * Request current operator ONS or EONS. Answered from the cache while
+ * it is younger than OPERATOR_CACHE_TTL_SEC and no registration change
+ * has been reported since.
  */
-void Get_GSM_NCIs(RIL_Token t)
+void requestOperator(void *data, size_t datalen, RIL_Token t)
 {
-    int err = 0;
-    char *p = NULL;
-    int n = 0;
-    ATLine *tmp = NULL;
-    ATResponse *gnci_resp = NULL;
-    RIL_NeighboringCell *ptr_cells[MAX_NUM_NEIGHBOR_CELLS];
-
-    err = at_send_command_multiline("AT*EGNCI", "*EGNCI:", &gnci_resp);
-    if (err < 0 ||
-        gnci_resp->success == 0 || gnci_resp->p_intermediates == NULL)
-        goto error;
+    (void) data; (void) datalen;
+    char *names[OPERATOR_NUM_NAMES];
+    struct timespec now;
+    int i;
 
-    tmp = gnci_resp->p_intermediates;
-    while (tmp) {
-        if (n > MAX_NUM_NEIGHBOR_CELLS)
-            goto error;
-        p = tmp->line;
-        if (*p == '*') {
-            char *line = p;
-            char *plmn = NULL;
-            char *lac = NULL;
-            char *cid = NULL;
-            int arfcn = 0;
-            int bsic = 0;
-            int rxlvl = 0;
-            int ilac = 0;
-            int icid = 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-            err = at_tok_start(&line);
-            if (err < 0) goto error;
-            /* PLMN */
-            err = at_tok_nextstr(&line, &plmn);
-            if (err < 0) goto error;
-            /* LAC */
-            err = at_tok_nextstr(&line, &lac);
-            if (err < 0) goto error;
-            /* CellID */
-            err = at_tok_nextstr(&line, &cid);
-            if (err < 0) goto error;
-            /* ARFCN */
-            err = at_tok_nextint(&line, &arfcn);
-            if (err < 0) goto error;
-            /* BSIC */
-            err = at_tok_nextint(&line, &bsic);
-            if (err < 0) goto error;
-            /* RxLevel */
-            err = at_tok_nextint(&line, &rxlvl);
-            if (err < 0) goto error;
-
-            /* process data for each cell */
-            ptr_cells[n] = alloca(sizeof(RIL_NeighboringCell));
-            ptr_cells[n]->rssi = rxlvl;
-            ptr_cells[n]->cid = alloca(9 * sizeof(char));
-            sscanf(lac,"%x",&ilac);
-            sscanf(cid,"%x",&icid);
-            sprintf(ptr_cells[n]->cid, "%08x", ((ilac << 16) + icid));
-            n++;
-        }
-        tmp = tmp->p_next;
+    pthread_mutex_lock(&s_operatorCache.mutex);
+    if (s_operatorCache.valid &&
+        timespecDiffMsec(&s_operatorCache.timestamp, &now) <
+        OPERATOR_CACHE_TTL_SEC * 1000) {
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, s_operatorCache.names,
+                              sizeof(s_operatorCache.names));
+        pthread_mutex_unlock(&s_operatorCache.mutex);
+        return;
     }
+    pthread_mutex_unlock(&s_operatorCache.mutex);
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, ptr_cells,
-                          n * sizeof(RIL_NeighboringCell *));
-
-finally:
-    at_response_free(gnci_resp);
-    return;
-
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    goto finally;
-}
-
-/**
- * WCDMA Network (UTMS, 3G) Neighborhood Cell IDs
- */
-void Get_WCDMA_NCIs(RIL_Token t)
-{
-    int err = 0;
-    char *p = NULL;
-    int n = 0;
-    ATLine *tmp = NULL;
-    ATResponse *wnci_resp = NULL;
-    RIL_NeighboringCell *ptr_cells[MAX_NUM_NEIGHBOR_CELLS];
-
-    err = at_send_command_multiline("AT*EWNCI", "*EWNCI:", &wnci_resp);
-    if (err < 0 || wnci_resp->success == 0)
+    /*
+     * Answer with the names read, as a registration change may clear the
+     * cache as soon as they are stored.
+     */
+    memset(names, 0, sizeof(names));
+    if (queryOperator(names) < 0)
         goto error;
 
-    tmp = wnci_resp->p_intermediates;
-    while (tmp) {
-        if (n > MAX_NUM_NEIGHBOR_CELLS)
-            goto error;
-        p = tmp->line;
-        if (*p == '*') {
-            char *line = p;
-            int uarfcn = 0;
-            int psc = 0;
-            int rscp = 0;
-            int ecno = 0;
-            int pathloss = 0;
-
-            err = at_tok_start(&line);
-            if (err < 0) goto error;
-            /* UARFCN */
-            err = at_tok_nextint(&line, &uarfcn);
-            if (err < 0) goto error;
-            /* PSC */
-            err = at_tok_nextint(&line, &psc);
-            if (err < 0) goto error;
-            /* RSCP */
-            err = at_tok_nextint(&line, &rscp);
-            if (err < 0) goto error;
-            /* ECNO */
-            err = at_tok_nextint(&line, &ecno);
-            if (err < 0) goto error;
-            /* PathLoss */
-            err = at_tok_nextint(&line, &pathloss);
-            if (err < 0) goto error;
-
-            /* process data for each cell */
-            ptr_cells[n] = alloca(sizeof(RIL_NeighboringCell));
-            ptr_cells[n]->rssi = rscp;
-            ptr_cells[n]->cid = alloca(9 * sizeof(char));
-            sprintf(ptr_cells[n]->cid, "%08x", psc);
-            n++;
-        }
-        tmp = tmp->p_next;
-    }
-
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, ptr_cells,
-                          n * sizeof(RIL_NeighboringCell *));
-
-finally:
-    at_response_free(wnci_resp);
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, names, sizeof(names));
+    for (i = 0; i < OPERATOR_NUM_NAMES; i++)
+        free(names[i]);
     return;
 
 error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    goto finally;
-}
-
-/* Not registered or unknown network (NOT UTMS or 3G)
- * return UNKNOWN_RSSI and UNKNOWN_CID */
-void No_NCIs(RIL_Token t)
-{
-    int n = 0;
-
-    RIL_NeighboringCell *ptr_cells[MAX_NUM_NEIGHBOR_CELLS];
-
-    ptr_cells[n] = alloca(sizeof(RIL_NeighboringCell));
-    ptr_cells[n]->rssi = 99;
-    ptr_cells[n]->cid = alloca(9 * sizeof(char));
-    sprintf(ptr_cells[n]->cid, "%08x", -1);
-
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, ptr_cells,
-                          n * sizeof(RIL_NeighboringCell *));
-
-    return;
 }
-
@@ -29,6 +29,7 @@
 void onNetworkTimeReceived(const char *s);
 void onSignalStrengthChanged(const char *s);
 void onNetworkStatusChanged(const char *s);
+void onNetworkRegistrationChanged(const char *s);
 int getPreferredNetworkType(void);
 int getPreferredNetworkType(void);
 void requestSetNetworkSelectionAutomatic(void *data, size_t datalen,
@@ -53,11 +54,10 @@ void requestGprsRegistrationState(int request, void *data,
 void requestOperator(void *data, size_t datalen, RIL_Token t);
 void requestRadioPower(void *data, size_t datalen, RIL_Token t);
 void pollSignalStrength(void *bar);
+void prefetchNetworkState(void);
 void sendTime(void *p);
-void requestNeighboringCellIDs(void *data, size_t datalen, RIL_Token t);
 
-void Get_GSM_NCIs(RIL_Token t);
-void Get_WCDMA_NCIs(RIL_Token t);
-void No_NCIs(RIL_Token t);
+struct oemDiagnostics;
+void clockDiagnostics(struct oemDiagnostics *diag);
 
 #endif
@@ -22,10 +22,18 @@
 */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <telephony/ril.h>
 #include "u300-ril.h"
+#include "u300-ril-oem.h"
+#include "u300-ril-cellinfo.h"
+#include "u300-ril-datamon.h"
+#include "u300-ril-network.h"
+#include "u300-ril-pdp.h"
+#include "u300-ril-sim.h"
 #include "atchannel.h"
 #include "at_tok.h"
+#include "misc.h"
 
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
@@ -45,6 +53,75 @@ void requestOEMHookRaw(void *data, size_t datalen, RIL_Token t)
 }
 #endif
 
+static const struct {
+    const char *name;
+    void (*dump)(struct oemDiagnostics *diag);
+} s_diagnostics[] = {
+    { "CELLINFO", cellInfoDiagnostics },
+    { "CLOCK", clockDiagnostics },
+    { "DATA", dataMonitorDiagnostics },
+    { "PDP", pdpDiagnostics },
+    { "SIM", simDiagnostics },
+};
+
+/**
+ * Appends a formatted line to the diagnostics response.
+ */
+void oemDiagPrintf(struct oemDiagnostics *diag, const char *fmt, ...)
+{
+    va_list ap;
+    char *line = NULL;
+
+    if (diag->count == diag->size) {
+        int size = diag->size ? diag->size * 2 : 16;
+        char **lines = realloc(diag->lines, size * sizeof(char *));
+
+        if (lines == NULL)
+            return;
+        diag->lines = lines;
+        diag->size = size;
+    }
+
+    va_start(ap, fmt);
+    if (vasprintf(&line, fmt, ap) < 0)
+        line = NULL;
+    va_end(ap);
+
+    if (line != NULL)
+        diag->lines[diag->count++] = line;
+}
+
+/**
+ * Returns the lines of the diagnostics named in an OEM_DIAG_PREFIX
+ * request, or "LIST" for the names of all diagnostics.
+ */
+static void requestOEMDiagnostics(const char *name, RIL_Token t)
+{
+    struct oemDiagnostics diag = { NULL, 0, 0 };
+    unsigned int i;
+    int found = 0;
+
+    for (i = 0; i < NUM_ELEMS(s_diagnostics); i++) {
+        if (strcmp(name, "LIST") == 0)
+            oemDiagPrintf(&diag, "%s", s_diagnostics[i].name);
+        else if (strcmp(name, s_diagnostics[i].name) == 0) {
+            s_diagnostics[i].dump(&diag);
+            found = 1;
+        }
+    }
+
+    if (!found && strcmp(name, "LIST") != 0) {
+        LOGW("%s() Unknown diagnostics %s", __func__, name);
+        RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
+    } else
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, diag.lines,
+                              diag.count * sizeof(char *));
+
+    for (i = 0; i < (unsigned int) diag.count; i++)
+        free(diag.lines[i]);
+    free(diag.lines);
+}
+
 /**
  * RIL_REQUEST_OEM_HOOK_STRINGS
  *
@@ -69,6 +146,14 @@ void requestOEMHookStrings(void *data, size_t datalen, RIL_Token t)
 
     /* Only take the first string in the array for now */
     cur = (const char **) data;
+    if (cur == NULL || *cur == NULL)
+        goto error;
+
+    if (strStartsWith(*cur, OEM_DIAG_PREFIX)) {
+        requestOEMDiagnostics(*cur + strlen(OEM_DIAG_PREFIX), t);
+        return;
+    }
+
     err = at_send_command_raw(*cur, &atresponse);
 
     if ((err != AT_NOERROR && at_get_error_type(err) == AT_ERROR)
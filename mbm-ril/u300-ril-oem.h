@@ -24,6 +24,20 @@
 #ifndef U300_RIL_OEM_H
 #define U300_RIL_OEM_H 1
 
+/*
+ * OEM_HOOK_STRINGS requests starting with OEM_DIAG_PREFIX are not sent
+ * to the modem, "MBM:<name>" returns the lines of diagnostics <name>.
+ */
+#define OEM_DIAG_PREFIX "MBM:"
+
+struct oemDiagnostics {
+    char **lines;
+    int count;
+    int size;
+};
+
+void oemDiagPrintf(struct oemDiagnostics *diag, const char *fmt, ...);
+
 void requestOEMHookRaw(void *data, size_t datalen, RIL_Token t);
 void requestOEMHookStrings(void *data, size_t datalen, RIL_Token t);
 
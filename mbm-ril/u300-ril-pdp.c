@@ -37,253 +37,724 @@
 #include <cutils/properties.h>
 #include "u300-ril-error.h"
 #include "u300-ril-pdp.h"
+#include "u300-ril-oem.h"
+#include "u300-ril-datamon.h"
 
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
 
 #include "u300-ril.h"
 #include "net-utils.h"
+#include "hexcodec.h"
 
 #define getNWType(data) ((data) ? (data) : "IP")
 
-/* Allocate and create an UCS-2 format string */
-static char *ucs2StringCreate(const char *String);
-
 /* Last pdp fail cause */
 static int s_lastPdpFailCause = PDP_FAIL_ERROR_UNSPECIFIED;
 
-#define MBM_ENAP_WAIT_TIME 17*5	/* loops to wait CONNECTION aprox 17s */
+#define MBM_ENAP_WAIT_TIME_MSEC (17 * 1000) /* wait CONNECTION aprox 17s */
+
+/* Interval the E2NAP state used to be polled at, for comparison */
+#define MBM_ENAP_POLL_INTERVAL_MSEC 200
+
+#define E2NAP_STATE_MASK(state) (1 << (state))
+
+/* Interface MTU to set at connect, 0 keeps the current one. */
+#define PROPERTY_MTU "mbm.ril.mtu"
+
+/* APN of the last successful data call, pre-staged at SIM ready. */
+#define PROPERTY_LAST_APN "persist.mbm.ril.last_apn"
+
+/* Room for the addresses *E2IPCFG reports of one kind. */
+#define IPCFG_LIST_LEN (3 * INET6_ADDRSTRLEN)
+
+enum {
+    IPCFG_IP = 1,
+    IPCFG_GATEWAY,
+    IPCFG_DNS
+};
+
+/* Space separated address lists as reported to the framework. */
+struct ipConfig {
+    int valid;
+    in_addr_t addr;
+    in_addr_t gateway;
+    char addresses[IPCFG_LIST_LEN];
+    char gateways[IPCFG_LIST_LEN];
+    char dnses[IPCFG_LIST_LEN];
+};
+
+/*
+ * A data call: a CID with a network interface of its own. *E2NAP
+ * carries no CID, so its reports go to the context with an AT*ENAP in
+ * flight, or to the only one configured. Guarded by s_e2nap_mutex.
+ */
+struct pdpContext {
+    int cid;
+    char *ifname;
+    int inUse;
+    int e2napState;
+    int e2napCause;
+
+    /* *E2IPCFG captured at connect, dropped on each *E2NAP transition */
+    struct ipConfig ipConfig;
+    unsigned int ipConfigGeneration;
+
+    /* What AT+CGDCONT and AT*EIAAUW have last provisioned */
+    int apnValid;
+    char *apn;
+    int authValid;
+    char *user;
+    char *pass;
+    char *auth;
+
+    unsigned int setups;
+    unsigned int setupFailures;
+    unsigned int teardowns;
+
+    /* RIL_REQUEST_DEACTIVATE_DATA_CALL waiting for *E2NAP disconnected */
+    int teardownPending;
+    RIL_Token teardownToken;
+    struct timespec teardownStart;
+    struct timespec teardownDisconnected;
+    int teardownConnected;
+};
 
 static pthread_mutex_t s_e2nap_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int s_e2napState = -1;
-static int s_e2napCause = -1;
+static pthread_cond_t s_e2nap_cond = PTHREAD_COND_INITIALIZER;
+static struct pdpContext s_contexts[MAX_PDP_CONTEXTS];
+static int s_numContexts = 0;
 
-static int parse_ip_information(char** addresses, char** gateways, char** dnses, in_addr_t* addr, in_addr_t* gateway)
-{
-    ATResponse* p_response = NULL;
+/*
+ * Index of the context with an AT*ENAP in flight, -1 if none. A
+ * teardown keeps it until its *E2NAP disconnected arrives.
+ */
+static int s_e2napOwner = -1;
 
-    int err = -1;
-    int number_of_entries = 0;
-    int iterator = 0;
-    int dnscnt = 0;
-    char *intermediate_line = NULL;
-    char *line_origin = NULL;
+/* An *E2NAP report could not be attributed, resync with AT+CGACT?. */
+static int s_e2napResync = 0;
 
-    *addresses = NULL;
-    *gateways = NULL;
-    *dnses = NULL;
+static unsigned int s_ipConfigQueries;
+static unsigned int s_ipConfigHits;
 
-    enum {
-        IP = 1,
-        GATEWAY,
-        DNS
-    };
+/*
+ * *E2NAP reports within DATA_CALL_LIST_DEBOUNCE_PROPERTY milliseconds
+ * are folded into one data call list update, which is only sent when
+ * it differs from the last list the framework got.
+ */
+#define DATA_CALL_LIST_DEBOUNCE_PROPERTY "mbm.ril.datacall.debounce"
+#define DEFAULT_DATA_CALL_LIST_DEBOUNCE_MSEC 500
+
+struct dataCallEntry {
+    int active;
+    char addresses[IPCFG_LIST_LEN];
+    char gateways[IPCFG_LIST_LEN];
+    char dnses[IPCFG_LIST_LEN];
+};
+
+static struct dataCallEntry s_lastDataCalls[MAX_PDP_CONTEXTS];
+static int s_lastDataCallsValid = 0;
+static int s_listUpdatePending = 0;
+static unsigned int s_listUpdateCoalesced = 0;  /* in the pending update */
+
+static unsigned int s_listReports;      /* *E2NAP reports asking for one */
+static unsigned int s_listCoalesced;    /* folded into a pending update */
+static unsigned int s_listUnchanged;    /* not sent, nothing changed */
+static unsigned int s_listSent;
+static unsigned int s_listAtCommands;   /* sent to build updates */
+static unsigned int s_listAtSaved;      /* estimated from the coalesced */
+static unsigned int s_apnSkipped;
+static unsigned int s_authSkipped;
+
+/* Phases of requestSetupDefaultPDP(), traced by setupPhase(). */
+enum {
+    SETUP_PHASE_CGDCONT,
+    SETUP_PHASE_AUTH,
+    SETUP_PHASE_ENAP,
+    SETUP_PHASE_E2NAP,
+    SETUP_PHASE_E2IPCFG,
+    SETUP_PHASE_IFC_CONFIGURE,
+    SETUP_PHASE_ABORT,
+    SETUP_PHASE_IFC_DOWN,
+    SETUP_PHASES
+};
+
+static const char *s_setupPhaseNames[SETUP_PHASES] = {
+    "cgdcont",          /* AT+CGDCONT */
+    "auth",             /* AT+CSCS and AT*EIAAUW */
+    "enap",             /* AT*ENAP=1 */
+    "e2nap",            /* waiting for *E2NAP connected */
+    "e2ipcfg",          /* AT*E2IPCFG? */
+    "ifc_configure",
+    "abort",            /* AT*ENAP=0 and waiting for disconnected */
+    "ifc_deconfigure"
+};
+
+struct setupTrace {
+    int phase;
+    struct timespec mark;
+};
+
+static struct latencyHistogram s_setupPhaseLatency[SETUP_PHASES];
+
+/*
+ * Time from AT*ENAP=1 to *E2NAP connected or disconnected as the
+ * former 200 ms polling loop would have seen it.
+ */
+static struct latencyHistogram s_e2napPolledLatency;
 
-    /* *E2IPCFG:
-     *  (1,"10.155.68.129")(2,"10.155.68.131")(3,"80.251.192.244")(3,"80.251.192.245")
-     */
-    err = at_send_command_singleline("AT*E2IPCFG?", "*E2IPCFG:", &p_response);
-    if (err != AT_NOERROR)
-        return -1;
+/* Failed setups by the phase failing and by E2NAP cause, -1 last. */
+static unsigned int s_setupFailPhases[SETUP_PHASES];
+static unsigned int s_setupFailCauses[E2NAP_C_MAXIMUM + 2];
 
-    err = at_tok_charcounter(p_response->p_intermediates->line, '(',
-            &number_of_entries);
-    if (err < 0 || number_of_entries == 0) {
-        LOGE("%s() Syntax error. Could not parse output", __func__);
-        goto error;
+/*
+ * Complete setups and teardowns, indexed by the number of other
+ * contexts that were connected meanwhile.
+ */
+static struct latencyHistogram s_setupLatency[MAX_PDP_CONTEXTS];
+static struct latencyHistogram s_teardownLatency[MAX_PDP_CONTEXTS];
+
+/* Teardowns split into AT*ENAP=0 to *E2NAP and taking the link down. */
+static struct latencyHistogram s_teardownE2napLatency;
+static struct latencyHistogram s_teardownIfcLatency;
+static unsigned int s_teardownTimeouts;
+static unsigned int s_ownerWaits;       /* AT*ENAP behind a teardown */
+
+/*
+ * Retry time suggested with a failed setup. Rejects the network will
+ * repeat until something is changed back off from a minute to half
+ * an hour, others from two seconds to five minutes, halved at random.
+ * The failure streak of an APN is forgotten after a success or after
+ * RETRY_STREAK_RESET_MSEC without failures.
+ */
+#define RETRY_TRANSIENT_BASE_MSEC (2 * 1000)
+#define RETRY_TRANSIENT_MAX_MSEC (5 * 60 * 1000)
+#define RETRY_PERMANENT_BASE_MSEC (60 * 1000)
+#define RETRY_PERMANENT_MAX_MSEC (30 * 60 * 1000)
+#define RETRY_STREAK_RESET_MSEC (10 * 60 * 1000)
+
+struct retryHistory {
+    char *apn;
+    int failures;
+    struct timespec lastFailure;
+};
+
+static struct retryHistory s_retryHistory[MAX_PDP_CONTEXTS];
+static unsigned int s_retrySeed;
+static unsigned int s_retryTransient;   /* failures given a backoff */
+static unsigned int s_retryPermanent;
+static unsigned int s_retriedSetups;    /* setups following a failure */
+static int s_lastRetryTime = -1;
+
+/**
+ * Configures one context per interface in the comma separated list
+ * ifaces, with CIDs counting up from RIL_CID_IP.
+ */
+void initPDPContexts(const char *ifaces)
+{
+    char *list = strdup(ifaces);
+    char *next = list;
+    char *ifname;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    while ((ifname = strsep(&next, ",")) != NULL) {
+        struct pdpContext *ctx;
+
+        if (*ifname == '\0')
+            continue;
+        if (s_numContexts == MAX_PDP_CONTEXTS) {
+            LOGW("%s() Ignoring interface %s, at most %d contexts",
+                 __func__, ifname, MAX_PDP_CONTEXTS);
+            continue;
+        }
+
+        ctx = &s_contexts[s_numContexts];
+        ctx->cid = RIL_CID_IP + s_numContexts;
+        ctx->ifname = strdup(ifname);
+        ctx->e2napState = -1;
+        ctx->e2napCause = -1;
+        LOGD("%s() CID %d on %s", __func__, ctx->cid, ctx->ifname);
+        s_numContexts++;
     }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    free(list);
+}
+
+static struct pdpContext *findContext(int cid)
+{
+    int i;
+
+    for (i = 0; i < s_numContexts; i++)
+        if (s_contexts[i].cid == cid)
+            return &s_contexts[i];
 
-    intermediate_line = p_response->p_intermediates->line;
+    return NULL;
+}
+
+/* Must be called with s_e2nap_mutex held. */
+static int countConnectedContexts(void)
+{
+    int i, n = 0;
 
-    /* Loop and collect information */
-    for (iterator = 0; iterator < number_of_entries; iterator++) {
-        int stat = 0;
-        char *line_tok = NULL;
-        char *address = NULL;
-        char *remaining_intermediate_line = NULL;
-        char* tmp_pointer = NULL;
+    for (i = 0; i < s_numContexts; i++)
+        if (s_contexts[i].e2napState == E2NAP_ST_CONNECTED)
+            n++;
 
-        line_origin = line_tok = getFirstElementValue(intermediate_line,
-                "(", ")", &remaining_intermediate_line);
-        intermediate_line = remaining_intermediate_line;
+    return n;
+}
+
+/* Must be called with s_e2nap_mutex held. */
+static void setContextState(struct pdpContext *ctx, int state, int cause)
+{
+    ctx->e2napState = state;
+    ctx->e2napCause = cause;
+    ctx->ipConfig.valid = 0;
+    ctx->ipConfigGeneration++;
+}
 
-        if (line_tok == NULL) {
-            LOGD("%s: No more connection info", __func__);
+/** Claims a context for a new data call, NULL if all are in use. */
+static struct pdpContext *claimContext(void)
+{
+    struct pdpContext *ctx = NULL;
+    int i;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (i = 0; i < s_numContexts; i++)
+        if (!s_contexts[i].inUse) {
+            ctx = &s_contexts[i];
+            ctx->inUse = 1;
+            setContextState(ctx, -1, -1);
             break;
         }
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
-        /* <stat> */
-        err = at_tok_nextint(&line_tok, &stat);
-        if (err < 0) {
-            goto error;
+    return ctx;
+}
+
+static void releaseContext(struct pdpContext *ctx)
+{
+    pthread_mutex_lock(&s_e2nap_mutex);
+    ctx->inUse = 0;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+}
+
+/**
+ * Ends the running phase of trace, adding its duration to the phase
+ * histogram, and starts phase, or none if -1. Returns the duration.
+ */
+static long long setupPhase(struct setupTrace *trace, int phase)
+{
+    struct timespec now;
+    long long elapsed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (trace->phase >= 0) {
+        elapsed = timespecDiffMsec(&trace->mark, &now);
+        pthread_mutex_lock(&s_e2nap_mutex);
+        latencyHistogramAdd(&s_setupPhaseLatency[trace->phase], elapsed);
+        pthread_mutex_unlock(&s_e2nap_mutex);
+    }
+
+    trace->phase = phase;
+    trace->mark = now;
+    return elapsed;
+}
+
+/*
+ * Makes ctx the context *E2NAP reports go to. Waits for a teardown of
+ * another context still owning them, up to MBM_ENAP_WAIT_TIME_MSEC.
+ */
+static void setE2napOwner(struct pdpContext *ctx)
+{
+    int index = ctx ? ctx - s_contexts : -1;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    if (index >= 0 && s_e2napOwner >= 0 && s_e2napOwner != index) {
+        struct timespec start, now;
+        long long remaining = MBM_ENAP_WAIT_TIME_MSEC;
+
+        s_ownerWaits++;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (s_e2napOwner >= 0 && s_e2napOwner != index &&
+               remaining > 0) {
+            pthread_cond_timeout_np(&s_e2nap_cond, &s_e2nap_mutex,
+                                    (unsigned) remaining);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = MBM_ENAP_WAIT_TIME_MSEC -
+                timespecDiffMsec(&start, &now);
         }
+        if (s_e2napOwner >= 0 && s_e2napOwner != index)
+            LOGW("%s() CID %d still owns *E2NAP, taking over", __func__,
+                 s_contexts[s_e2napOwner].cid);
+    }
+    s_e2napOwner = index;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+}
+
+static int getContextState(struct pdpContext *ctx)
+{
+    int state;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    state = ctx->e2napState;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return state;
+}
+
+/**
+ * Waits up to timeoutMsec for onConnectionStateChanged() to report one
+ * of the E2NAP states in stateMask for ctx and returns the state it
+ * ended in.
+ */
+static int waitForContextState(struct pdpContext *ctx, int stateMask,
+                               long long timeoutMsec)
+{
+    struct timespec start, now;
+    long long remaining = timeoutMsec;
+    int state;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    while ((ctx->e2napState < 0 ||
+            !(stateMask & E2NAP_STATE_MASK(ctx->e2napState))) &&
+           remaining > 0) {
+        pthread_cond_timeout_np(&s_e2nap_cond, &s_e2nap_mutex,
+                                (unsigned) remaining);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining = timeoutMsec - timespecDiffMsec(&start, &now);
+    }
+    state = ctx->e2napState;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return state;
+}
+
+/* AT*ENAP=0 takes the CID only when several contexts are configured. */
+static int sendEnapDisconnect(struct pdpContext *ctx)
+{
+    if (s_numContexts > 1)
+        return at_send_command("AT*ENAP=0,%d", ctx->cid);
 
-        /* <address> */
-        err = at_tok_nextstr(&line_tok, &address);
-        if (err < 0) {
+    return at_send_command("AT*ENAP=0");
+}
+
+static void appendAddress(char *list, size_t size, const char *address)
+{
+    size_t len = strlen(list);
+
+    if (len + (len ? 1 : 0) + strlen(address) + 1 > size) {
+        LOGW("%s() Dropping address %s", __func__, address);
+        return;
+    }
+    if (len)
+        list[len++] = ' ';
+    strcpy(list + len, address);
+}
+
+/*
+ * Parses an *E2IPCFG response in a single pass, without allocating:
+ *  (1,"10.155.68.129")(2,"10.155.68.131")(3,"80.251.192.244")(3,"80.251.192.245")
+ */
+static int parseIpConfig(const char *line, struct ipConfig *cfg)
+{
+    const char *p = line;
+    int dnscnt = 0;
+
+    memset(cfg, 0, sizeof(*cfg));
+
+    while ((p = strchr(p, '(')) != NULL) {
+        char address[INET6_ADDRSTRLEN];
+        const char *end;
+        char *next;
+        long stat;
+        size_t len;
+
+        stat = strtol(p + 1, &next, 10);
+        if (next == p + 1)
             goto error;
-        }
+
+        /* <stat>,"<address>" */
+        p = next;
+        while (*p == ',' || *p == ' ')
+            p++;
+        if (*p++ != '"')
+            goto error;
+        end = strchr(p, '"');
+        if (end == NULL || (len = end - p) >= sizeof(address))
+            goto error;
+        memcpy(address, p, len);
+        address[len] = '\0';
+        p = end + 1;
 
         switch (stat % 10) {
-        case IP:
-            if (!*addresses)
-                *addresses = strdup(address);
-            else {
-                tmp_pointer = realloc(*addresses,
-                        strlen(address) + strlen(*addresses) + 1);
-                if (NULL == tmp_pointer) {
-                    LOGE("%s() Failed to allocate memory for addresses", __func__);
-                    goto error;
-                }
-                *addresses = tmp_pointer;
-                sprintf(*addresses, "%s %s", *addresses, address);
-            }
+        case IPCFG_IP:
             LOGD("%s() IP Address: %s", __func__, address);
-            if (inet_pton(AF_INET, address, addr) <= 0) {
+            if (inet_pton(AF_INET, address, &cfg->addr) <= 0) {
                 LOGE("%s() inet_pton() failed for %s!", __func__, address);
                 goto error;
             }
+            appendAddress(cfg->addresses, sizeof(cfg->addresses), address);
             break;
 
-        case GATEWAY:
-            if (!*gateways)
-                *gateways = strdup(address);
-            else {
-                tmp_pointer = realloc(*gateways,
-                        strlen(address) + strlen(*gateways) + 1);
-                if (NULL == tmp_pointer) {
-                    LOGE("%s() Failed to allocate memory for gateways", __func__);
-                    goto error;
-                }
-                *gateways = tmp_pointer;
-                sprintf(*gateways, "%s %s", *gateways, address);
-            }
+        case IPCFG_GATEWAY:
             LOGD("%s() GW: %s", __func__, address);
-            if (inet_pton(AF_INET, address, gateway) <= 0) {
+            if (inet_pton(AF_INET, address, &cfg->gateway) <= 0) {
                 LOGE("%s() Failed inet_pton for gw %s!", __func__, address);
                 goto error;
             }
+            appendAddress(cfg->gateways, sizeof(cfg->gateways), address);
             break;
 
-        case DNS:
+        case IPCFG_DNS:
             dnscnt++;
             LOGD("%s() DNS%d: %s", __func__, dnscnt, address);
-            if (dnscnt == 1)
-                *dnses = strdup(address);
-            else if (dnscnt == 2) {
-                tmp_pointer = realloc(*dnses,
-                        strlen(address) + strlen(*dnses) + 1);
-                if (NULL == tmp_pointer) {
-                    LOGE("%s() Failed to allocate memory for dnses", __func__);
-                    goto error;
-                }
-                *dnses = tmp_pointer;
-                sprintf(*dnses, "%s %s", *dnses, address);
-            }
+            if (dnscnt <= 2)
+                appendAddress(cfg->dnses, sizeof(cfg->dnses), address);
             break;
         }
-        free(line_origin);
-        line_origin = NULL;
     }
 
-    at_response_free(p_response);
+    if (cfg->addresses[0] == '\0') {
+        LOGE("%s() Syntax error. Could not parse output", __func__);
+        goto error;
+    }
+
+    cfg->valid = 1;
     return 0;
 
 error:
-
-    free(line_origin);
-    free(*addresses);
-    free(*gateways);
-    free(*dnses);
-    at_response_free(p_response);
-
-    *gateways = NULL;
-    *addresses = NULL;
-    *dnses = NULL;
+    memset(cfg, 0, sizeof(*cfg));
     return -1;
 }
 
-void requestOrSendPDPContextList(RIL_Token *token)
+/** Reads the IP configuration of the connection from the modem. */
+static int queryIpConfig(struct ipConfig *cfg)
 {
-    ATResponse *atresponse = NULL;
-    RIL_Data_Call_Response_v6 response;
-    int e2napState = getE2napState();
+    ATResponse *p_response = NULL;
     int err;
-    int cid;
-    char *line, *apn, *type;
-    char* addresses = NULL;
-    char* dnses = NULL;
-    char* gateways = NULL;
-    in_addr_t addr;
-    in_addr_t gateway;
 
-    memset(&response, 0, sizeof(response));
-    response.ifname = ril_iface;
+    err = at_send_command_singleline("AT*E2IPCFG?", "*E2IPCFG:", &p_response);
+    if (err != AT_NOERROR)
+        return -1;
 
-    err = at_send_command_multiline("AT+CGDCONT?", "+CGDCONT:", &atresponse);
+    err = parseIpConfig(p_response->p_intermediates->line, cfg);
+    at_response_free(p_response);
+    return err;
+}
 
-    if (err != AT_NOERROR)
-        goto error;
+/**
+ * Queries the IP configuration of ctx and keeps it unless its state
+ * changed meanwhile.
+ */
+static int captureIpConfig(struct pdpContext *ctx, struct ipConfig *cfg)
+{
+    unsigned int generation;
 
-    line = atresponse->p_intermediates->line;
-    err = at_tok_start(&line);
-    if (err < 0)
-        goto error;
+    pthread_mutex_lock(&s_e2nap_mutex);
+    generation = ctx->ipConfigGeneration;
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
-    err = at_tok_nextint(&line, &cid);
-    if (err < 0)
-        goto error;
+    if (queryIpConfig(cfg) < 0)
+        return -1;
 
-    response.cid = cid;
+    pthread_mutex_lock(&s_e2nap_mutex);
+    s_ipConfigQueries++;
+    if (generation == ctx->ipConfigGeneration &&
+        ctx->e2napState == E2NAP_ST_CONNECTED)
+        ctx->ipConfig = *cfg;
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
-    if (e2napState == E2NAP_ST_CONNECTED)
-        response.active = 1;
+    return 0;
+}
 
-    err = at_tok_nextstr(&line, &type);
-    if (err < 0)
-        goto error;
+/**
+ * Returns the IP configuration captured for ctx, querying the modem
+ * at most once per *E2NAP connected transition. *E2IPCFG has no CID,
+ * so it is only queried here while ctx is the one connected context.
+ * Otherwise cfg->valid is 0 unless a configuration was captured.
+ */
+static int getIpConfig(struct pdpContext *ctx, struct ipConfig *cfg)
+{
+    pthread_mutex_lock(&s_e2nap_mutex);
+    if (ctx->ipConfig.valid || ctx->e2napState != E2NAP_ST_CONNECTED ||
+        countConnectedContexts() > 1) {
+        *cfg = ctx->ipConfig;
+        if (ctx->ipConfig.valid)
+            s_ipConfigHits++;
+        pthread_mutex_unlock(&s_e2nap_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
-    response.type = alloca(strlen(type) + 1);
-    strcpy(response.type, type);
+    return captureIpConfig(ctx, cfg);
+}
 
-    err = at_tok_nextstr(&line, &apn);
-    if (err < 0)
-        goto error;
+/**
+ * Updates contexts from AT+CGACT? after an *E2NAP report that could not
+ * be attributed, typically a network initiated disconnect.
+ */
+static void resyncContexts(void)
+{
+    ATResponse *p_response = NULL;
+    ATLine *cursor;
+    int err;
+
+    err = at_send_command_multiline("AT+CGACT?", "+CGACT:", &p_response);
+    if (err != AT_NOERROR)
+        goto finally;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (cursor = p_response->p_intermediates; cursor != NULL;
+         cursor = cursor->p_next) {
+        struct pdpContext *ctx;
+        char *line = cursor->line;
+        int cid, active;
+
+        if (at_tok_start(&line) < 0 || at_tok_nextint(&line, &cid) < 0 ||
+            at_tok_nextint(&line, &active) < 0)
+            continue;
+
+        ctx = findContext(cid);
+        if (ctx == NULL || ctx - s_contexts == s_e2napOwner)
+            continue;
+
+        if (!active && ctx->e2napState == E2NAP_ST_CONNECTED) {
+            LOGD("%s() CID %d disconnected", __func__, cid);
+            setContextState(ctx, E2NAP_ST_DISCONNECTED, -1);
+        } else if (active && ctx->e2napState != E2NAP_ST_CONNECTED) {
+            LOGD("%s() CID %d connected", __func__, cid);
+            setContextState(ctx, E2NAP_ST_CONNECTED, -1);
+        }
+    }
+    pthread_cond_broadcast(&s_e2nap_cond);
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+finally:
+    at_response_free(p_response);
+}
+
+/*
+ * Must be called with s_e2nap_mutex held. Returns 1, remembering the
+ * list, when it differs from the last one the framework got.
+ */
+static int dataCallListChanged(const RIL_Data_Call_Response_v6 *responses,
+                               int n)
+{
+    struct dataCallEntry entries[MAX_PDP_CONTEXTS];
+    int i;
+
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; i < n; i++) {
+        entries[i].active = responses[i].active;
+        if (responses[i].addresses != NULL)
+            snprintf(entries[i].addresses, sizeof(entries[i].addresses),
+                     "%s", responses[i].addresses);
+        if (responses[i].gateways != NULL)
+            snprintf(entries[i].gateways, sizeof(entries[i].gateways),
+                     "%s", responses[i].gateways);
+        if (responses[i].dnses != NULL)
+            snprintf(entries[i].dnses, sizeof(entries[i].dnses),
+                     "%s", responses[i].dnses);
+    }
 
-    at_response_free(atresponse);
-    atresponse = NULL;
+    if (s_lastDataCallsValid &&
+        memcmp(entries, s_lastDataCalls, n * sizeof(entries[0])) == 0)
+        return 0;
 
-    /* TODO: Check if we should check ip for a specific CID instead */
-    if (parse_ip_information(&addresses, &gateways, &dnses, &addr, &gateway) < 0) {
-           LOGE("%s() Failed to parse network interface data", __func__);
-           goto error;
+    memcpy(s_lastDataCalls, entries, n * sizeof(entries[0]));
+    s_lastDataCallsValid = 1;
+    return 1;
+}
+
+/*
+ * Answers token with the data call list, or when token is NULL sends
+ * it unless unchanged. coalesced is the number of updates folded into
+ * this one, for the statistics.
+ */
+static void sendDataCallList(RIL_Token *token, unsigned int coalesced)
+{
+    RIL_Data_Call_Response_v6 responses[MAX_PDP_CONTEXTS];
+    struct ipConfig cfgs[MAX_PDP_CONTEXTS];
+    unsigned int queries, commands;
+    int resync, changed;
+    int i;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    resync = s_e2napResync;
+    s_e2napResync = 0;
+    queries = s_ipConfigQueries;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    if (resync)
+        resyncContexts();
+
+    for (i = 0; i < s_numContexts; i++) {
+        struct pdpContext *ctx = &s_contexts[i];
+        RIL_Data_Call_Response_v6 *response = &responses[i];
+
+        memset(response, 0, sizeof(*response));
+        response->ifname = ctx->ifname;
+        response->cid = ctx->cid;
+        response->type = "IP";
+        response->suggestedRetryTime = -1;
+
+        if (getIpConfig(ctx, &cfgs[i]) < 0) {
+            LOGE("%s() Failed to parse network interface data", __func__);
+            goto error;
+        }
+
+        pthread_mutex_lock(&s_e2nap_mutex);
+        response->active = (ctx->e2napState == E2NAP_ST_CONNECTED);
+        pthread_mutex_unlock(&s_e2nap_mutex);
+
+        if (response->active && cfgs[i].valid) {
+            response->addresses = cfgs[i].addresses;
+            response->gateways = cfgs[i].gateways;
+            response->dnses = cfgs[i].dnses;
+        }
     }
 
-    response.addresses = addresses;
-    response.gateways = gateways;
-    response.dnses = dnses;
-    response.suggestedRetryTime = -1;
+    pthread_mutex_lock(&s_e2nap_mutex);
+    commands = (resync ? 1 : 0) + s_ipConfigQueries - queries;
+    s_listAtCommands += commands;
+    s_listAtSaved += coalesced * commands;
+    changed = dataCallListChanged(responses, s_numContexts);
+    if (token == NULL) {
+        if (changed)
+            s_listSent++;
+        else
+            s_listUnchanged++;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
     if (token != NULL)
-        RIL_onRequestComplete(*token, RIL_E_SUCCESS, &response,
-                sizeof(RIL_Data_Call_Response_v6));
+        RIL_onRequestComplete(*token, RIL_E_SUCCESS, responses,
+                s_numContexts * sizeof(RIL_Data_Call_Response_v6));
+    else if (changed)
+        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, responses,
+                s_numContexts * sizeof(RIL_Data_Call_Response_v6));
     else
-        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, &response,
-                sizeof(RIL_Data_Call_Response_v6));
-
-    free(addresses);
-    free(gateways);
-    free(dnses);
+        LOGD("%s() Data call list unchanged", __func__);
 
     return;
 
 error:
+    pthread_mutex_lock(&s_e2nap_mutex);
+    s_lastDataCallsValid = 0;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
     if (token != NULL)
         RIL_onRequestComplete(*token, RIL_E_GENERIC_FAILURE, NULL, 0);
     else
         RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED, NULL, 0);
+}
 
-    at_response_free(atresponse);
+void requestOrSendPDPContextList(RIL_Token *token)
+{
+    sendDataCallList(token, 0);
 }
 
 /**
@@ -296,14 +767,58 @@ error:
  */
 void onPDPContextListChanged(void *param)
 {
+    unsigned int coalesced;
     (void) param;
-    requestOrSendPDPContextList(NULL);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    s_listUpdatePending = 0;
+    coalesced = s_listUpdateCoalesced;
+    s_listUpdateCoalesced = 0;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    sendDataCallList(NULL, coalesced);
+}
+
+/**
+ * Schedules a data call list update, folding in reports that arrive
+ * before it runs.
+ */
+static void scheduleDataCallListUpdate(void)
+{
+    struct timespec delay = { 0, 0 };
+    int msec = getPropertyInt(DATA_CALL_LIST_DEBOUNCE_PROPERTY,
+                              DEFAULT_DATA_CALL_LIST_DEBOUNCE_MSEC);
+    int pending;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    s_listReports++;
+    pending = s_listUpdatePending;
+    if (pending) {
+        s_listCoalesced++;
+        s_listUpdateCoalesced++;
+    } else
+        s_listUpdatePending = 1;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    if (pending)
+        return;
+
+    if (msec > 0) {
+        delay.tv_sec = msec / 1000;
+        delay.tv_nsec = (msec % 1000) * 1000000L;
+    }
+    enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, onPDPContextListChanged, NULL,
+                    &delay);
 }
 
-int getE2NAPFailCause(void)
+static int getE2NAPFailCause(struct pdpContext *ctx)
 {
-    int e2napCause = getE2napCause();
-    int e2napState = getE2napState();
+    int e2napCause, e2napState;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    e2napCause = ctx->e2napCause;
+    e2napState = ctx->e2napState;
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
     if (e2napState == E2NAP_ST_CONNECTED)
         return 0;
@@ -311,6 +826,141 @@ int getE2NAPFailCause(void)
     return e2napCause;
 }
 
+/* Rejects that retrying the same request will not get past. */
+static int isPermanentFailure(int e2napCause)
+{
+    if (e2napCause >= GRPS_SEM_INCORRECT_MSG
+            && e2napCause <= GPRS_MSG_NOT_COMP_PROTO_STATE)
+        return 1;
+
+    switch (e2napCause) {
+    case GPRS_OP_DETERMINED_BARRING:
+    case GPRS_UNKNOWN_APN:
+    case GPRS_UNKNOWN_PDP_TYPE:
+    case GPRS_USER_AUTH_FAILURE:
+    case GPRS_ACT_REJECTED_GGSN:
+    case GPRS_SERVICE_OPTION_NOT_SUPP:
+    case GPRS_REQ_SER_OPTION_NOT_SUBS:
+    case GPRS_PROTO_ERROR_UNSPECIFIED:
+    case GPRS_APN_RESTRICT_VALUE_INCOMP:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Must be called with s_e2nap_mutex held. */
+static struct retryHistory *findRetryHistory(const char *apn, int create)
+{
+    struct retryHistory *oldest = &s_retryHistory[0];
+    int i;
+
+    if (apn == NULL)
+        apn = "";
+
+    for (i = 0; i < MAX_PDP_CONTEXTS; i++) {
+        struct retryHistory *h = &s_retryHistory[i];
+
+        if (h->apn != NULL && !strcmp(h->apn, apn))
+            return h;
+        if (h->apn == NULL || (oldest->apn != NULL &&
+            timespecDiffMsec(&h->lastFailure, &oldest->lastFailure) > 0))
+            oldest = h;
+    }
+
+    if (!create)
+        return NULL;
+
+    free(oldest->apn);
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->apn = strdup(apn);
+    return oldest;
+}
+
+/*
+ * Records a failed setup to apn and returns the retry time in
+ * milliseconds to suggest for it.
+ */
+static int getSuggestedRetryTime(const char *apn, int e2napCause)
+{
+    struct retryHistory *h;
+    struct timespec now;
+    long long delay, max;
+    int permanent = isPermanentFailure(e2napCause);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    h = findRetryHistory(apn, 1);
+    if (h->failures > 0 &&
+        timespecDiffMsec(&h->lastFailure, &now) > RETRY_STREAK_RESET_MSEC)
+        h->failures = 0;
+    h->failures++;
+    h->lastFailure = now;
+
+    if (permanent) {
+        delay = RETRY_PERMANENT_BASE_MSEC;
+        max = RETRY_PERMANENT_MAX_MSEC;
+        s_retryPermanent++;
+    } else {
+        delay = RETRY_TRANSIENT_BASE_MSEC;
+        max = RETRY_TRANSIENT_MAX_MSEC;
+        s_retryTransient++;
+    }
+    if (h->failures > 1)
+        delay <<= h->failures - 1 < 16 ? h->failures - 1 : 16;
+    if (delay > max)
+        delay = max;
+
+    /* Keep devices that lost coverage together from retrying together. */
+    if (!permanent) {
+        if (s_retrySeed == 0)
+            s_retrySeed = (unsigned int) (now.tv_sec ^ now.tv_nsec) | 1;
+        delay = delay / 2 + rand_r(&s_retrySeed) % (delay / 2 + 1);
+    }
+
+    s_lastRetryTime = (int) delay;
+    LOGD("%s() %s failure %d to APN '%s', retry in %lld ms", __func__,
+         permanent ? "Permanent" : "Transient", h->failures, h->apn, delay);
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return (int) delay;
+}
+
+/* Forgets the failure streak of apn, or counts a setup as a retry. */
+static void updateRetryHistory(const char *apn, int succeeded)
+{
+    struct retryHistory *h;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    h = findRetryHistory(apn, 0);
+    if (h != NULL && h->failures > 0) {
+        if (succeeded)
+            h->failures = 0;
+        else
+            s_retriedSetups++;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+}
+
+/*
+ * Fails a setup with status, or the last PDP fail cause if the
+ * network gave none, and a retry time suggested from its history.
+ */
+static void completeSetupFailure(RIL_Token t, const char *apn,
+                                 struct pdpContext *ctx, int status)
+{
+    RIL_Data_Call_Response_v6 response;
+
+    memset(&response, 0, sizeof(response));
+    response.status = status > 0 ? status : s_lastPdpFailCause;
+    response.suggestedRetryTime = getSuggestedRetryTime(apn, status);
+    response.cid = ctx != NULL ? ctx->cid : -1;
+    response.active = 0;
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
+}
+
 /**
  * RIL_REQUEST_PDP_CONTEXT_LIST
  *
@@ -325,11 +975,8 @@ void requestPDPContextList(void *data, size_t datalen, RIL_Token t)
     requestOrSendPDPContextList(&t);
 }
 
-void mbm_check_error_cause(void)
+void mbm_check_error_cause(int e2napState, int e2napCause)
 {
-    int e2napCause = getE2napCause();
-    int e2napState = getE2napState();
-
     if ((e2napCause < E2NAP_C_SUCCESS) || (e2napState == E2NAP_ST_CONNECTED)) {
         s_lastPdpFailCause = PDP_FAIL_ERROR_UNSPECIFIED;
         return;
@@ -503,8 +1150,8 @@ static int networkAuth(const char *authentication, const char *user,
         oldenc = getCharEncoding();
         setCharEncoding("UCS2");
 
-        atUser = ucs2StringCreate(user);
-        atPass = ucs2StringCreate(pass);
+        atUser = utf8ToUcs2Hex(user);
+        atPass = utf8ToUcs2Hex(pass);
         /* Even if sending of the command below would be erroneous, we should still
          * try to change back the character set to the original.
          */
@@ -514,7 +1161,7 @@ static int networkAuth(const char *authentication, const char *user,
         free(atUser);
 
         /* Set back to the original character set */
-        chSet = ucs2StringCreate(oldenc);
+        chSet = utf8ToUcs2Hex(oldenc);
         setCharEncoding(chSet);
         free(chSet);
         free(oldenc);
@@ -533,30 +1180,133 @@ static int networkAuth(const char *authentication, const char *user,
     return 0;
 }
 
-void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
+static int sameString(const char *a, const char *b)
 {
-    in_addr_t addr;
-    in_addr_t gateway;
+    return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+static void setString(char **dst, const char *src)
+{
+    free(*dst);
+    *dst = src ? strdup(src) : NULL;
+}
+
+/** Sends AT+CGDCONT for ctx unless apn is already provisioned. */
+static int provisionApn(struct pdpContext *ctx, const char *apn)
+{
+    int err;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    if (ctx->apnValid && sameString(ctx->apn, apn)) {
+        s_apnSkipped++;
+        pthread_mutex_unlock(&s_e2nap_mutex);
+        return AT_NOERROR;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    err = at_send_command("AT+CGDCONT=%d,\"IP\",\"%s\"", ctx->cid, apn);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    ctx->apnValid = (err == AT_NOERROR);
+    setString(&ctx->apn, apn);
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return err;
+}
+
+/** Runs networkAuth() for ctx unless the settings are unchanged. */
+static int provisionAuth(struct pdpContext *ctx, const char *auth,
+                         const char *user, const char *pass)
+{
+    int err;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    if (ctx->authValid && sameString(ctx->auth, auth) &&
+        sameString(ctx->user, user) && sameString(ctx->pass, pass)) {
+        s_authSkipped++;
+        pthread_mutex_unlock(&s_e2nap_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
+    err = networkAuth(auth, user, pass, ctx->cid);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    ctx->authValid = (err == 0);
+    setString(&ctx->auth, auth);
+    setString(&ctx->user, user);
+    setString(&ctx->pass, pass);
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return err;
+}
+
+/**
+ * Forgets what has been provisioned, for when the modem may have lost
+ * its PDP context definitions.
+ */
+void invalidatePDPProvisioning(void)
+{
+    int i;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (i = 0; i < s_numContexts; i++) {
+        s_contexts[i].apnValid = 0;
+        s_contexts[i].authValid = 0;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+}
+
+/**
+ * Defines the first context for the APN of the last successful data
+ * call on it, so setting up a call to it again only needs AT*ENAP=1.
+ */
+void prestagePDPContext(void)
+{
+    char apn[PROPERTY_VALUE_MAX];
+
+    if (s_numContexts == 0 ||
+        property_get(PROPERTY_LAST_APN, apn, "") <= 0)
+        return;
+
+    if (provisionApn(&s_contexts[0], apn) == AT_NOERROR)
+        LOGD("%s() pre-staged APN '%s'", __func__, apn);
+}
+
+static void rememberLastApn(const char *apn)
+{
+    char last[PROPERTY_VALUE_MAX];
+
+    if (apn == NULL || strlen(apn) >= PROPERTY_VALUE_MAX)
+        return;
+
+    property_get(PROPERTY_LAST_APN, last, "");
+    if (strcmp(last, apn))
+        property_set(PROPERTY_LAST_APN, apn);
+}
+
+void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
+{
     const char *apn, *user, *pass, *auth;
-    char *addresses = NULL;
-    char *gateways = NULL;
-    char *dnses = NULL;
     const char *type = NULL;
+    const char *profile;
+    struct pdpContext *ctx;
+    struct ipConfig cfg;
 
     RIL_Data_Call_Response_v6 response;
 
     int err = -1;
-    int cme_err, i;
-
-    int e2napState = setE2napState(-1);
-    int e2napCause = setE2napCause(-1);
+    int cme_err;
+    int e2napState, connected;
+    int failedPhase = -1, failCause = -1;
+    struct setupTrace trace = { -1, { 0, 0 } };
+    struct timespec setupStart, start, end;
 
-    (void) data;
     (void) datalen;
 
     memset(&response, 0, sizeof(response));
 
+    profile = ((const char **) data)[1];
     apn = ((const char **) data)[2];
     user = ((const char **) data)[3];
     pass = ((const char **) data)[4];
@@ -565,202 +1315,335 @@ void requestSetupDefaultPDP(void *data, size_t datalen, RIL_Token t)
 
     s_lastPdpFailCause = PDP_FAIL_ERROR_UNSPECIFIED;
 
-    LOGD("%s() requesting data connection to APN '%s'", __func__, apn);
-
-    if (ifc_init()) {
-        LOGE("%s() FAILED to set up ifc!", __func__);
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    ctx = claimContext();
+    if (ctx == NULL) {
+        LOGE("%s() All %d PDP contexts are in use", __func__, s_numContexts);
+        s_lastPdpFailCause = PDP_FAIL_INSUFFICIENT_RESOURCES;
+        completeSetupFailure(t, apn, NULL, -1);
         return;
     }
 
-    if (ifc_down(ril_iface)) {
-        LOGE("%s() Failed to bring down %s!", __func__, ril_iface);
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        return;
-    }
+    updateRetryHistory(apn, 0);
+
+    LOGD("%s() requesting data connection to APN '%s' on CID %d", __func__,
+         apn, ctx->cid);
 
-    err = at_send_command("AT+CGDCONT=%d,\"IP\",\"%s\"", RIL_CID_IP, apn);
+    clock_gettime(CLOCK_MONOTONIC, &setupStart);
+    pthread_mutex_lock(&s_e2nap_mutex);
+    connected = countConnectedContexts();
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    setupPhase(&trace, SETUP_PHASE_CGDCONT);
+    err = provisionApn(ctx, apn);
     if (err != AT_NOERROR) {
         cme_err = at_get_cme_error(err);
         LOGE("%s() CGDCONT failed: %d, cme: %d", __func__, err, cme_err);
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        return;
+        completeSetupFailure(t, apn, ctx, -1);
+        goto release;
     }
 
-    if (networkAuth(auth, user, pass, RIL_CID_IP)) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        return;
+    setupPhase(&trace, SETUP_PHASE_AUTH);
+    if (provisionAuth(ctx, auth, user, pass)) {
+        completeSetupFailure(t, apn, ctx, -1);
+        goto release;
     }
 
     /* Start data on PDP context for IP */
-    err = at_send_command("AT*ENAP=1,%d", RIL_CID_IP);
+    setupPhase(&trace, SETUP_PHASE_ENAP);
+    setE2napOwner(ctx);
+    err = at_send_command("AT*ENAP=1,%d", ctx->cid);
     if (err != AT_NOERROR) {
         cme_err = at_get_cme_error(err);
         LOGE("requestSetupDefaultPDP: ENAP failed: %d  cme: %d", err, cme_err);
         goto error;
     }
 
-    for (i = 0; i < MBM_ENAP_WAIT_TIME; i++) {
-        e2napState = getE2napState();
-
-        if (e2napState == E2NAP_ST_CONNECTED
-                || e2napState == E2NAP_ST_DISCONNECTED) {
-            LOGD("%s() %s", __func__, e2napStateToString(e2napState));
-            break;
-        }
-        usleep(200 * 1000);
+    setupPhase(&trace, SETUP_PHASE_E2NAP);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    e2napState = waitForContextState(ctx,
+                                     E2NAP_STATE_MASK(E2NAP_ST_CONNECTED) |
+                                     E2NAP_STATE_MASK(E2NAP_ST_DISCONNECTED),
+                                     MBM_ENAP_WAIT_TIME_MSEC);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (e2napState == E2NAP_ST_CONNECTED
+            || e2napState == E2NAP_ST_DISCONNECTED) {
+        long long waited = timespecDiffMsec(&start, &end);
+
+        LOGD("%s() %s after %lld ms", __func__,
+             e2napStateToString(e2napState), waited);
+        pthread_mutex_lock(&s_e2nap_mutex);
+        latencyHistogramAdd(&s_e2napPolledLatency,
+            (waited / MBM_ENAP_POLL_INTERVAL_MSEC + 1) *
+            MBM_ENAP_POLL_INTERVAL_MSEC);
+        pthread_mutex_unlock(&s_e2nap_mutex);
     }
 
-    e2napState = getE2napState();
-    e2napCause = getE2napCause();
-
     if (e2napState == E2NAP_ST_DISCONNECTED)
         goto error;
 
-    if (parse_ip_information(&addresses, &gateways, &dnses, &addr, &gateway) < 0) {
+    setupPhase(&trace, SETUP_PHASE_E2IPCFG);
+    if (getIpConfig(ctx, &cfg) < 0 ||
+        (!cfg.valid && captureIpConfig(ctx, &cfg) < 0)) {
         LOGE("%s() Failed to parse network interface data", __func__);
         goto error;
     }
 
-    e2napState = getE2napState();
-    response.addresses = addresses;
-    response.gateways = gateways;
-    response.dnses = dnses;
+    response.addresses = cfg.addresses;
+    response.gateways = cfg.gateways;
+    response.dnses = cfg.dnses;
     LOGI("%s() Setting up interface %s,%s,%s",
         __func__, response.addresses, response.gateways, response.dnses);
 
-    if (e2napState == E2NAP_ST_DISCONNECTED)
+    if (getContextState(ctx) == E2NAP_ST_DISCONNECTED)
         goto error; /* we got disconnected */
 
-    response.ifname = ril_iface;
+    response.ifname = ctx->ifname;
     response.active = 2;
     response.type = (char *) type;
     response.status = 0;
-    response.cid = 1;
+    response.cid = ctx->cid;
     response.suggestedRetryTime = -1;
 
     /* Don't use android netutils. We use our own and get the routing correct.
      * Carl Nordbeck */
-    if (ifc_configure(ril_iface, addr, gateway))
-        LOGE("%s() Failed to configure the interface %s", __func__, ril_iface);
-
-    e2napState = getE2napState();
-    LOGI("IP Address %s, %s", addresses, e2napStateToString(e2napState));
+    /* Only the default data call takes the default route, so that the
+     * others, such as a tethered or management one, cannot move it. */
+    setupPhase(&trace, SETUP_PHASE_IFC_CONFIGURE);
+    if (ifc_configure(ctx->ifname, cfg.addr, cfg.gateway,
+                      getPropertyInt(PROPERTY_MTU, 0),
+                      profile == NULL ||
+                      atoi(profile) == RIL_DATA_PROFILE_DEFAULT))
+        LOGE("%s() Failed to configure the interface %s", __func__,
+             ctx->ifname);
+
+    e2napState = getContextState(ctx);
+    LOGI("IP Address %s, %s", cfg.addresses, e2napStateToString(e2napState));
 
     if (e2napState == E2NAP_ST_DISCONNECTED)
         goto error; /* we got disconnected */
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
+    setupPhase(&trace, -1);
+    setE2napOwner(NULL);
+
+    if (ctx == &s_contexts[0])
+        rememberLastApn(apn);
+    updateRetryHistory(apn, 1);
 
-    free(addresses);
-    free(gateways);
-    free(dnses);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&s_e2nap_mutex);
+    latencyHistogramAdd(&s_setupLatency[connected],
+                        timespecDiffMsec(&setupStart, &end));
+    ctx->setups++;
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
+
+    startDataMonitor();
     return;
 
 error:
+    failedPhase = trace.phase;
+    setupPhase(&trace, SETUP_PHASE_ABORT);
 
-    response.status = getE2NAPFailCause();
+    failCause = getE2NAPFailCause(ctx);
 
-    mbm_check_error_cause();
+    pthread_mutex_lock(&s_e2nap_mutex);
+    e2napState = ctx->e2napState;
+    err = ctx->e2napCause;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+    mbm_check_error_cause(e2napState, err);
 
     /* Restore enap state and wait for enap to report disconnected*/
-    at_send_command("AT*ENAP=0");
-    for (i = 0; i < MBM_ENAP_WAIT_TIME; i++) {
-        e2napState = getE2napState();
-        if (e2napState == E2NAP_ST_DISCONNECTED)
-            break;
+    sendEnapDisconnect(ctx);
+    waitForContextState(ctx, E2NAP_STATE_MASK(E2NAP_ST_DISCONNECTED),
+                        MBM_ENAP_WAIT_TIME_MSEC);
+    setE2napOwner(NULL);
+
+    /* Do not leave a stale configuration up on the interface. */
+    setupPhase(&trace, SETUP_PHASE_IFC_DOWN);
+    ifc_deconfigure(ctx->ifname);
+
+    completeSetupFailure(t, apn, ctx, failCause);
+
+release:
+    if (failedPhase < 0)
+        failedPhase = trace.phase;
+    setupPhase(&trace, -1);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    ctx->setupFailures++;
+    ctx->inUse = 0;
+    if (failedPhase >= 0)
+        s_setupFailPhases[failedPhase]++;
+    if (failCause > 0 && failCause <= E2NAP_C_MAXIMUM)
+        s_setupFailCauses[failCause]++;
+    else
+        s_setupFailCauses[E2NAP_C_MAXIMUM + 1]++;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+}
 
-        usleep(200 * 1000);
+/*
+ * Completes the teardown of ctx once *E2NAP has reported it
+ * disconnected. Runs on the reader thread as the report comes in, so
+ * that no queue, nor a long command on one, can hold it up. It sends no
+ * AT command, the interface goes down over netlink.
+ */
+static void finishTeardown(struct pdpContext *ctx)
+{
+    struct timespec end;
+    RIL_Token t;
+    int err;
+
+    err = ifc_deconfigure(ctx->ifname);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    t = ctx->teardownToken;
+    ctx->teardownToken = NULL;
+    latencyHistogramAdd(&s_teardownIfcLatency,
+                        timespecDiffMsec(&ctx->teardownDisconnected, &end));
+    latencyHistogramAdd(&s_teardownLatency[ctx->teardownConnected - 1],
+                        timespecDiffMsec(&ctx->teardownStart, &end));
+    if (!err) {
+        ctx->teardowns++;
+        ctx->inUse = 0;
     }
+    pthread_mutex_unlock(&s_e2nap_mutex);
 
-    if (response.status > 0)
-        RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
-    else
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    if (t != NULL)
+        RIL_onRequestComplete(t, err ? RIL_E_GENERIC_FAILURE : RIL_E_SUCCESS,
+                              NULL, 0);
+}
+
+/*
+ * Called from onConnectionStateChanged() with s_e2nap_mutex held.
+ * Hands a teardown of ctx waiting for this report over to
+ * finishTeardown(), returning 1 if there was one.
+ */
+static int onTeardownStateChanged(struct pdpContext *ctx, int state)
+{
+    if (!ctx->teardownPending || state != E2NAP_ST_DISCONNECTED)
+        return 0;
 
-    free(addresses);
-    free(gateways);
-    free(dnses);
+    ctx->teardownPending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ctx->teardownDisconnected);
+    latencyHistogramAdd(&s_teardownE2napLatency,
+                        timespecDiffMsec(&ctx->teardownStart,
+                                         &ctx->teardownDisconnected));
+    if (s_e2napOwner == ctx - s_contexts)
+        s_e2napOwner = -1;
+    return 1;
+}
+
+/* Fails a teardown of ctx that *E2NAP never confirmed. */
+static void teardownTimeout(void *param)
+{
+    struct pdpContext *ctx = (struct pdpContext *) param;
+    struct timespec now;
+    RIL_Token t = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    /* A later teardown has a timeout of its own. */
+    if (ctx->teardownPending &&
+        timespecDiffMsec(&ctx->teardownStart, &now) >=
+        MBM_ENAP_WAIT_TIME_MSEC) {
+        ctx->teardownPending = 0;
+        t = ctx->teardownToken;
+        ctx->teardownToken = NULL;
+        if (s_e2napOwner == ctx - s_contexts)
+            s_e2napOwner = -1;
+        s_teardownTimeouts++;
+        pthread_cond_broadcast(&s_e2nap_cond);
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    if (t != NULL) {
+        LOGE("%s() CID %d not disconnected after %d ms", __func__, ctx->cid,
+             MBM_ENAP_WAIT_TIME_MSEC);
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    }
 }
 
 /* CHECK There are several error cases if PDP deactivation fails
  * 24.008: 8, 25, 36, 38, 39, 112
+ *
+ * Returns once AT*ENAP=0 is accepted. The request completes from
+ * finishTeardown() on *E2NAP disconnected, or from teardownTimeout().
  */
 void requestDeactivateDefaultPDP(void *data, size_t datalen, RIL_Token t)
 {
-    ATResponse *p_response = NULL;
-    int enap = 0;
-    int err, i;
-    char *line;
-    (void) data;
-    (void) datalen;
+    struct pdpContext *ctx = NULL;
+    struct timespec timeout = { MBM_ENAP_WAIT_TIME_MSEC / 1000,
+        (MBM_ENAP_WAIT_TIME_MSEC % 1000) * 1000000L };
+    int e2napState, pending;
+    int err;
 
-    err = at_send_command_singleline("AT*ENAP?", "*ENAP:", &p_response);
-    if (err != AT_NOERROR)
-        goto error;
+    if (data != NULL && datalen >= sizeof(char *) &&
+        ((const char **) data)[0] != NULL)
+        ctx = findContext(atoi(((const char **) data)[0]));
+    else if (s_numContexts > 0)
+        ctx = &s_contexts[0];
 
-    line = p_response->p_intermediates->line;
-    err = at_tok_start(&line);
-    if (err < 0)
+    if (ctx == NULL) {
+        LOGE("%s() No such PDP context", __func__);
         goto error;
+    }
 
-    err = at_tok_nextint(&line, &enap);
-    if (err < 0)
-        goto error;
+    e2napState = getContextState(ctx);
 
-    if (enap == ENAP_T_CONN_IN_PROG)
+    if (e2napState == E2NAP_ST_CONNECTING)
         LOGE("%s() Tear down connection while connection setup in progress", __func__);
 
-    if (enap == ENAP_T_CONNECTED) {
-        err = at_send_command("AT*ENAP=0"); /* TODO: can return CME error */
-
-        if (err != AT_NOERROR && at_get_error_type(err) != CME_ERROR)
-            goto error;
-        for (i = 0; i < MBM_ENAP_WAIT_TIME; i++) {
-            at_response_free(p_response);
-            p_response = NULL;
-            err = at_send_command_singleline("AT*ENAP?", "*ENAP:", &p_response);
-
-            if (err != AT_NOERROR)
-                goto error;
-
-            line = p_response->p_intermediates->line;
-
-            err = at_tok_start(&line);
-            if (err < 0)
-                goto error;
-
-            err = at_tok_nextint(&line, &enap);
-            if (err < 0)
-                goto error;
+    if (e2napState != E2NAP_ST_CONNECTED) {
+        releaseContext(ctx);
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+        return;
+    }
 
-            if (enap == 0)
-                break;
+    pthread_mutex_lock(&s_e2nap_mutex);
+    pending = ctx->teardownPending;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+    if (pending) {
+        LOGE("%s() CID %d is already being torn down", __func__, ctx->cid);
+        goto error;
+    }
 
-            sleep(1);
+    setE2napOwner(ctx);
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    ctx->teardownPending = 1;
+    ctx->teardownToken = t;
+    ctx->teardownConnected = countConnectedContexts();
+    clock_gettime(CLOCK_MONOTONIC, &ctx->teardownStart);
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    err = sendEnapDisconnect(ctx); /* TODO: can return CME error */
+
+    if (err != AT_NOERROR && at_get_error_type(err) != CME_ERROR) {
+        pthread_mutex_lock(&s_e2nap_mutex);
+        pending = ctx->teardownPending;
+        if (pending) {
+            ctx->teardownPending = 0;
+            ctx->teardownToken = NULL;
+            s_e2napOwner = -1;
+            pthread_cond_broadcast(&s_e2nap_cond);
         }
+        pthread_mutex_unlock(&s_e2nap_mutex);
 
-        if (enap != ENAP_T_NOT_CONNECTED)
+        /* Otherwise *E2NAP got in first and completes the request. */
+        if (pending)
             goto error;
-
-        /* Bring down the interface as well. */
-        if (ifc_init())
-            goto error;
-
-        if (ifc_down(ril_iface))
-            goto error;
-
-        ifc_close();
+        return;
     }
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
-    at_response_free(p_response);
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, teardownTimeout, ctx, &timeout);
     return;
 
 error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
 }
 
 /**
@@ -779,36 +1662,25 @@ void requestLastPDPFailCause(void *data, size_t datalen, RIL_Token t)
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &s_lastPdpFailCause, sizeof(int));
 }
 
-/**
- * Returns a pointer to allocated memory filled with AT command
- * UCS-2 formatted string corresponding to the input string.
- * Note: Caller need to take care of freeing the
- *  allocated memory by calling free( ) when the
- *  created string is no longer used.
- */
-static char *ucs2StringCreate(const char *iString)
+/* Must be called with s_e2nap_mutex held. */
+static struct pdpContext *getE2napContext(void)
 {
-    int slen = 0;
-    int idx = 0;
-    char *ucs2String = NULL;
+    if (s_e2napOwner >= 0)
+        return &s_contexts[s_e2napOwner];
 
-    /* In case of NULL input, create an empty string as output */
-    if (NULL == iString)
-        slen = 0;
-    else
-        slen = strlen(iString);
+    if (s_numContexts == 1)
+        return &s_contexts[0];
 
-    ucs2String = (char *) malloc(sizeof(char) * (slen * 4 + 1));
-    for (idx = 0; idx < slen; idx++)
-        sprintf(&ucs2String[idx * 4], "%04x", iString[idx]);
-    ucs2String[idx * 4] = '\0';
-    return ucs2String;
+    return NULL;
 }
 
 void onConnectionStateChanged(const char *s)
 {
     int m_state = -1, m_cause = -1, err;
     int commas;
+    int newState, newCause = -1;
+    int torndown = 0;
+    struct pdpContext *ctx;
 
     err = at_tok_start((char **) &s);
     if (err < 0)
@@ -850,42 +1722,44 @@ void onConnectionStateChanged(const char *s)
             }
         }
 
-        if ((err = pthread_mutex_lock(&s_e2nap_mutex)) != 0)
-            LOGE("%s() failed to take e2nap mutex: %s", __func__,
-                    strerror(err));
-
         if (m_state == E2NAP_ST_CONNECTING || m_state2 == E2NAP_ST_CONNECTING) {
-            s_e2napState = E2NAP_ST_CONNECTING;
+            newState = E2NAP_ST_CONNECTING;
         } else if (m_state == E2NAP_ST_CONNECTED) {
-            s_e2napCause = m_cause2;
-            s_e2napState = E2NAP_ST_CONNECTED;
+            newCause = m_cause2;
+            newState = E2NAP_ST_CONNECTED;
         } else if (m_state2 == E2NAP_ST_CONNECTED) {
-            s_e2napCause = m_cause;
-            s_e2napState = E2NAP_ST_CONNECTED;
+            newCause = m_cause;
+            newState = E2NAP_ST_CONNECTED;
         } else {
-            s_e2napCause = m_cause;
-            s_e2napState = E2NAP_ST_DISCONNECTED;
+            newCause = m_cause;
+            newState = E2NAP_ST_DISCONNECTED;
         }
-        if ((err = pthread_mutex_unlock(&s_e2nap_mutex)) != 0)
-            LOGE("%s() failed to release e2nap mutex: %s", __func__,
-                    strerror(err));
     } else {
-        if ((err = pthread_mutex_lock(&s_e2nap_mutex)) != 0)
-            LOGE("%s() failed to take e2nap mutex: %s", __func__,
-                    strerror(err));
+        newState = m_state;
+        newCause = m_cause;
+    }
 
-        s_e2napState = m_state;
-        s_e2napCause = m_cause;
-        if ((err = pthread_mutex_unlock(&s_e2nap_mutex)) != 0)
-            LOGE("%s() failed to release e2nap mutex: %s", __func__,
-                    strerror(err));
+    if ((err = pthread_mutex_lock(&s_e2nap_mutex)) != 0)
+        LOGE("%s() failed to take e2nap mutex: %s", __func__,
+                strerror(err));
 
-    }
+    ctx = getE2napContext();
+    if (ctx != NULL) {
+        setContextState(ctx, newState, newCause);
+        torndown = onTeardownStateChanged(ctx, newState);
+    } else
+        s_e2napResync = 1;
+    pthread_cond_broadcast(&s_e2nap_cond);
+
+    if ((err = pthread_mutex_unlock(&s_e2nap_mutex)) != 0)
+        LOGE("%s() failed to release e2nap mutex: %s", __func__,
+                strerror(err));
 
     LOGD("%s() %s", e2napStateToString(m_state), __func__);
+    if (torndown)
+        finishTeardown(ctx);
     if (m_state != E2NAP_ST_CONNECTING)
-        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, onPDPContextListChanged, NULL,
-                NULL);
+        scheduleDataCallListUpdate();
 
     /* Make system request network information. This will allow RIL to report any new
      * technology made available from connection.
@@ -894,27 +1768,185 @@ void onConnectionStateChanged(const char *s)
         RIL_onUnsolicitedResponse(
                 RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED, NULL, 0);
 
-    mbm_check_error_cause();
+    if (ctx != NULL)
+        mbm_check_error_cause(newState, newCause);
+}
+
+/**
+ * Fills in the CIDs and interfaces of the connected contexts, at most
+ * max, and returns how many there are.
+ */
+int getConnectedPDPContexts(int *cids, const char **ifnames, int max)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (i = 0; i < s_numContexts && n < max; i++) {
+        if (s_contexts[i].e2napState != E2NAP_ST_CONNECTED)
+            continue;
+        cids[n] = s_contexts[i].cid;
+        ifnames[n] = s_contexts[i].ifname;
+        n++;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return n;
+}
+
+/**
+ * Disconnects the context of cid so the framework sees the data call
+ * drop and sets it up again. The context stays claimed until the
+ * framework deactivates it.
+ */
+int resetPDPContext(int cid)
+{
+    struct pdpContext *ctx = findContext(cid);
+    int state;
+
+    if (ctx == NULL || getContextState(ctx) != E2NAP_ST_CONNECTED)
+        return -1;
+
+    LOGI("%s() Disconnecting CID %d on %s", __func__, cid, ctx->ifname);
+
+    setE2napOwner(ctx);
+    sendEnapDisconnect(ctx);
+    state = waitForContextState(ctx, E2NAP_STATE_MASK(E2NAP_ST_DISCONNECTED),
+                                MBM_ENAP_WAIT_TIME_MSEC);
+    setE2napOwner(NULL);
+
+    ifc_deconfigure(ctx->ifname);
+
+    return state == E2NAP_ST_DISCONNECTED ? 0 : -1;
 }
 
+/**
+ * Returns E2NAP_ST_CONNECTED if any context is connected, otherwise
+ * E2NAP_ST_CONNECTING if any is connecting, otherwise the state of the
+ * first context.
+ */
 int getE2napState(void)
 {
-    return s_e2napState;
+    int state = -1;
+    int i;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (i = 0; i < s_numContexts; i++) {
+        int st = s_contexts[i].e2napState;
+
+        if (i == 0 || st == E2NAP_ST_CONNECTED ||
+            (st == E2NAP_ST_CONNECTING && state != E2NAP_ST_CONNECTED))
+            state = st;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return state;
 }
 
+/** Returns the cause of the first context. */
 int getE2napCause(void)
 {
-    return s_e2napCause;
+    int cause = -1;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    if (s_numContexts > 0)
+        cause = s_contexts[0].e2napCause;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+
+    return cause;
 }
 
 int setE2napState(int state)
 {
-    s_e2napState = state;
-    return s_e2napState;
+    int i;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (i = 0; i < s_numContexts; i++) {
+        s_contexts[i].e2napState = state;
+        s_contexts[i].ipConfig.valid = 0;
+        s_contexts[i].ipConfigGeneration++;
+    }
+    pthread_mutex_unlock(&s_e2nap_mutex);
+    return state;
 }
 
 int setE2napCause(int state)
 {
-    s_e2napCause = state;
-    return s_e2napCause;
+    int i;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (i = 0; i < s_numContexts; i++)
+        s_contexts[i].e2napCause = state;
+    pthread_mutex_unlock(&s_e2nap_mutex);
+    return state;
+}
+
+/**
+ * Dumps data call statistics.
+ */
+void pdpDiagnostics(struct oemDiagnostics *diag)
+{
+    char buf[128];
+    int i;
+
+    pthread_mutex_lock(&s_e2nap_mutex);
+    for (i = 0; i < s_numContexts; i++) {
+        struct pdpContext *ctx = &s_contexts[i];
+
+        oemDiagPrintf(diag, "context cid=%d if=%s state=%s setups=%u "
+                      "failures=%u teardowns=%u", ctx->cid, ctx->ifname,
+                      e2napStateToString(ctx->e2napState), ctx->setups,
+                      ctx->setupFailures, ctx->teardowns);
+    }
+    for (i = 0; i < MAX_PDP_CONTEXTS; i++) {
+        if (s_setupLatency[i].count > 0) {
+            latencyHistogramFormat(&s_setupLatency[i], buf, sizeof(buf));
+            oemDiagPrintf(diag, "setup other_active=%d %s", i, buf);
+        }
+        if (s_teardownLatency[i].count > 0) {
+            latencyHistogramFormat(&s_teardownLatency[i], buf, sizeof(buf));
+            oemDiagPrintf(diag, "teardown other_active=%d %s", i, buf);
+        }
+    }
+    for (i = 0; i < SETUP_PHASES; i++) {
+        if (s_setupPhaseLatency[i].count > 0) {
+            latencyHistogramFormat(&s_setupPhaseLatency[i], buf, sizeof(buf));
+            oemDiagPrintf(diag, "phase %s %s", s_setupPhaseNames[i], buf);
+        }
+    }
+    latencyHistogramFormat(&s_teardownE2napLatency, buf, sizeof(buf));
+    oemDiagPrintf(diag, "teardown_e2nap %s", buf);
+    latencyHistogramFormat(&s_teardownIfcLatency, buf, sizeof(buf));
+    oemDiagPrintf(diag, "teardown_ifc %s", buf);
+    oemDiagPrintf(diag, "teardown timeouts=%u enap_waits=%u",
+                  s_teardownTimeouts, s_ownerWaits);
+    latencyHistogramFormat(&s_e2napPolledLatency, buf, sizeof(buf));
+    oemDiagPrintf(diag, "e2nap_wait_if_polled %s", buf);
+    for (i = 0; i < SETUP_PHASES; i++)
+        if (s_setupFailPhases[i] > 0)
+            oemDiagPrintf(diag, "setup_failed phase=%s n=%u",
+                          s_setupPhaseNames[i], s_setupFailPhases[i]);
+    for (i = 0; i <= E2NAP_C_MAXIMUM; i++)
+        if (s_setupFailCauses[i] > 0)
+            oemDiagPrintf(diag, "setup_failed cause=%d (%s) n=%u", i,
+                          errorCauseToString(i), s_setupFailCauses[i]);
+    if (s_setupFailCauses[E2NAP_C_MAXIMUM + 1] > 0)
+        oemDiagPrintf(diag, "setup_failed cause=none n=%u",
+                      s_setupFailCauses[E2NAP_C_MAXIMUM + 1]);
+    oemDiagPrintf(diag, "e2ipcfg queries=%u snapshot_hits=%u",
+                  s_ipConfigQueries, s_ipConfigHits);
+    oemDiagPrintf(diag, "datacall_list reports=%u coalesced=%u unchanged=%u "
+                  "sent=%u at_commands=%u at_saved=%u upcalls_saved=%u",
+                  s_listReports, s_listCoalesced, s_listUnchanged,
+                  s_listSent, s_listAtCommands, s_listAtSaved,
+                  s_listCoalesced + s_listUnchanged);
+    oemDiagPrintf(diag, "provision apn_skipped=%u auth_skipped=%u",
+                  s_apnSkipped, s_authSkipped);
+    oemDiagPrintf(diag, "retry transient=%u permanent=%u retried=%u "
+                  "last_ms=%d", s_retryTransient, s_retryPermanent,
+                  s_retriedSetups, s_lastRetryTime);
+    for (i = 0; i < MAX_PDP_CONTEXTS; i++)
+        if (s_retryHistory[i].apn != NULL && s_retryHistory[i].failures > 0)
+            oemDiagPrintf(diag, "retry apn=%s failures=%d",
+                          s_retryHistory[i].apn, s_retryHistory[i].failures);
+    pthread_mutex_unlock(&s_e2nap_mutex);
 }
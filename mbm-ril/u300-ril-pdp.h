@@ -24,6 +24,10 @@
 #ifndef U300_RIL_PDP_H
 #define U300_RIL_PDP_H 1
 
+/* Contexts the -i interface list can configure. */
+#define MAX_PDP_CONTEXTS 4
+
+void initPDPContexts(const char *ifaces);
 void requestOrSendPDPContextList(RIL_Token *t);
 void onPDPContextListChanged(void *param);
 void requestPDPContextList(void *data, size_t datalen, RIL_Token t);
@@ -35,5 +39,12 @@ int getE2napState(void);
 int getE2napCause(void);
 int setE2napState(int state);
 int setE2napCause(int state);
+int getConnectedPDPContexts(int *cids, const char **ifnames, int max);
+int resetPDPContext(int cid);
+void invalidatePDPProvisioning(void);
+void prestagePDPContext(void);
+
+struct oemDiagnostics;
+void pdpDiagnostics(struct oemDiagnostics *diag);
 
 #endif
@@ -25,13 +25,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <strings.h>
+#include <pthread.h>
 #include "atchannel.h"
 #include "at_tok.h"
+#include "ber_tlv.h"
 #include "fcp_parser.h"
 #include "u300-ril.h"
 #include "u300-ril-sim.h"
 #include "u300-ril-messaging.h"
 #include "u300-ril-device.h"
+#include "u300-ril-oem.h"
+#include "u300-ril-simcache.h"
 #include "misc.h"
 
 #define LOG_TAG "RIL"
@@ -253,6 +258,38 @@ static const struct timespec TIMEVAL_SIMPOLL = { 1, 0 };
 static const struct timespec TIMEVAL_SIMRESET = { 60, 0 };
 static int sim_hotswap;
 
+/*
+ * *ESIMSR and *EPEV trigger a poll as soon as the SIM moves on, polls
+ * in between are only a fallback and back off from SIM_POLL_MIN_MSEC to
+ * SIM_POLL_MAX_MSEC. SIM_POLL_BACKOFF_PROPERTY set to 0 polls every
+ * TIMEVAL_SIMPOLL instead, as before, to compare the two.
+ */
+#define SIM_POLL_BACKOFF_PROPERTY "mbm.ril.simpoll.backoff"
+#define SIM_POLL_MIN_MSEC 500
+#define SIM_POLL_MAX_MSEC 8000
+
+/*
+ * Polls while waiting for the SIM to settle after the radio turns on.
+ * Each poll moves seq on, which voids a fallback poll already
+ * scheduled.
+ */
+static pthread_mutex_t s_simPollMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    unsigned long seq;
+    int waiting;
+    int delayMsec;
+    int polls;
+    struct timespec since;
+} s_simPoll;
+
+static unsigned int s_simReadyCount;
+static long long s_simReadyLastMsec = -1;
+static long long s_simReadyMinMsec = -1;
+static long long s_simReadyMaxMsec = -1;
+static int s_simReadyLastPolls;
+static unsigned int s_simPollUrcTriggers;
+static unsigned int s_simPollFallbacks;
+
 /* All files listed under ADF_USIM in 3GPP TS 31.102 */
 static const int ef_usim_files[] = {
     0x6F05, 0x6F06, 0x6F07, 0x6F08, 0x6F09,
@@ -286,6 +323,48 @@ static const int ef_telecom_files[] = {
 static int s_simResetting = 0;
 static int s_simRemoved = 0;
 
+/*
+ * What is known about the card inserted, found out on first use and
+ * kept until the card is swapped or reset. Then s_cardEpoch moves on
+ * and the next user starts the context over. The reader thread only
+ * moves the epoch, it must not take s_cardMutex: that is held across
+ * the AT commands which find the context out.
+ *
+ * Readers without the mutex take a field only if s_card.epoch is the
+ * current one both before and after reading it. A rebuild clears
+ * s_card.epoch first and publishes the new one last, so that the fields
+ * of one card are never taken for those of the next.
+ */
+struct simCardContext {
+    unsigned int epoch;         /* 0 until first built */
+    UICC_Type type;
+    int lc;                     /* logical channel to the USIM, 0 if none */
+};
+
+static pthread_mutex_t s_cardMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct simCardContext s_card;
+static volatile unsigned int s_cardEpoch = 1;
+static unsigned int s_cardRebuilds;
+
+/*
+ * The SIM status as last seen, kept up to date from *ESIMSR, *EPEV,
+ * *EESIMSWAP and PIN requests, so GET_SIM_STATUS need not ask the modem
+ * each time. Whatever these cannot tell for sure is marked unknown, to
+ * be asked for once. The epoch keeps an answer from being stored over
+ * an invalidation that came in while AT+CPIN? was outstanding.
+ */
+static pthread_mutex_t s_statusMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_statusKnown;
+static SIM_Status s_status;
+static unsigned int s_statusEpoch;
+static unsigned int s_statusHits;
+static unsigned int s_statusQueries;
+static unsigned int s_statusInvalidations;
+
+static void resetAccessPredictor(void);
+static void forgetSelectPositions(void);
+static void setSimStatus(SIM_Status status);
+
 int get_pending_hotswap(void)
 {
     return sim_hotswap;
@@ -328,6 +407,8 @@ void onSimStateChanged(const char *s)
     switch (state) {
     case 7: /* SIM STATE POWER OFF, or indicating no SIM inserted. */
         s_simResetting = 1;
+        simCacheFlush(0);
+        invalidateSimCard();
         setRadioState(RADIO_STATE_SIM_LOCKED_OR_ABSENT);
         break;
     case 4: /* SIM STATE WAIT FOR PIN */
@@ -366,6 +447,21 @@ void onSimStateChanged(const char *s)
         break;
     }
 
+    /*
+     * None of the states tells the status for sure: an ACTIVE card may
+     * still be behind a personalisation lock. The next AT+CPIN? decides.
+     */
+    invalidateSimStatus();
+
+    /* The SIM has settled, no need to wait for the next poll. */
+    if ((state == 4 || state == 5) &&
+        getRadioState() == RADIO_STATE_SIM_NOT_READY) {
+        pthread_mutex_lock(&s_simPollMutex);
+        s_simPollUrcTriggers++;
+        pthread_mutex_unlock(&s_simPollMutex);
+        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL, NULL);
+    }
+
     RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
 
 finally:
@@ -382,6 +478,8 @@ void onSimHotswap(const char *s)
     if (strcmp ("*EESIMSWAP:0", s) == 0) {
         LOGD("%s() SIM Removed", __func__);
         s_simRemoved = 1;
+        simCacheFlush(0);
+        invalidateSimCard();
         /* Toggle radio state since Android won't
          * poll the sim state unless the radio
          * state has changed from the previous
@@ -389,9 +487,12 @@ void onSimHotswap(const char *s)
          */
         setRadioState(RADIO_STATE_SIM_NOT_READY);
         setRadioState(RADIO_STATE_SIM_LOCKED_OR_ABSENT);
+        setSimStatus(SIM_ABSENT);
     } else if (strcmp ("*EESIMSWAP:1", s) == 0) {
         LOGD("%s() SIM Inserted", __func__);
         s_simRemoved = 0;
+        simCacheFlush(0);
+        invalidateSimCard();
         set_pending_hotswap(1);
     } else
         LOGD("%s() Uknown Hot Swap Event: %s", __func__, s);
@@ -439,8 +540,36 @@ static int getNumRetries (int request) {
     return num_retries;
 }
 
+/* Must be called with s_statusMutex held. */
+static void storeSimStatus(SIM_Status status)
+{
+    s_status = status;
+    s_statusKnown = 1;
+    s_statusEpoch++;
+}
+
+static void setSimStatus(SIM_Status status)
+{
+    pthread_mutex_lock(&s_statusMutex);
+    storeSimStatus(status);
+    pthread_mutex_unlock(&s_statusMutex);
+}
+
+/**
+ * Makes the next GET_SIM_STATUS ask the modem, as the SIM status may
+ * have changed in a way not reported.
+ */
+void invalidateSimStatus(void)
+{
+    pthread_mutex_lock(&s_statusMutex);
+    s_statusKnown = 0;
+    s_statusEpoch++;
+    s_statusInvalidations++;
+    pthread_mutex_unlock(&s_statusMutex);
+}
+
 /** Returns one of SIM_*. Returns SIM_NOT_READY on error. */
-static SIM_Status getSIMStatus(void)
+static SIM_Status querySIMStatus(void)
 {
     ATResponse *atresponse = NULL;
     int err;
@@ -572,6 +701,98 @@ done:
     return ret;
 }
 
+/**
+ * Asks the modem for the SIM status, noting it for GET_SIM_STATUS.
+ * SIM_NOT_READY is left out, it only lasts until the next *ESIMSR or
+ * poll.
+ */
+static SIM_Status getSIMStatus(void)
+{
+    SIM_Status status;
+    unsigned int epoch;
+
+    pthread_mutex_lock(&s_statusMutex);
+    epoch = s_statusEpoch;
+    s_statusQueries++;
+    pthread_mutex_unlock(&s_statusMutex);
+
+    status = querySIMStatus();
+
+    pthread_mutex_lock(&s_statusMutex);
+    if (status != SIM_NOT_READY && epoch == s_statusEpoch &&
+        getRadioState() != RADIO_STATE_OFF &&
+        getRadioState() != RADIO_STATE_UNAVAILABLE)
+        storeSimStatus(status);
+    pthread_mutex_unlock(&s_statusMutex);
+
+    return status;
+}
+
+/** The SIM status as last seen, asking the modem only if unknown. */
+static SIM_Status getCachedSIMStatus(void)
+{
+    SIM_Status status;
+
+    if (s_simRemoved)
+        return SIM_ABSENT;
+
+    if (getRadioState() == RADIO_STATE_OFF ||
+        getRadioState() == RADIO_STATE_UNAVAILABLE)
+        return SIM_NOT_READY;
+
+    pthread_mutex_lock(&s_statusMutex);
+    if (s_statusKnown) {
+        s_statusHits++;
+        status = s_status;
+        pthread_mutex_unlock(&s_statusMutex);
+        return status;
+    }
+    pthread_mutex_unlock(&s_statusMutex);
+
+    return getSIMStatus();
+}
+
+/* Must be called with s_cardMutex held. */
+static void syncSimCard(void)
+{
+    if (s_card.epoch == s_cardEpoch)
+        return;
+
+    if (s_card.epoch != 0) {
+        LOGD("%s() Card changed, context rebuilt", __func__);
+        s_cardRebuilds++;
+    }
+    s_card.epoch = 0;
+    __sync_synchronize();
+    s_card.type = UICC_TYPE_UNKNOWN;
+    s_card.lc = 0;
+    __sync_synchronize();
+    s_card.epoch = s_cardEpoch;
+}
+
+/*
+ * Returns whether a field of s_card read between the two reads of
+ * s_card.epoch, epoch being the first, belongs to the current card.
+ */
+static int sameSimCard(unsigned int epoch)
+{
+    __sync_synchronize();
+    return epoch != 0 && epoch == s_card.epoch && epoch == s_cardEpoch;
+}
+
+/**
+ * Forgets all that is known about the card, as it has been swapped or
+ * reset. Safe to call from the reader thread.
+ */
+void invalidateSimCard(void)
+{
+    s_cardEpoch++;
+    resetAccessPredictor();
+    forgetSelectPositions();
+    invalidateSimStatus();
+    invalidateSimFileFormats();
+}
+
 /**
  * Fetch information about UICC card type (SIM/USIM)
  *
@@ -580,7 +801,8 @@ done:
 static UICC_Type getUICCType(void)
 {
     ATResponse *atresponse = NULL;
-    static UICC_Type UiccType = UICC_TYPE_UNKNOWN;
+    UICC_Type UiccType;
+    unsigned int epoch;
     int err;
 
     if (getRadioState() == RADIO_STATE_OFF ||
@@ -588,47 +810,56 @@ static UICC_Type getUICCType(void)
         return UICC_TYPE_UNKNOWN;
     }
 
-    if (UiccType == UICC_TYPE_UNKNOWN) {
+    /* Same card as last time. */
+    epoch = s_card.epoch;
+    __sync_synchronize();
+    UiccType = s_card.type;
+    if (sameSimCard(epoch) && UiccType != UICC_TYPE_UNKNOWN)
+        return UiccType;
+
+    pthread_mutex_lock(&s_cardMutex);
+    syncSimCard();
+
+    if (s_card.type == UICC_TYPE_UNKNOWN) {
         err = at_send_command_singleline("AT+CUAD", "+CUAD:", &atresponse);
         if (err == AT_NOERROR) {
             /* USIM */
             if(strstr(atresponse->p_intermediates->line, USIM_APPLICATION_ID)){
-                UiccType = UICC_TYPE_USIM;
+                s_card.type = UICC_TYPE_USIM;
                 LOGI("Detected card type USIM - stored");
             } else {
                 /* should maybe be unknown */
-                UiccType = UICC_TYPE_SIM;
+                s_card.type = UICC_TYPE_SIM;
             }
         } else if (at_get_error_type(err) != AT_ERROR) {
             /* Command failed - unknown card */
-            UiccType = UICC_TYPE_UNKNOWN;
+            s_card.type = UICC_TYPE_UNKNOWN;
             LOGE("%s() Failed to detect card type - Retry at next request", __func__);
         } else {
             /* Legacy SIM */
             /* TODO: CUAD only responds OK if SIM is inserted.
              *       This is an inccorect AT response...
              */
-            UiccType = UICC_TYPE_SIM;
+            s_card.type = UICC_TYPE_SIM;
             LOGI("Detected card type Legacy SIM - stored");
         }
         at_response_free(atresponse);
     }
 
+    UiccType = s_card.type;
+    pthread_mutex_unlock(&s_cardMutex);
+
     return UiccType;
 }
 
-
 /**
- * Get the current card status.
- *
- * This must be freed using freeCardStatus.
- * @return: On success returns RIL_E_SUCCESS.
+ * Get the current card status, as last seen.
  */
-static int getCardStatus(RIL_CardStatus_v6 **pp_card_status) {
+static void getCardStatus(RIL_CardStatus_v6 *p_card_status) {
     RIL_CardState card_state;
     int num_apps;
 
-    SIM_Status sim_status = getSIMStatus();
+    SIM_Status sim_status = getCachedSIMStatus();
     if (sim_status == SIM_ABSENT) {
         card_state = RIL_CARDSTATE_ABSENT;
         num_apps = 0;
@@ -637,8 +868,7 @@ static int getCardStatus(RIL_CardStatus_v6 **pp_card_status) {
         num_apps = 1;
     }
 
-    /* Allocate and initialize base card status. */
-    RIL_CardStatus_v6 *p_card_status = malloc(sizeof(RIL_CardStatus_v6));
+    /* Initialize base card status. */
     p_card_status->card_state = card_state;
     p_card_status->universal_pin_state = RIL_PINSTATE_UNKNOWN;
     p_card_status->gsm_umts_subscription_app_index = -1;
@@ -668,16 +898,67 @@ static int getCardStatus(RIL_CardStatus_v6 **pp_card_status) {
             p_card_status->applications[0].app_type = RIL_APPTYPE_USIM;
         }
     }
+}
+
+static void pollSIMStateLater(void *param)
+{
+    int current;
+
+    pthread_mutex_lock(&s_simPollMutex);
+    current = (unsigned long) param == s_simPoll.seq;
+    if (current)
+        s_simPollFallbacks++;
+    pthread_mutex_unlock(&s_simPollMutex);
 
-    *pp_card_status = p_card_status;
-    return RIL_E_SUCCESS;
+    if (current)
+        pollSIMState(NULL);
 }
 
-/**
- * Free the card status returned by getCardStatus.
- */
-static void freeCardStatus(RIL_CardStatus_v6 *p_card_status) {
-    free(p_card_status);
+/* Polls again after the next fallback delay, unless a URC comes first. */
+static void scheduleSIMPoll(unsigned long seq)
+{
+    struct timespec delay;
+    int msec;
+
+    pthread_mutex_lock(&s_simPollMutex);
+    if (!getPropertyInt(SIM_POLL_BACKOFF_PROPERTY, 1))
+        msec = TIMEVAL_SIMPOLL.tv_sec * 1000;
+    else {
+        msec = s_simPoll.delayMsec;
+        s_simPoll.delayMsec = msec * 2 < SIM_POLL_MAX_MSEC ?
+            msec * 2 : SIM_POLL_MAX_MSEC;
+    }
+    pthread_mutex_unlock(&s_simPollMutex);
+
+    delay.tv_sec = msec / 1000;
+    delay.tv_nsec = (msec % 1000) * 1000000L;
+    enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMStateLater, (void *) seq,
+                    &delay);
+}
+
+/* Ends the wait, timing it if the SIM turned ready without a PIN. */
+static void endSIMPollWait(int ready)
+{
+    struct timespec now;
+    long long msec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_simPollMutex);
+    if (s_simPoll.waiting && ready) {
+        msec = timespecDiffMsec(&s_simPoll.since, &now);
+        s_simReadyCount++;
+        s_simReadyLastMsec = msec;
+        s_simReadyLastPolls = s_simPoll.polls;
+        if (s_simReadyMinMsec < 0 || msec < s_simReadyMinMsec)
+            s_simReadyMinMsec = msec;
+        if (msec > s_simReadyMaxMsec)
+            s_simReadyMaxMsec = msec;
+        LOGI("%s() SIM ready %lld ms after radio on or reset, %d polls",
+             __func__, msec, s_simPoll.polls);
+    }
+    s_simPoll.waiting = 0;
+    pthread_mutex_unlock(&s_simPollMutex);
 }
 
 /**
@@ -687,23 +968,36 @@ static void freeCardStatus(RIL_CardStatus_v6 *p_card_status) {
  */
 void pollSIMState(void *param)
 {
+    unsigned long seq;
+
     if (((int) param) != 1 &&
         getRadioState() != RADIO_STATE_SIM_NOT_READY &&
         getRadioState() != RADIO_STATE_SIM_LOCKED_OR_ABSENT)
         /* No longer valid to poll. */
         return;
 
+    pthread_mutex_lock(&s_simPollMutex);
+    seq = ++s_simPoll.seq;
+    if (!s_simPoll.waiting && getRadioState() == RADIO_STATE_SIM_NOT_READY) {
+        s_simPoll.waiting = 1;
+        s_simPoll.polls = 0;
+        s_simPoll.delayMsec = SIM_POLL_MIN_MSEC;
+        clock_gettime(CLOCK_MONOTONIC, &s_simPoll.since);
+    }
+    s_simPoll.polls++;
+    pthread_mutex_unlock(&s_simPollMutex);
+
     switch (getSIMStatus()) {
     case SIM_NOT_READY:
         LOGI("SIM_NOT_READY, poll for sim state.");
-        enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL,
-                        &TIMEVAL_SIMPOLL);
+        scheduleSIMPoll(seq);
         return;
 
     case SIM_PIN2:
     case SIM_PUK2:
     case SIM_PUK2_PERM_BLOCKED:
     case SIM_READY:
+        endSIMPollWait(1);
         setRadioState(RADIO_STATE_SIM_READY);
         return;
     case SIM_ABSENT:
@@ -723,6 +1017,7 @@ void pollSIMState(void *param)
     case SIM_CORPORATE_PERSO_PUK:
     /* pass through, do not break */
     default:
+        endSIMPollWait(0);
         setRadioState(RADIO_STATE_SIM_LOCKED_OR_ABSENT);
         return;
     }
@@ -739,37 +1034,38 @@ void pollSIMState(void *param)
 void requestGetSimStatus(void *data, size_t datalen, RIL_Token t)
 {
     (void) data; (void) datalen;
-    RIL_CardStatus_v6* p_card_status = NULL;
+    RIL_CardStatus_v6 card_status;
 
-    if (getCardStatus(&p_card_status) != RIL_E_SUCCESS)
-        goto error;
-
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, (char*)p_card_status, sizeof(*p_card_status));
-
-finally:
-    if (p_card_status != NULL)
-        freeCardStatus(p_card_status);
-    return;
-
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    goto finally;
+    getCardStatus(&card_status);
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &card_status, sizeof(card_status));
 }
 
 static int simIOGetLogicalChannel(void)
 {
     ATResponse *atresponse = NULL;
-    static int g_lc = 0;
+    unsigned int epoch;
+    int lc;
     int err;
 
-    if (g_lc == 0) {
-        struct tlv tlvApp, tlvAppId;
+    /* Same card as last time. */
+    epoch = s_card.epoch;
+    __sync_synchronize();
+    lc = s_card.lc;
+    if (sameSimCard(epoch) && lc != 0)
+        return lc;
+
+    pthread_mutex_lock(&s_cardMutex);
+    syncSimCard();
+
+    if (s_card.lc == 0) {
+        struct berTlvIter it;
+        struct berTlv tlvApp, tlvAppId;
         char *line;
         char *resp;
 
         err = at_send_command_singleline("AT+CUAD", "+CUAD:", &atresponse);
         if (err != AT_NOERROR)
-            return g_lc;
+            goto finally;
 
         line = atresponse->p_intermediates->line;
         err = at_tok_start(&line);
@@ -780,52 +1076,153 @@ static int simIOGetLogicalChannel(void)
         if (err < 0)
             goto finally;
 
-        err = parseTlv(resp, &resp[strlen(resp)], &tlvApp);
-        if (err < 0)
-            goto finally;
-        if (tlvApp.tag != 0x61) { /* Application */
+        /* The Application ID may come after a label or other data. */
+        berTlvInit(&it, resp, strlen(resp), BER_TLV_HEX);
+        if (berTlvFind(&it, 0x61, &tlvApp) <= 0) { /* Application */
             err = -EINVAL;
             goto finally;
         }
 
-        err = parseTlv(tlvApp.data, tlvApp.end, &tlvAppId);
-        if (err < 0)
-            goto finally;
-        if (tlvAppId.tag != 0x4F) { /* Application ID */
+        berTlvEnter(&it, &tlvApp, 0);
+        if (berTlvFind(&it, 0x4F, &tlvAppId) <= 0) { /* Application ID */
             err = -EINVAL;
             goto finally;
         }
 
         at_response_free(atresponse);
-        err = at_send_command_singleline("AT+CCHO=\"%.*s\"", "+CCHO:", &atresponse, tlvAppId.end - tlvAppId.data, tlvAppId.data);
+        atresponse = NULL;
+        err = at_send_command_singleline("AT+CCHO=\"%.*s\"", "+CCHO:", &atresponse, (int) (tlvAppId.end - tlvAppId.value), tlvAppId.value);
         if (err != AT_NOERROR)
-            return g_lc;
+            goto finally;
         line = atresponse->p_intermediates->line;
         err = at_tok_start(&line);
         if (err < 0)
             goto finally;
 
-        err = at_tok_nextint(&line, &g_lc);
+        err = at_tok_nextint(&line, &lc);
         if (err < 0)
             goto finally;
+        s_card.lc = lc;
     }
 
 finally:
+    lc = s_card.lc;
+    pthread_mutex_unlock(&s_cardMutex);
     at_response_free(atresponse);
-    return g_lc;
+    return lc;
 }
 
-static int simIOSelectFile(unsigned short fileid)
+/*
+ * Where each logical channel stands in the file tree, so that a SELECT
+ * is only sent for the part of the path that differs. The MF, the USIM
+ * ADF and the parent of the current DF can be selected from anywhere
+ * in the tree, children only from their parent (TS 102 221 8.4.1).
+ * Forgotten whenever a SELECT fails or the card is reset or swapped.
+ * Guarded by s_selectMutex.
+ */
+#define SIM_SELECT_CHANNELS 4
+#define SIM_SELECT_MAX_DEPTH 10
+#define SIM_IO_BURST_GAP_MSEC 500
+
+struct simChannelPosition {
+    int lc;                     /* 0 if unused */
+    int valid;
+    int depth;                  /* DFs from the MF down, MF included */
+    unsigned short df[SIM_SELECT_MAX_DEPTH];
+    unsigned short ef;          /* 0 if the last DF is current */
+};
+
+static pthread_mutex_t s_selectMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct simChannelPosition s_positions[SIM_SELECT_CHANNELS];
+static unsigned int s_positionGeneration;
+static unsigned int s_selectSent;
+static unsigned int s_selectSaved;
+static unsigned int s_selectSkipped;
+
+/*
+ * SIM I/O requests less than SIM_IO_BURST_GAP_MSEC apart make a burst,
+ * the framework reads its files in those.
+ */
+static struct {
+    struct timespec last;
+    unsigned int requests;
+    unsigned int sent;
+    unsigned int saved;
+} s_ioBurst;
+static unsigned int s_ioBursts;
+static unsigned int s_ioBurstLastRequests;
+static unsigned int s_ioBurstLastSent;
+static unsigned int s_ioBurstLastSaved;
+static unsigned int s_ioBurstMaxSaved;
+
+/* Must be called with s_selectMutex held. */
+static struct simChannelPosition *findPosition(int lc)
+{
+    struct simChannelPosition *unused = NULL;
+    int i;
+
+    for (i = 0; i < SIM_SELECT_CHANNELS; i++) {
+        if (s_positions[i].lc == lc)
+            return &s_positions[i];
+        if (unused == NULL && s_positions[i].lc == 0)
+            unused = &s_positions[i];
+    }
+
+    if (unused == NULL)
+        unused = &s_positions[0];
+    memset(unused, 0, sizeof(*unused));
+    unused->lc = lc;
+    return unused;
+}
+
+/* Forgets where the channels stand, for a reset or new card. */
+static void forgetSelectPositions(void)
+{
+    pthread_mutex_lock(&s_selectMutex);
+    memset(s_positions, 0, sizeof(s_positions));
+    s_positionGeneration++;
+    pthread_mutex_unlock(&s_selectMutex);
+}
+
+/* Closes the burst in progress if the previous request is long gone. */
+static void noteSimIORequest(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s_selectMutex);
+    if (s_ioBurst.requests > 0 &&
+        timespecDiffMsec(&s_ioBurst.last, &now) >= SIM_IO_BURST_GAP_MSEC) {
+        if (s_ioBurst.saved > 0)
+            LOGD("%s() SIM I/O burst of %u requests: %u SELECTs sent, "
+                 "%u saved", __func__, s_ioBurst.requests, s_ioBurst.sent,
+                 s_ioBurst.saved);
+        s_ioBursts++;
+        s_ioBurstLastRequests = s_ioBurst.requests;
+        s_ioBurstLastSent = s_ioBurst.sent;
+        s_ioBurstLastSaved = s_ioBurst.saved;
+        if (s_ioBurst.saved > s_ioBurstMaxSaved)
+            s_ioBurstMaxSaved = s_ioBurst.saved;
+        memset(&s_ioBurst, 0, sizeof(s_ioBurst));
+    }
+    s_ioBurst.requests++;
+    s_ioBurst.last = now;
+    pthread_mutex_unlock(&s_selectMutex);
+}
+
+static int simIOSelectFile(int lc, unsigned short fileid)
 {
     int err = 0;
-    unsigned short lc = simIOGetLogicalChannel();
     ATResponse *atresponse = NULL;
     char *line;
     char *resp;
     int resplen;
 
-    if (lc == 0)
-        return -EIO;
+    pthread_mutex_lock(&s_selectMutex);
+    s_selectSent++;
+    s_ioBurst.sent++;
+    pthread_mutex_unlock(&s_selectMutex);
 
     err = at_send_command_singleline("AT+CGLA=%d,14,\"00A4000C02%.4X\"", "+CGLA:", &atresponse, lc, fileid);
     if (at_get_error_type(err) == AT_ERROR)
@@ -857,42 +1254,134 @@ finally:
     return err;
 }
 
+/* The MF, DFs and ADFs: 3Fxx, 7Fxx and 5Fxx (TS 102 221 8.2). */
+static int isDedicatedFile(unsigned short fileid)
+{
+    return (fileid >> 8) == 0x3F || (fileid >> 8) == 0x7F ||
+        (fileid >> 8) == 0x5F;
+}
+
+/*
+ * Selects fileid under path on the logical channel, starting from where
+ * the channel stands when that takes fewer SELECTs than from the MF.
+ * fileid may be a DF as well, the channel then stands inside it.
+ */
 static int simIOSelectPath(const char *path, unsigned short fileid)
 {
     int err = 0;
-    size_t path_len = 0;
-    size_t pos;
-    static char cashed_path[4 * 10 + 1] = {'\0'};
-    static unsigned short cashed_fileid = 0;
+    int lc = simIOGetLogicalChannel();
+    struct simChannelPosition pos;
+    unsigned short df[SIM_SELECT_MAX_DEPTH];
+    unsigned int generation;
+    size_t path_len;
+    int depth, common, up, climb, from, i;
+    int full, saved;
+
+    if (lc == 0)
+        return -EIO;
 
     if (path == NULL)
         path = "3F00";
 
     path_len = strlen(path);
-
-    if (path_len & 3)
+    if (path_len == 0 || (path_len & 3) ||
+        path_len / 4 > SIM_SELECT_MAX_DEPTH)
         return -EINVAL;
 
-    if ((fileid != cashed_fileid) || (strcmp(path, cashed_path) != 0)) {
-        for(pos = 0; pos < path_len; pos += 4) {
-            unsigned val;
+    depth = path_len / 4;
+    for (i = 0; i < depth; i++) {
+        unsigned val;
 
-            if(sscanf(&path[pos], "%4X", &val) != 1)
-                return -EINVAL;
+        if (sscanf(&path[i * 4], "%4X", &val) != 1)
+            return -EINVAL;
+        df[i] = val;
+    }
 
-            err = simIOSelectFile(val);
-            if (err < 0)
-                return err;
-        }
-        err = simIOSelectFile(fileid);
+    pthread_mutex_lock(&s_selectMutex);
+    pos = *findPosition(lc);
+    generation = s_positionGeneration;
+    pthread_mutex_unlock(&s_selectMutex);
+
+    /* Savings count against re-selecting from the MF. */
+    full = depth + 1;
+
+    common = 0;
+    if (pos.valid)
+        while (common < depth && common < pos.depth &&
+               df[common] == pos.df[common])
+            common++;
+
+    if (common == depth && pos.depth == depth && pos.ef == fileid) {
+        pthread_mutex_lock(&s_selectMutex);
+        s_selectSkipped++;
+        s_selectSaved += full;
+        s_ioBurst.saved += full;
+        pthread_mutex_unlock(&s_selectMutex);
+        return 0;
     }
-    if (path_len < sizeof(cashed_path)) {
-        strcpy(cashed_path, path);
-        cashed_fileid = fileid;
-    } else {
-        cashed_path[0] = '\0';
-        cashed_fileid = 0;
+
+    /*
+     * Climb from the current DF to the deepest DF the paths share and
+     * descend from there, if that beats starting over from the MF. One
+     * SELECT climbs to the parent, the MF or the USIM ADF.
+     */
+    climb = -1;
+    if (common > 0) {
+        up = pos.depth - common;
+        if (up == 0)
+            climb = 0;
+        else if (up == 1 || common == 1 || df[common - 1] == 0x7FFF)
+            climb = 1;
+        else
+            climb = up;
+        if (climb + depth - common >= depth)
+            climb = -1;
     }
+    from = climb < 0 ? 0 : common;
+
+    if (climb == 1)
+        err = simIOSelectFile(lc, df[common - 1]);
+    else
+        for (i = pos.depth - 2; climb > 1 && err >= 0 && i >= common - 1; i--)
+            err = simIOSelectFile(lc, pos.df[i]);
+
+    for (i = from; err >= 0 && i < depth; i++)
+        err = simIOSelectFile(lc, df[i]);
+
+    if (err >= 0)
+        err = simIOSelectFile(lc, fileid);
+
+    pthread_mutex_lock(&s_selectMutex);
+    if (err >= 0 && climb >= 0) {
+        saved = full - climb - (depth - from) - 1;
+        s_selectSaved += saved;
+        s_ioBurst.saved += saved;
+    }
+    /* Unless a reset meanwhile has forgotten the channel already. */
+    if (generation == s_positionGeneration) {
+        struct simChannelPosition *p = findPosition(lc);
+
+        p->valid = err >= 0;
+        p->depth = depth;
+        memcpy(p->df, df, depth * sizeof(df[0]));
+        p->ef = fileid;
+
+        if (fileid == 0x3F00 || fileid == 0x7FFF) {
+            /* Wherever path was, those are found from the MF. */
+            p->depth = fileid == 0x3F00 ? 1 : 2;
+            p->df[0] = 0x3F00;
+            p->df[1] = 0x7FFF;
+            p->ef = 0;
+        } else if (isDedicatedFile(fileid)) {
+            if (depth < SIM_SELECT_MAX_DEPTH) {
+                p->df[p->depth++] = fileid;
+                p->ef = 0;
+            } else
+                p->valid = 0;
+        }
+    }
+    pthread_mutex_unlock(&s_selectMutex);
+
     return err;
 }
 
@@ -1051,9 +1540,131 @@ finally:
     return err;
 }
 
+/*
+ * Some cards answer AT+CRSM for a file, others only AT+CGLA. Which one
+ * worked is learnt per file and per DF, and tried first next time. A
+ * file never seen goes by its DF, then by AT+CRSM. Forgotten when the
+ * card is swapped or reset. Guarded by s_accessMutex.
+ */
+enum {
+    SIM_ACCESS_CRSM,
+    SIM_ACCESS_CGLA,
+    SIM_ACCESS_METHODS
+};
+
+#define SIM_ACCESS_ENTRIES 64
+#define SIM_ACCESS_PATH_LEN (4 * 10 + 1)
+
+struct simAccessEntry {
+    int valid;
+    int fileid;                 /* -1 for the DF as a whole */
+    char path[SIM_ACCESS_PATH_LEN];
+    int method;
+    unsigned int lastUsed;
+};
+
+static pthread_mutex_t s_accessMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct simAccessEntry s_access[SIM_ACCESS_ENTRIES];
+static unsigned int s_accessClock;
+static unsigned int s_accessFirstTry[SIM_ACCESS_METHODS];
+static unsigned int s_accessFallback[SIM_ACCESS_METHODS];
+static unsigned int s_accessFailed;
+static unsigned int s_accessResets;
+
+static const char *s_accessNames[SIM_ACCESS_METHODS] = { "crsm", "cgla" };
+
+/* Must be called with s_accessMutex held. */
+static struct simAccessEntry *findAccess(const char *path, int fileid,
+                                         int create)
+{
+    struct simAccessEntry *oldest = &s_access[0];
+    int i;
+
+    for (i = 0; i < SIM_ACCESS_ENTRIES; i++) {
+        struct simAccessEntry *e = &s_access[i];
+
+        if (e->valid && e->fileid == fileid && !strcasecmp(e->path, path))
+            return e;
+        if (!e->valid || (oldest->valid && e->lastUsed < oldest->lastUsed))
+            oldest = e;
+    }
+
+    if (!create || strlen(path) >= SIM_ACCESS_PATH_LEN)
+        return NULL;
+
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->valid = 1;
+    oldest->fileid = fileid;
+    strcpy(oldest->path, path);
+    return oldest;
+}
+
+static int predictAccess(const char *path, int fileid)
+{
+    struct simAccessEntry *e;
+    int method = SIM_ACCESS_CRSM;
+
+    pthread_mutex_lock(&s_accessMutex);
+    e = findAccess(path, fileid, 0);
+    if (e == NULL)
+        e = findAccess(path, -1, 0);
+    if (e != NULL) {
+        e->lastUsed = ++s_accessClock;
+        method = e->method;
+    }
+    pthread_mutex_unlock(&s_accessMutex);
+
+    return method;
+}
+
+static void learnAccess(const char *path, int fileid, int method)
+{
+    struct simAccessEntry *e;
+
+    pthread_mutex_lock(&s_accessMutex);
+    e = findAccess(path, fileid, 1);
+    if (e != NULL) {
+        e->method = method;
+        e->lastUsed = ++s_accessClock;
+    }
+    e = findAccess(path, -1, 1);
+    if (e != NULL) {
+        e->method = method;
+        e->lastUsed = ++s_accessClock;
+    }
+    pthread_mutex_unlock(&s_accessMutex);
+}
+
+/* Forgets the access methods learnt, for a new card. */
+static void resetAccessPredictor(void)
+{
+    pthread_mutex_lock(&s_accessMutex);
+    memset(s_access, 0, sizeof(s_access));
+    s_accessResets++;
+    pthread_mutex_unlock(&s_accessMutex);
+}
+
+static int sendSimIOCmdWith(int method, const RIL_SIM_IO_v6 *ioargs,
+                            ATResponse **atresponse, RIL_SIM_IO_Response *sr)
+{
+    int err;
+
+    if (method == SIM_ACCESS_CGLA)
+        err = sendSimIOCmdUICC(ioargs, atresponse, sr);
+    else
+        err = sendSimIOCmdICC(ioargs, atresponse, sr);
+
+    /* Kept from the CRSM/CGLA workaround: either status byte may do. */
+    if (err < 0 || (sr->sw1 != 0x90 && sr->sw2 != 0x00))
+        return err < 0 ? err : 1;
+    return 0;
+}
+
 static int sendSimIOCmd(const RIL_SIM_IO_v6 *ioargs, ATResponse **atresponse, RIL_SIM_IO_Response *sr)
 {
     int err;
+    int method, other;
+    const char *path = ioargs->path != NULL ? ioargs->path : "";
     UICC_Type UiccType;
 
     if (sr == NULL)
@@ -1062,115 +1673,223 @@ static int sendSimIOCmd(const RIL_SIM_IO_v6 *ioargs, ATResponse **atresponse, RI
     /* Detect card type to determine which SIM access command to use */
     UiccType = getUICCType();
 
+    if (UiccType == UICC_TYPE_SIM)
+        return sendSimIOCmdICC(ioargs, atresponse, sr);
+
     /*
      * FIXME WORKAROUND: Currently GCLA works from some files on some cards
      * and CRSM works on some files for some cards...
-     * Trying with CRSM first and retry with CGLA if needed
+     * Trying the method that worked before first and retry with the
+     * other one if needed
      */
-    err = sendSimIOCmdICC(ioargs, atresponse, sr);
-    if ((err < 0 || (sr->sw1 != 0x90 && sr->sw2 != 0x00)) &&
-            UiccType != UICC_TYPE_SIM) {
-        at_response_free(*atresponse);
-        *atresponse = NULL;
-        LOGD("%s() Retrying with CGLA access...", __func__);
-        err = sendSimIOCmdUICC(ioargs, atresponse, sr);
+    method = predictAccess(path, ioargs->fileid);
+    err = sendSimIOCmdWith(method, ioargs, atresponse, sr);
+    if (err == 0) {
+        learnAccess(path, ioargs->fileid, method);
+        pthread_mutex_lock(&s_accessMutex);
+        s_accessFirstTry[method]++;
+        pthread_mutex_unlock(&s_accessMutex);
+        return 0;
     }
+
+    other = method == SIM_ACCESS_CRSM ? SIM_ACCESS_CGLA : SIM_ACCESS_CRSM;
+    at_response_free(*atresponse);
+    *atresponse = NULL;
+    LOGD("%s() Retrying with %s access...", __func__, s_accessNames[other]);
+    err = sendSimIOCmdWith(other, ioargs, atresponse, sr);
+
+    pthread_mutex_lock(&s_accessMutex);
+    if (err == 0)
+        s_accessFallback[other]++;
+    else
+        s_accessFailed++;
+    pthread_mutex_unlock(&s_accessMutex);
+
+    if (err == 0)
+        learnAccess(path, ioargs->fileid, other);
     /* END WORKAROUND */
 
-    /* reintroduce below code when workaround is not needed */
-    /* if (UiccType == UICC_TYPE_SIM)
-        err = sendSimIOCmdICC(ioargs, atresponse, sr);
-    else {
-        err = sendSimIOCmdUICC(ioargs, atresponse, sr);
-    } */
+    return err < 0 ? err : 0;
+}
 
-    return err;
+/*
+ * GET RESPONSE answers of a USIM as converted to TS 51.011, per file and
+ * path. The framework asks for them before each file it reads, again
+ * and again while loading the phonebook and SMS, and they do not change
+ * until the card or its applications are initialised anew.
+ */
+#define SIM_FCP_MEMO_ENTRIES 32
+
+struct simFcpMemo {
+    int valid;
+    int fileid;
+    char path[SIM_ACCESS_PATH_LEN];
+    int sw1;
+    int sw2;
+    char response[TS_51011_921_RESP_HEX_LEN];
+};
+
+static pthread_mutex_t s_fcpMemoMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct simFcpMemo s_fcpMemo[SIM_FCP_MEMO_ENTRIES];
+static int s_fcpMemoNext;
+static unsigned int s_fcpMemoGeneration;
+static unsigned int s_fcpMemoHits;
+static unsigned int s_fcpMemoMisses;
+static unsigned int s_fcpMemoClears;
+
+static unsigned int fcpMemoGeneration(void)
+{
+    unsigned int generation;
+
+    pthread_mutex_lock(&s_fcpMemoMutex);
+    generation = s_fcpMemoGeneration;
+    pthread_mutex_unlock(&s_fcpMemoMutex);
+
+    return generation;
 }
 
-static int convertSimIoFcp(RIL_SIM_IO_Response *sr, char **cvt)
+/* Returns the entry for ioargs, NULL if none. Call with s_fcpMemoMutex held. */
+static struct simFcpMemo *findFcpMemo(const RIL_SIM_IO_v6 *ioargs)
 {
-    int err;
-    /* size_t pos; */
-    size_t fcplen;
-    struct ts_51011_921_resp resp;
-    void *cvt_buf = NULL;
+    const char *path = ioargs->path != NULL ? ioargs->path : "";
+    int i;
 
-    if (!sr->simResponse || !cvt) {
-        err = -EINVAL;
-        goto error;
-    }
+    for (i = 0; i < SIM_FCP_MEMO_ENTRIES; i++)
+        if (s_fcpMemo[i].valid && s_fcpMemo[i].fileid == ioargs->fileid &&
+            strcasecmp(s_fcpMemo[i].path, path) == 0)
+            return &s_fcpMemo[i];
+    return NULL;
+}
 
-    fcplen = strlen(sr->simResponse);
-    if ((fcplen == 0) || (fcplen & 1)) {
-        err = -EINVAL;
-        goto error;
-    }
+/*
+ * Answers a GET RESPONSE from the memo into cvt. Returns 0 if it could,
+ * -1 if not.
+ */
+static int lookupFcpMemo(const RIL_SIM_IO_v6 *ioargs, RIL_SIM_IO_Response *sr,
+                         char *cvt)
+{
+    struct simFcpMemo *memo;
+
+    pthread_mutex_lock(&s_fcpMemoMutex);
+    memo = findFcpMemo(ioargs);
+    if (memo != NULL) {
+        memcpy(cvt, memo->response, sizeof(memo->response));
+        sr->sw1 = memo->sw1;
+        sr->sw2 = memo->sw2;
+        sr->simResponse = cvt;
+        s_fcpMemoHits++;
+    } else
+        s_fcpMemoMisses++;
+    pthread_mutex_unlock(&s_fcpMemoMutex);
 
-    err = fcp_to_ts_51011(sr->simResponse, fcplen, &resp);
-    if (err < 0)
-        goto error;
+    return memo != NULL ? 0 : -1;
+}
 
-    cvt_buf = malloc(sizeof(resp) * 2 + 1);
-    if (!cvt_buf) {
-        err = -ENOMEM;
-        goto error;
-    }
+/*
+ * Keeps a converted GET RESPONSE, unless the memo was cleared since
+ * generation was taken.
+ */
+static void storeFcpMemo(const RIL_SIM_IO_v6 *ioargs,
+                         const RIL_SIM_IO_Response *sr,
+                         unsigned int generation)
+{
+    const char *path = ioargs->path != NULL ? ioargs->path : "";
+    struct simFcpMemo *memo;
 
-    err = binaryToString((unsigned char*)(&resp),
-                   sizeof(resp), cvt_buf);
-    if (err < 0)
-        goto error;
+    if (strlen(path) >= SIM_ACCESS_PATH_LEN)
+        return;
 
-    /* cvt_buf ownership is moved to the caller */
-    *cvt = cvt_buf;
-    cvt_buf = NULL;
+    pthread_mutex_lock(&s_fcpMemoMutex);
+    if (generation != s_fcpMemoGeneration)
+        goto finally;
+
+    memo = findFcpMemo(ioargs);
+    if (memo == NULL) {
+        memo = &s_fcpMemo[s_fcpMemoNext];
+        s_fcpMemoNext = (s_fcpMemoNext + 1) % SIM_FCP_MEMO_ENTRIES;
+    }
+    memo->valid = 1;
+    memo->fileid = ioargs->fileid;
+    strcpy(memo->path, path);
+    memo->sw1 = sr->sw1;
+    memo->sw2 = sr->sw2;
+    memcpy(memo->response, sr->simResponse, sizeof(memo->response));
 
 finally:
-    return err;
+    pthread_mutex_unlock(&s_fcpMemoMutex);
+}
 
-error:
-    free(cvt_buf);
-    goto finally;
+/**
+ * Forgets the converted GET RESPONSE answers, for a new card or after a
+ * REFRESH that may have changed its files. Safe from the reader thread.
+ */
+void invalidateSimFileFormats(void)
+{
+    pthread_mutex_lock(&s_fcpMemoMutex);
+    memset(s_fcpMemo, 0, sizeof(s_fcpMemo));
+    s_fcpMemoNext = 0;
+    s_fcpMemoGeneration++;
+    s_fcpMemoClears++;
+    pthread_mutex_unlock(&s_fcpMemoMutex);
 }
 
+/*
+ * Converts the FCP template of a USIM GET RESPONSE to the TS 51.011
+ * layout, into cvt of TS_51011_921_RESP_HEX_LEN characters.
+ */
+static int convertSimIoFcp(const RIL_SIM_IO_Response *sr, char *cvt)
+{
+    size_t fcplen;
 
-/**
- * RIL_REQUEST_SIM_IO
- *
- * Request SIM I/O operation.
- * This is similar to the TS 27.007 "restricted SIM" operation
- * where it assumes all of the EF selection will be done by the
- * callee.
+    if (!sr->simResponse || !cvt)
+        return -EINVAL;
+
+    fcplen = strlen(sr->simResponse);
+    if ((fcplen == 0) || (fcplen & 1))
+        return -EINVAL;
+
+    return fcp_to_ts_51011_hex(sr->simResponse, fcplen, cvt);
+}
+
+/*
+ * Performs a SIM I/O operation as the framework asks for it, answering
+ * reads from the file cache when possible. sr->simResponse points into
+ * *atresponse or *buf, both of which the caller frees, or for a GET
+ * RESPONSE converted to TS 51.011 into cvt, which holds
+ * TS_51011_921_RESP_HEX_LEN characters.
  */
-void requestSIM_IO(void *data, size_t datalen, RIL_Token t)
+static int simIO(const RIL_SIM_IO_v6 *ioargs, int prefetch,
+                 ATResponse **atresponse, RIL_SIM_IO_Response *sr, char **buf,
+                 char *cvt)
 {
-    (void) datalen;
-    ATResponse *atresponse = NULL;
-    RIL_SIM_IO_Response sr;
-    int cvt_done = 0;
-    int err;
+    int err = 0;
     UICC_Type UiccType = getUICCType();
-
+    unsigned int generation;
+    unsigned int memoGeneration = 0;
+    int convert;
+    int memo;
     int pathReplaced = 0;
     RIL_SIM_IO_v6 ioargsDup;
 
+    *buf = NULL;
+    noteSimIORequest();
+
     /*
      * Android telephony framework does not support USIM cards properly,
      * send GSM filepath where as active cardtype is USIM.
      * Android RIL needs to change the file path of files listed under ADF-USIM
      * if current active cardtype is USIM
      */
-    memcpy(&ioargsDup, data, sizeof(RIL_SIM_IO_v6));
+    memcpy(&ioargsDup, ioargs, sizeof(RIL_SIM_IO_v6));
     if (UICC_TYPE_USIM == UiccType) {
         unsigned int i;
-        int err;
         unsigned int count = sizeof(ef_usim_files) / sizeof(int);
 
         for (i = 0; i < count; i++) {
             if (ef_usim_files[i] == ioargsDup.fileid) {
                 err = asprintf(&ioargsDup.path, PATH_ADF_USIM_DIRECTORY);
                 if (err < 0)
-                    goto error;
+                    return err;
                 pathReplaced = 1;
                 LOGD("%s() Path replaced for USIM: %d", __func__, ioargsDup.fileid);
                 break;
@@ -1182,7 +1901,7 @@ void requestSIM_IO(void *data, size_t datalen, RIL_Token t)
                 if (ef_telecom_files[i] == ioargsDup.fileid) {
                     err = asprintf(&ioargsDup.path, PATH_ADF_TELECOM_DIRECTORY);
                     if (err < 0)
-                        goto error;
+                        return err;
                     pathReplaced = 1;
                     LOGD("%s() Path replaced for telecom: %d", __func__, ioargsDup.fileid);
                     break;
@@ -1191,33 +1910,214 @@ void requestSIM_IO(void *data, size_t datalen, RIL_Token t)
         }
     }
 
-    memset(&sr, 0, sizeof(sr));
-
-    err = sendSimIOCmd(&ioargsDup, &atresponse, &sr);
-
-    if (err < 0)
-        goto error;
+    memset(sr, 0, sizeof(*sr));
 
     /*
      * In case the command is GET_RESPONSE and cardtype is 3G SIM
-     * convert to 2G FCP
+     * convert to 2G FCP, or answer from what was converted before.
      */
-    if (ioargsDup.command == 0xC0 && UiccType != UICC_TYPE_SIM) {
-        err = convertSimIoFcp(&sr, &sr.simResponse);
+    convert = ioargsDup.command == 0xC0 && UiccType != UICC_TYPE_SIM;
+    memo = convert && UiccType == UICC_TYPE_USIM && simCacheEnabled();
+    if (memo) {
+        if (lookupFcpMemo(&ioargsDup, sr, cvt) == 0)
+            goto finally;
+        memoGeneration = fcpMemoGeneration();
+    }
+
+    if (simCacheLookup(&ioargsDup, sr, prefetch) == 0) {
+        *buf = sr->simResponse;
+        err = 0;
+    } else {
+        /* Whatever the outcome, what is cached may be stale now. */
+        if (ioargsDup.command == 0xD6 || ioargsDup.command == 0xDC)
+            simCacheInvalidateFile(ioargsDup.fileid);
+
+        generation = simCacheGeneration();
+        err = sendSimIOCmd(&ioargsDup, atresponse, sr);
         if (err < 0)
-            goto error;
-        cvt_done = 1; /* sr.simResponse needs to be freed */
+            goto finally;
+        simCacheStore(&ioargsDup, sr, generation, prefetch);
     }
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
+    if (convert) {
+        err = convertSimIoFcp(sr, cvt);
+        if (err < 0)
+            goto finally;
+        free(*buf);
+        *buf = NULL;
+        sr->simResponse = cvt;
+        if (memo && sr->sw1 == 0x90)
+            storeFcpMemo(&ioargsDup, sr, memoGeneration);
+    }
 
 finally:
-    at_response_free(atresponse);
-    if (cvt_done)
-        free(sr.simResponse);
-
     if (pathReplaced)
         free(ioargsDup.path);
+    return err;
+}
+
+/*
+ * When the framework reads the records of a file one after the other,
+ * as it does for ADN, FDN, SMS and the like, the records that follow are
+ * read into the cache ahead of it. SIM_READAHEAD_BATCH go per event on
+ * the normal queue, so that requests get in between, and no more than
+ * SIM_READAHEAD_WINDOW ahead of the last record asked for. A record
+ * that cannot be read ends the stream. Only touched from the normal
+ * queue.
+ */
+#define SIM_READAHEAD_PROPERTY "mbm.ril.simcache.readahead"
+#define SIM_READAHEAD_BATCH 4
+#define SIM_READAHEAD_WINDOW 16
+
+static struct {
+    int fileid;
+    char path[SIM_ACCESS_PATH_LEN];
+    int recordSize;
+    int lastRecord;             /* last one the framework read */
+    int first;                  /* first one read ahead */
+    int last;                   /* last one read ahead */
+    int next;                   /* 0 before the stream starts, -1 at end */
+    int scheduled;
+    unsigned int generation;
+} s_readAhead;
+
+static unsigned int s_readAheadStreams;
+static unsigned int s_readAheadBatches;
+static unsigned int s_readAheadRecords;
+static unsigned int s_readAheadHits;
+
+static void readAheadRecords(void *param);
+
+static int readAheadWanted(void)
+{
+    return s_readAhead.next > 0 && s_readAhead.next <= 0xFF &&
+        s_readAhead.next <= s_readAhead.lastRecord + SIM_READAHEAD_WINDOW;
+}
+
+/*
+ * Notes a READ RECORD the framework got an answer for, starting or
+ * feeding read-ahead once two records in a row have been read.
+ */
+static void noteRecordRead(const RIL_SIM_IO_v6 *ioargs)
+{
+    const char *path = ioargs->path != NULL ? ioargs->path : "";
+
+    if (ioargs->p2 != 4 || !simCacheEnabled() ||
+        !getPropertyInt(SIM_READAHEAD_PROPERTY, 1) ||
+        strlen(path) >= SIM_ACCESS_PATH_LEN)
+        return;
+
+    if (ioargs->fileid != s_readAhead.fileid ||
+        ioargs->p3 != s_readAhead.recordSize ||
+        strcasecmp(path, s_readAhead.path) != 0 ||
+        ioargs->p1 != s_readAhead.lastRecord + 1) {
+        if (ioargs->fileid == s_readAhead.fileid &&
+            ioargs->p1 >= s_readAhead.first &&
+            ioargs->p1 <= s_readAhead.last)
+            s_readAheadHits++;
+        memset(&s_readAhead, 0, sizeof(s_readAhead));
+        s_readAhead.fileid = ioargs->fileid;
+        strcpy(s_readAhead.path, path);
+        s_readAhead.recordSize = ioargs->p3;
+        s_readAhead.lastRecord = ioargs->p1;
+        return;
+    }
+
+    if (ioargs->p1 >= s_readAhead.first && ioargs->p1 <= s_readAhead.last)
+        s_readAheadHits++;
+    s_readAhead.lastRecord = ioargs->p1;
+
+    if (s_readAhead.next == 0) {
+        s_readAhead.next = ioargs->p1 + 1;
+        s_readAhead.first = s_readAhead.next;
+        s_readAhead.last = s_readAhead.first - 1;
+        s_readAhead.generation = simCacheGeneration();
+        s_readAheadStreams++;
+    }
+
+    if (!s_readAhead.scheduled && readAheadWanted()) {
+        s_readAhead.scheduled = 1;
+        enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, readAheadRecords, NULL, NULL);
+    }
+}
+
+static void readAheadRecords(void *param)
+{
+    RIL_SIM_IO_v6 io;
+    int i;
+    (void) param;
+
+    s_readAhead.scheduled = 0;
+
+    /* An update of the file or a new card ends the stream. */
+    if (s_readAhead.generation != simCacheGeneration() ||
+        getRadioState() != RADIO_STATE_SIM_READY) {
+        s_readAhead.next = -1;
+        return;
+    }
+
+    memset(&io, 0, sizeof(io));
+    io.command = 0xB2;
+    io.fileid = s_readAhead.fileid;
+    io.path = s_readAhead.path[0] != '\0' ? s_readAhead.path : NULL;
+    io.p2 = 4;      /* absolute */
+    io.p3 = s_readAhead.recordSize;
+
+    s_readAheadBatches++;
+    for (i = 0; i < SIM_READAHEAD_BATCH && readAheadWanted(); i++) {
+        ATResponse *atresponse = NULL;
+        RIL_SIM_IO_Response sr;
+        char *buf = NULL;
+        char cvt[TS_51011_921_RESP_HEX_LEN];
+        int err;
+
+        io.p1 = s_readAhead.next;
+        err = simIO(&io, 1, &atresponse, &sr, &buf, cvt);
+        if (err >= 0 && sr.sw1 == 0x90) {
+            s_readAhead.last = s_readAhead.next++;
+            s_readAheadRecords++;
+        } else
+            s_readAhead.next = -1;
+
+        at_response_free(atresponse);
+        free(buf);
+    }
+
+    if (readAheadWanted()) {
+        s_readAhead.scheduled = 1;
+        enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, readAheadRecords, NULL, NULL);
+    }
+}
+
+/**
+ * RIL_REQUEST_SIM_IO
+ *
+ * Request SIM I/O operation.
+ * This is similar to the TS 27.007 "restricted SIM" operation
+ * where it assumes all of the EF selection will be done by the
+ * callee.
+ */
+void requestSIM_IO(void *data, size_t datalen, RIL_Token t)
+{
+    (void) datalen;
+    ATResponse *atresponse = NULL;
+    RIL_SIM_IO_Response sr;
+    char *buf = NULL;
+    char cvt[TS_51011_921_RESP_HEX_LEN];
+    int err;
+
+    err = simIO((const RIL_SIM_IO_v6 *) data, 0, &atresponse, &sr, &buf, cvt);
+    if (err < 0)
+        goto error;
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
+
+    if (((const RIL_SIM_IO_v6 *) data)->command == 0xB2 && sr.sw1 == 0x90)
+        noteRecordRead((const RIL_SIM_IO_v6 *) data);
+
+finally:
+    at_response_free(atresponse);
+    free(buf);
     return;
 
 error:
@@ -1225,6 +2125,261 @@ error:
     goto finally;
 }
 
+/*
+ * Files the framework reads at SIM ready, with the paths it uses. The
+ * ICCID comes first, as the key of a persisted cache.
+ */
+static const struct {
+    int fileid;
+    const char *path;
+} s_prefetchFiles[] = {
+    { 0x2FE2, "3F00" },         /* EF_ICCID */
+    { 0x6FAD, "3F007F20" },     /* EF_AD */
+    { 0x6F38, "3F007F20" },     /* EF_SST */
+    { 0x6F46, "3F007F20" },     /* EF_SPN */
+    { 0x6FCD, "3F007F20" },     /* EF_SPDI */
+    { 0x6FC5, "3F007F20" },     /* EF_PNN */
+    { 0x6FC9, "3F007F20" },     /* EF_MBI */
+    { 0x6FCA, "3F007F20" },     /* EF_MWIS */
+    { 0x6FCB, "3F007F20" },     /* EF_CFIS */
+    { 0x6F16, "3F007F20" },     /* EF_INFO_CPHS */
+    { 0x6F14, "3F007F20" },     /* EF_SPN_CPHS */
+    { 0x6F15, "3F007F20" },     /* EF_CSP_CPHS */
+    { 0x6F40, "3F007F10" },     /* EF_MSISDN */
+    { 0x2F05, "3F00" },         /* EF_PL */
+    { 0x6F3C, "3F007F10" },     /* EF_SMS */
+};
+
+#define SIM_PREFETCH_PROPERTY "mbm.ril.simcache.prefetch"
+#define SIM_PREFETCH_MAX_RECORDS 64
+
+/*
+ * The prefetch sends one command per event on the normal queue, so
+ * that framework requests get in between. Only touched from there.
+ */
+static struct {
+    int active;
+    unsigned int generation;
+    unsigned int file;
+    int record;                 /* 0 while at the GET RESPONSE */
+    int records;
+    int recordSize;
+    struct timespec start;
+} s_prefetch;
+
+static unsigned int s_prefetchBursts;
+static unsigned int s_prefetchCommands;
+static long long s_prefetchLastMsec = -1;
+
+/*
+ * Issues the next command of the prefetch burst. Returns 0 when there
+ * are more to go.
+ */
+static int prefetchStep(void)
+{
+    ATResponse *atresponse = NULL;
+    RIL_SIM_IO_Response sr;
+    RIL_SIM_IO_v6 io;
+    unsigned char fcp[15];
+    char *buf = NULL;
+    char cvt[TS_51011_921_RESP_HEX_LEN];
+    int fileSize;
+
+    if (s_prefetch.file >= NUM_ELEMS(s_prefetchFiles))
+        return -1;
+
+    memset(&io, 0, sizeof(io));
+    io.fileid = s_prefetchFiles[s_prefetch.file].fileid;
+    io.path = (char *) s_prefetchFiles[s_prefetch.file].path;
+
+    if (s_prefetch.record == 0) {
+        io.command = 0xC0;
+        io.p3 = sizeof(fcp);
+    } else if (s_prefetch.records == 0) {
+        io.command = 0xB0;
+        io.p3 = s_prefetch.recordSize;
+    } else {
+        io.command = 0xB2;
+        io.p1 = s_prefetch.record;
+        io.p2 = 4;      /* absolute */
+        io.p3 = s_prefetch.recordSize;
+    }
+
+    s_prefetchCommands++;
+    if (simIO(&io, 1, &atresponse, &sr, &buf, cvt) < 0 || sr.sw1 != 0x90 ||
+        sr.simResponse == NULL)
+        goto next_file;
+
+    if (s_prefetch.record == 0) {
+        if (strlen(sr.simResponse) < 2 * sizeof(fcp) ||
+            stringToBinary(sr.simResponse, 2 * sizeof(fcp), fcp) < 0)
+            goto next_file;
+
+        /* TS 51.011 9.2.1: size, structure and record length */
+        fileSize = fcp[2] << 8 | fcp[3];
+        if (fcp[13] == 0 && fileSize > 0 && fileSize <= 0xFF) {
+            s_prefetch.records = 0;
+            s_prefetch.recordSize = fileSize;
+        } else if (fcp[13] == 1 && fcp[14] > 0) {
+            s_prefetch.records = fileSize / fcp[14];
+            if (s_prefetch.records == 0)
+                goto next_file;
+            if (s_prefetch.records > SIM_PREFETCH_MAX_RECORDS)
+                s_prefetch.records = SIM_PREFETCH_MAX_RECORDS;
+            s_prefetch.recordSize = fcp[14];
+        } else
+            goto next_file;
+        s_prefetch.record = 1;
+        goto finally;
+    }
+
+    if (io.fileid == 0x2FE2)
+        simCacheLoad(sr.simResponse);
+
+    if (s_prefetch.records > 0 && s_prefetch.record < s_prefetch.records) {
+        s_prefetch.record++;
+        goto finally;
+    }
+
+next_file:
+    s_prefetch.file++;
+    s_prefetch.record = 0;
+    s_prefetch.records = 0;
+
+finally:
+    at_response_free(atresponse);
+    free(buf);
+    return s_prefetch.file < NUM_ELEMS(s_prefetchFiles) ? 0 : -1;
+}
+
+static void prefetchSimFiles(void *param)
+{
+    struct timespec now;
+    (void) param;
+
+    if (!s_prefetch.active)
+        return;
+
+    if (s_prefetch.generation != simCacheGeneration() ||
+        getRadioState() != RADIO_STATE_SIM_READY) {
+        LOGD("%s() SIM changed, prefetch stopped", __func__);
+        s_prefetch.active = 0;
+        return;
+    }
+
+    if (prefetchStep() == 0) {
+        enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, prefetchSimFiles, NULL, NULL);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s_prefetchLastMsec = timespecDiffMsec(&s_prefetch.start, &now);
+    s_prefetch.active = 0;
+    LOGI("%s() Prefetched SIM files in %lld ms", __func__, s_prefetchLastMsec);
+    simCacheSave();
+}
+
+static void startPrefetch(void *param)
+{
+    (void) param;
+
+    if (s_prefetch.active)
+        return;
+
+    memset(&s_prefetch, 0, sizeof(s_prefetch));
+    s_prefetch.active = 1;
+    s_prefetch.generation = simCacheGeneration();
+    clock_gettime(CLOCK_MONOTONIC, &s_prefetch.start);
+    s_prefetchBursts++;
+    prefetchSimFiles(NULL);
+}
+
+/**
+ * Reads the files the framework asks for at SIM ready into the cache,
+ * in the background on the normal queue.
+ */
+void prefetchSimFilesOnReady(void)
+{
+    if (!simCacheEnabled() || !getPropertyInt(SIM_PREFETCH_PROPERTY, 1))
+        return;
+
+    enqueueRILEvent(RIL_EVENT_QUEUE_NORMAL, startPrefetch, NULL, NULL);
+}
+
+/**
+ * Dumps SIM file cache and prefetch counters.
+ */
+void simDiagnostics(struct oemDiagnostics *diag)
+{
+    unsigned int first, tries;
+    int i, learnt = 0, memos = 0;
+
+    simCacheDiagnostics(diag);
+
+    pthread_mutex_lock(&s_simPollMutex);
+    oemDiagPrintf(diag, "ready count=%u last_ms=%lld min_ms=%lld max_ms=%lld "
+                  "last_polls=%d urc_triggers=%u fallbacks=%u waiting=%d "
+                  "backoff=%d", s_simReadyCount, s_simReadyLastMsec,
+                  s_simReadyMinMsec, s_simReadyMaxMsec, s_simReadyLastPolls,
+                  s_simPollUrcTriggers, s_simPollFallbacks, s_simPoll.waiting,
+                  getPropertyInt(SIM_POLL_BACKOFF_PROPERTY, 1));
+    pthread_mutex_unlock(&s_simPollMutex);
+
+    oemDiagPrintf(diag, "card epoch=%u type=%d lc=%d rebuilds=%u",
+                  s_cardEpoch, s_card.type, s_card.lc, s_cardRebuilds);
+
+    pthread_mutex_lock(&s_statusMutex);
+    oemDiagPrintf(diag, "status known=%d status=%d hits=%u queries=%u "
+                  "invalidations=%u", s_statusKnown, s_status, s_statusHits,
+                  s_statusQueries, s_statusInvalidations);
+    pthread_mutex_unlock(&s_statusMutex);
+
+    pthread_mutex_lock(&s_accessMutex);
+    for (i = 0; i < SIM_ACCESS_ENTRIES; i++)
+        if (s_access[i].valid)
+            learnt++;
+    first = s_accessFirstTry[SIM_ACCESS_CRSM] +
+        s_accessFirstTry[SIM_ACCESS_CGLA];
+    tries = first + s_accessFallback[SIM_ACCESS_CRSM] +
+        s_accessFallback[SIM_ACCESS_CGLA] + s_accessFailed;
+    oemDiagPrintf(diag, "access first_try=%u/%u (%u%%) crsm_first=%u "
+                  "cgla_first=%u crsm_fallback=%u cgla_fallback=%u "
+                  "failed=%u learnt=%d resets=%u", first, tries,
+                  tries ? first * 100 / tries : 0,
+                  s_accessFirstTry[SIM_ACCESS_CRSM],
+                  s_accessFirstTry[SIM_ACCESS_CGLA],
+                  s_accessFallback[SIM_ACCESS_CRSM],
+                  s_accessFallback[SIM_ACCESS_CGLA], s_accessFailed,
+                  learnt, s_accessResets);
+    pthread_mutex_unlock(&s_accessMutex);
+
+    pthread_mutex_lock(&s_selectMutex);
+    oemDiagPrintf(diag, "select sent=%u saved=%u skipped=%u", s_selectSent,
+                  s_selectSaved, s_selectSkipped);
+    oemDiagPrintf(diag, "io_burst count=%u last_requests=%u last_sent=%u "
+                  "last_saved=%u max_saved=%u current_requests=%u",
+                  s_ioBursts, s_ioBurstLastRequests, s_ioBurstLastSent,
+                  s_ioBurstLastSaved, s_ioBurstMaxSaved, s_ioBurst.requests);
+    pthread_mutex_unlock(&s_selectMutex);
+
+    oemDiagPrintf(diag, "readahead streams=%u batches=%u records=%u "
+                  "hits=%u file=%04X next=%d", s_readAheadStreams,
+                  s_readAheadBatches, s_readAheadRecords, s_readAheadHits,
+                  s_readAhead.fileid, s_readAhead.next);
+
+    pthread_mutex_lock(&s_fcpMemoMutex);
+    for (i = 0; i < SIM_FCP_MEMO_ENTRIES; i++)
+        if (s_fcpMemo[i].valid)
+            memos++;
+    oemDiagPrintf(diag, "fcp_memo entries=%d hits=%u misses=%u clears=%u",
+                  memos, s_fcpMemoHits, s_fcpMemoMisses, s_fcpMemoClears);
+    pthread_mutex_unlock(&s_fcpMemoMutex);
+
+    oemDiagPrintf(diag, "prefetch bursts=%u commands=%u last_ms=%lld "
+                  "active=%d", s_prefetchBursts, s_prefetchCommands,
+                  s_prefetchLastMsec, s_prefetch.active);
+}
+
 /**
  * Enter SIM PIN, might be PIN, PIN2, PUK, PUK2, etc.
  *
@@ -1255,6 +2410,9 @@ void requestEnterSimPin(void *data, size_t datalen, RIL_Token t, int request)
     } else
         goto error;
 
+    /* Whatever the outcome, the PIN state may not be what it was. */
+    invalidateSimStatus();
+
     cme_err = at_get_cme_error(err);
 
     if (cme_err != CME_ERROR_NON_CME && err != AT_NOERROR) {
@@ -1311,6 +2469,8 @@ void requestChangePassword(void *data, size_t datalen, RIL_Token t,
 
 error:
     if (at_get_cme_error(err) == CME_INCORRECT_PASSWORD) {
+        /* Too many of these block the PIN. */
+        invalidateSimStatus();
         num_retries = getNumRetries(request);
         RIL_onRequestComplete(t, RIL_E_PASSWORD_INCORRECT, &num_retries, sizeof(int *));
     } else
@@ -1399,6 +2559,9 @@ void requestSetFacilityLock(void *data, size_t datalen, RIL_Token t)
             num_retries = -1;
             break;
         }
+        /* A wrong PIN counts towards blocking it. */
+        if (errorril != RIL_E_GENERIC_FAILURE)
+            invalidateSimStatus();
         goto finally;
     }
 
@@ -24,6 +24,8 @@
 #ifndef U300_RIL_SIM_H
 #define U300_RIL_SIM_H 1
 
+struct oemDiagnostics;
+
 int get_pending_hotswap(void);
 void set_pending_hotswap(int pending_hotswap);
 
@@ -39,5 +41,10 @@ void requestSetFacilityLock(void *data, size_t datalen, RIL_Token t);
 void requestQueryFacilityLock(void *data, size_t datalen, RIL_Token t);
 
 void pollSIMState(void *param);
+void invalidateSimCard(void);
+void invalidateSimStatus(void);
+void invalidateSimFileFormats(void);
+void prefetchSimFilesOnReady(void);
+void simDiagnostics(struct oemDiagnostics *diag);
 
 #endif
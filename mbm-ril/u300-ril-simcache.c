@@ -0,0 +1,465 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Heavily modified for ST-Ericsson U300 modems.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <telephony/ril.h>
+#include "misc.h"
+#include "u300-ril-oem.h"
+#include "u300-ril-simcache.h"
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+/*
+ * Results of READ BINARY, READ RECORD and GET RESPONSE as the card
+ * gave them, keyed by command, path, file and P1/P2/P3. Cleared when
+ * the card is swapped, reset or refreshed, and per file on UPDATE.
+ * SIM_CACHE_PROPERTY set to 0 disables the cache.
+ *
+ * With SIM_CACHE_PERSIST_PROPERTY set to 1 the contents are also kept
+ * in a file per ICCID, which is removed as soon as any of the files
+ * it holds may have changed.
+ */
+#define SIM_CACHE_PROPERTY "mbm.ril.simcache"
+#define SIM_CACHE_PERSIST_PROPERTY "mbm.ril.simcache.persist"
+#define SIM_CACHE_DIR "/data/misc/radio"
+#define SIM_CACHE_ENTRIES 128
+#define SIM_CACHE_PATH_LEN (4 * 10 + 1)
+#define SIM_CACHE_ICCID_LEN 21
+
+struct simCacheEntry {
+    int valid;
+    int command;
+    int fileid;
+    int p1;
+    int p2;
+    int p3;
+    char path[SIM_CACHE_PATH_LEN];
+    int sw1;
+    int sw2;
+    char *response;
+    unsigned int lastUsed;
+    int prefetched;
+    int persisted;
+};
+
+static pthread_mutex_t s_simCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct simCacheEntry s_entries[SIM_CACHE_ENTRIES];
+static unsigned int s_clock;
+static unsigned int s_generation;
+static char s_iccid[SIM_CACHE_ICCID_LEN];
+
+static unsigned int s_lookups;
+static unsigned int s_hits;
+static unsigned int s_prefetchHits;
+static unsigned int s_persistHits;
+static unsigned int s_stores;
+static unsigned int s_prefetched;
+static unsigned int s_evictions;
+static unsigned int s_invalidations;
+static unsigned int s_flushes;
+static unsigned int s_loaded;
+static unsigned int s_saved;
+
+int simCacheEnabled(void)
+{
+    return getPropertyInt(SIM_CACHE_PROPERTY, 1);
+}
+
+/**
+ * Returns 1 for the commands whose results are cached. Of READ RECORD
+ * only the absolute mode is: next, previous and current record give a
+ * different record each time for the same parameters.
+ */
+int simCacheIsCacheable(int command, int p1, int p2)
+{
+    if (command == 0xB2)
+        return p2 == 4 && p1 != 0;
+    return command == 0xB0 || command == 0xC0;
+}
+
+/**
+ * Returns a number that changes on each flush, for results fetched
+ * meanwhile not to be stored.
+ */
+unsigned int simCacheGeneration(void)
+{
+    unsigned int generation;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    generation = s_generation;
+    pthread_mutex_unlock(&s_simCacheMutex);
+
+    return generation;
+}
+
+static const char *normalizePath(const char *path)
+{
+    return path != NULL ? path : "";
+}
+
+/* Must be called with s_simCacheMutex held. */
+static struct simCacheEntry *findEntry(int command, int fileid, int p1,
+                                       int p2, int p3, const char *path)
+{
+    int i;
+
+    for (i = 0; i < SIM_CACHE_ENTRIES; i++) {
+        struct simCacheEntry *e = &s_entries[i];
+
+        if (e->valid && e->fileid == fileid && e->command == command &&
+            e->p1 == p1 && e->p2 == p2 && e->p3 == p3 &&
+            !strcasecmp(e->path, path))
+            return e;
+    }
+    return NULL;
+}
+
+/* Must be called with s_simCacheMutex held. */
+static void dropEntry(struct simCacheEntry *e)
+{
+    free(e->response);
+    memset(e, 0, sizeof(*e));
+}
+
+/* Must be called with s_simCacheMutex held. */
+static struct simCacheEntry *allocEntry(void)
+{
+    struct simCacheEntry *oldest = &s_entries[0];
+    int i;
+
+    for (i = 0; i < SIM_CACHE_ENTRIES; i++) {
+        if (!s_entries[i].valid)
+            return &s_entries[i];
+        if (s_entries[i].lastUsed < oldest->lastUsed)
+            oldest = &s_entries[i];
+    }
+
+    s_evictions++;
+    dropEntry(oldest);
+    return oldest;
+}
+
+/* Must be called with s_simCacheMutex held. */
+static void removePersisted(void)
+{
+    char name[PATH_MAX];
+
+    if (s_iccid[0] == '\0' || !getPropertyInt(SIM_CACHE_PERSIST_PROPERTY, 0))
+        return;
+
+    snprintf(name, sizeof(name), "%s/mbm-simcache-%s", SIM_CACHE_DIR,
+             s_iccid);
+    if (unlink(name) == 0)
+        LOGD("%s() Removed %s", __func__, name);
+}
+
+/**
+ * Fills sr from the cache. On a hit sr->simResponse is allocated and
+ * must be freed by the caller. Lookups of the prefetch itself are not
+ * counted. Returns 0 on a hit, -1 on a miss.
+ */
+int simCacheLookup(const RIL_SIM_IO_v6 *ioargs, RIL_SIM_IO_Response *sr,
+                   int prefetch)
+{
+    struct simCacheEntry *e;
+    int ret = -1;
+
+    if (!simCacheIsCacheable(ioargs->command, ioargs->p1, ioargs->p2) ||
+        !simCacheEnabled())
+        return -1;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    if (!prefetch)
+        s_lookups++;
+    e = findEntry(ioargs->command, ioargs->fileid, ioargs->p1, ioargs->p2,
+                  ioargs->p3, normalizePath(ioargs->path));
+    if (e != NULL) {
+        memset(sr, 0, sizeof(*sr));
+        sr->sw1 = e->sw1;
+        sr->sw2 = e->sw2;
+        if (e->response != NULL) {
+            sr->simResponse = strdup(e->response);
+            if (sr->simResponse == NULL)
+                goto finally;
+        }
+        ret = 0;
+        if (prefetch)
+            goto finally;
+        e->lastUsed = ++s_clock;
+        s_hits++;
+        if (e->prefetched) {
+            e->prefetched = 0;
+            s_prefetchHits++;
+        }
+        if (e->persisted) {
+            e->persisted = 0;
+            s_persistHits++;
+        }
+    }
+
+finally:
+    pthread_mutex_unlock(&s_simCacheMutex);
+    return ret;
+}
+
+/**
+ * Stores a successful result, unless the cache has been flushed since
+ * generation was taken.
+ */
+void simCacheStore(const RIL_SIM_IO_v6 *ioargs,
+                   const RIL_SIM_IO_Response *sr,
+                   unsigned int generation, int prefetched)
+{
+    const char *path = normalizePath(ioargs->path);
+    struct simCacheEntry *e;
+
+    if (!simCacheIsCacheable(ioargs->command, ioargs->p1, ioargs->p2) ||
+        sr->sw1 != 0x90 || sr->sw2 != 0x00 ||
+        strlen(path) >= SIM_CACHE_PATH_LEN || !simCacheEnabled())
+        return;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    if (generation != s_generation)
+        goto finally;
+
+    e = findEntry(ioargs->command, ioargs->fileid, ioargs->p1, ioargs->p2,
+                  ioargs->p3, path);
+    if (e != NULL)
+        dropEntry(e);
+    else
+        e = allocEntry();
+
+    if (sr->simResponse != NULL) {
+        e->response = strdup(sr->simResponse);
+        if (e->response == NULL)
+            goto finally;
+    }
+    e->command = ioargs->command;
+    e->fileid = ioargs->fileid;
+    e->p1 = ioargs->p1;
+    e->p2 = ioargs->p2;
+    e->p3 = ioargs->p3;
+    strcpy(e->path, path);
+    e->sw1 = sr->sw1;
+    e->sw2 = sr->sw2;
+    e->lastUsed = ++s_clock;
+    e->prefetched = prefetched;
+    e->valid = 1;
+    s_stores++;
+    if (prefetched)
+        s_prefetched++;
+
+finally:
+    pthread_mutex_unlock(&s_simCacheMutex);
+}
+
+/** Drops everything cached about fileid, which has been updated. */
+void simCacheInvalidateFile(int fileid)
+{
+    int i, dropped = 0;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    for (i = 0; i < SIM_CACHE_ENTRIES; i++)
+        if (s_entries[i].valid && s_entries[i].fileid == fileid) {
+            dropEntry(&s_entries[i]);
+            dropped++;
+        }
+    /* A result fetched before the update must not be stored after it. */
+    s_generation++;
+    s_invalidations++;
+    removePersisted();
+    pthread_mutex_unlock(&s_simCacheMutex);
+
+    if (dropped > 0)
+        LOGD("%s() Dropped %d entries of %04X", __func__, dropped, fileid);
+}
+
+/**
+ * Drops the whole cache, as the card has been swapped or reset. If
+ * contentChanged, the card has reported its files changed and the
+ * persisted copy is removed as well.
+ */
+void simCacheFlush(int contentChanged)
+{
+    int i;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    for (i = 0; i < SIM_CACHE_ENTRIES; i++)
+        if (s_entries[i].valid)
+            dropEntry(&s_entries[i]);
+    if (contentChanged)
+        removePersisted();
+    s_iccid[0] = '\0';
+    s_generation++;
+    s_flushes++;
+    pthread_mutex_unlock(&s_simCacheMutex);
+}
+
+/**
+ * Sets the ICCID of the card the cache holds files of and, if
+ * persisting is enabled, loads what was saved for it.
+ */
+void simCacheLoad(const char *iccid)
+{
+    char name[PATH_MAX];
+    char line[1024];
+    FILE *f;
+    int n = 0;
+
+    if (iccid == NULL || strlen(iccid) >= SIM_CACHE_ICCID_LEN ||
+        strspn(iccid, "0123456789ABCDEFabcdef") != strlen(iccid))
+        return;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    strcpy(s_iccid, iccid);
+
+    if (!getPropertyInt(SIM_CACHE_PERSIST_PROPERTY, 0))
+        goto finally;
+
+    snprintf(name, sizeof(name), "%s/mbm-simcache-%s", SIM_CACHE_DIR, iccid);
+    f = fopen(name, "r");
+    if (f == NULL)
+        goto finally;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct simCacheEntry e;
+        char response[sizeof(line)];
+
+        memset(&e, 0, sizeof(e));
+        if (sscanf(line, "%x %x %d %d %d %d %d %40s %1000s", &e.command,
+                   &e.fileid, &e.p1, &e.p2, &e.p3, &e.sw1, &e.sw2, e.path,
+                   response) != 9 ||
+            !simCacheIsCacheable(e.command, e.p1, e.p2))
+            continue;
+        if (!strcmp(e.path, "-"))
+            e.path[0] = '\0';
+        if (findEntry(e.command, e.fileid, e.p1, e.p2, e.p3, e.path))
+            continue;
+        if (strcmp(response, "-")) {
+            e.response = strdup(response);
+            if (e.response == NULL)
+                break;
+        }
+        e.valid = 1;
+        e.persisted = 1;
+        e.lastUsed = ++s_clock;
+        *allocEntry() = e;
+        n++;
+    }
+    fclose(f);
+
+    s_loaded += n;
+    LOGD("%s() Loaded %d entries from %s", __func__, n, name);
+
+finally:
+    pthread_mutex_unlock(&s_simCacheMutex);
+}
+
+/** Saves the cache for the current ICCID if persisting is enabled. */
+void simCacheSave(void)
+{
+    char name[PATH_MAX];
+    char tmp[PATH_MAX];
+    FILE *f = NULL;
+    int fd;
+    int i, n = 0;
+
+    if (!getPropertyInt(SIM_CACHE_PERSIST_PROPERTY, 0))
+        return;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    if (s_iccid[0] == '\0')
+        goto finally;
+
+    snprintf(name, sizeof(name), "%s/mbm-simcache-%s", SIM_CACHE_DIR,
+             s_iccid);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+
+    /*
+     * Holds SIM contents such as messages and MSISDN, for radio only
+     * whatever the umask. A leftover would keep its mode, so it goes.
+     */
+    unlink(tmp);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0 && (f = fdopen(fd, "w")) == NULL)
+        close(fd);
+    if (f == NULL) {
+        LOGW("%s() Cannot write %s", __func__, tmp);
+        goto finally;
+    }
+
+    for (i = 0; i < SIM_CACHE_ENTRIES; i++) {
+        struct simCacheEntry *e = &s_entries[i];
+
+        if (!e->valid)
+            continue;
+        fprintf(f, "%x %x %d %d %d %d %d %s %s\n", e->command, e->fileid,
+                e->p1, e->p2, e->p3, e->sw1, e->sw2,
+                e->path[0] ? e->path : "-",
+                e->response ? e->response : "-");
+        n++;
+    }
+
+    if (fclose(f) != 0 || rename(tmp, name) != 0) {
+        LOGW("%s() Failed to save %s", __func__, name);
+        unlink(tmp);
+        goto finally;
+    }
+
+    s_saved += n;
+    LOGD("%s() Saved %d entries to %s", __func__, n, name);
+
+finally:
+    pthread_mutex_unlock(&s_simCacheMutex);
+}
+
+/**
+ * Dumps SIM file cache counters.
+ */
+void simCacheDiagnostics(struct oemDiagnostics *diag)
+{
+    int i, used = 0;
+
+    pthread_mutex_lock(&s_simCacheMutex);
+    for (i = 0; i < SIM_CACHE_ENTRIES; i++)
+        if (s_entries[i].valid)
+            used++;
+    oemDiagPrintf(diag, "cache enabled=%d persist=%d entries=%d/%d",
+                  simCacheEnabled(),
+                  getPropertyInt(SIM_CACHE_PERSIST_PROPERTY, 0), used,
+                  SIM_CACHE_ENTRIES);
+    oemDiagPrintf(diag, "cache lookups=%u hits=%u prefetch_hits=%u "
+                  "persist_hits=%u stores=%u prefetched=%u evictions=%u",
+                  s_lookups, s_hits, s_prefetchHits, s_persistHits,
+                  s_stores, s_prefetched, s_evictions);
+    oemDiagPrintf(diag, "cache invalidations=%u flushes=%u loaded=%u "
+                  "saved=%u", s_invalidations, s_flushes, s_loaded, s_saved);
+    pthread_mutex_unlock(&s_simCacheMutex);
+}
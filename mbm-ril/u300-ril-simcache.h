@@ -0,0 +1,45 @@
+/* ST-Ericsson U300 RIL
+**
+** Copyright (C) ST-Ericsson AB 2008-2012
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by The Android Open Source Project.
+**
+** Heavily modified for ST-Ericsson U300 modems.
+*/
+
+#ifndef U300_RIL_SIMCACHE_H
+#define U300_RIL_SIMCACHE_H 1
+
+struct oemDiagnostics;
+
+int simCacheEnabled(void);
+int simCacheIsCacheable(int command, int p1, int p2);
+unsigned int simCacheGeneration(void);
+
+int simCacheLookup(const RIL_SIM_IO_v6 *ioargs, RIL_SIM_IO_Response *sr,
+                   int prefetch);
+void simCacheStore(const RIL_SIM_IO_v6 *ioargs,
+                   const RIL_SIM_IO_Response *sr,
+                   unsigned int generation, int prefetched);
+void simCacheInvalidateFile(int fileid);
+void simCacheFlush(int contentChanged);
+
+void simCacheLoad(const char *iccid);
+void simCacheSave(void);
+
+void simCacheDiagnostics(struct oemDiagnostics *diag);
+
+#endif
@@ -27,8 +27,11 @@
 #include "atchannel.h"
 #include "at_tok.h"
 #include "misc.h"
+#include "ber_tlv.h"
 #include <telephony/ril.h>
 #include "u300-ril.h"
+#include "u300-ril-sim.h"
+#include "u300-ril-simcache.h"
 
 #define LOG_TAG "RILV"
 #include <utils/Log.h>
@@ -438,40 +441,6 @@ cleanup:
     free(cmenu);
 }
 
-static size_t tlv_stream_get(const char **stream, const char *end)
-{
-    size_t ret;
-
-    if (*stream + 1 >= end)
-        return -1;
-
-    ret = ((unsigned)char2nib((*stream)[0]) << 4)
-        | ((unsigned)char2nib((*stream)[1]) << 0);
-    *stream += 2;
-
-    return ret;
-}
-
-static int mbm_parseTlv(const char *stream, const char *end, struct tlv *tlv)
-{
-    size_t len;
-
-    tlv->tag = tlv_stream_get(&stream, end);
-    len = tlv_stream_get(&stream, end);
-
-    /* The length is coded onto 2 or 4 bytes */
-    if (len == 0x81)
-        len = tlv_stream_get(&stream, end);
-
-    if (stream + 2*len > end)
-        return -1;
-
-    tlv->data = &stream[0];
-    tlv->end  = &stream[len*2];
-
-    return 0;
-}
-
 /**
  * Send TERMINAL RESPONSE after processing REFRESH proactive command
  */
@@ -494,23 +463,33 @@ static void sendRefreshTerminalResponse(void *param)
         LOGD("%s() Failed sending at command", __func__);
 }
 
-static uint16_t hex2int(const char *data) {
-    uint16_t efid;
+/*
+ * Drops the cached contents of each EF in a File List, a count byte
+ * followed by paths of two byte file identifiers.
+ */
+static void invalidateRefreshedFiles(const struct berTlv *tlvFileList)
+{
+    size_t i;
 
-    efid = ((unsigned)char2nib(data[0]) << 4)
-        | ((unsigned)char2nib(data[1]) << 0);
-    efid <<= 8;
-    efid |= ((unsigned)char2nib(data[2]) << 4)
-        | ((unsigned)char2nib(data[3]) << 0);
+    for (i = 1; i + 2 <= tlvFileList->len; i += 2) {
+        uint16_t fileid = berTlvByte(tlvFileList, i) << 8 |
+            berTlvByte(tlvFileList, i + 1);
 
-    return efid;
+        /* Skip the MF, DFs and ADFs along the paths. */
+        if ((fileid >> 8) != 0x3F && (fileid >> 8) != 0x7F &&
+            (fileid >> 8) != 0x5F)
+            simCacheInvalidateFile(fileid);
+    }
 }
 
-static void sendSimRefresh(struct tlv *tlvRefreshCmd, char *end)
+/*
+ * Handles a REFRESH, of which the Command Details are read and the
+ * simple TLVs after them are next in it.
+ */
+static void sendSimRefresh(struct berTlvIter *it, const struct berTlv *tlvCmdDetails)
 {
-    struct tlv tlvDevId;
-    struct tlv tlvFileList;
-    const char *devId = tlvRefreshCmd->end;
+    struct berTlv tlvDevId;
+    struct berTlv tlvFileList;
     int err;
     int response[2];
     unsigned int efid;
@@ -524,15 +503,16 @@ static void sendSimRefresh(struct tlv *tlvRefreshCmd, char *end)
         LOGD("%s() Memory allocation error!", __func__);
         return;
     }
-    refreshState->cmdNumber = tlv_stream_get(&tlvRefreshCmd->data, tlvRefreshCmd->end);
     /* We don't care about command type */
-    tlv_stream_get(&tlvRefreshCmd->data, tlvRefreshCmd->end);
-
-    refreshState->cmdQualifier = tlv_stream_get(&tlvRefreshCmd->data, tlvRefreshCmd->end);
+    if (tlvCmdDetails->len >= 3) {
+        refreshState->cmdNumber = berTlvByte(tlvCmdDetails, 0);
+        refreshState->cmdQualifier = berTlvByte(tlvCmdDetails, 2);
+    } else
+        refreshState->cmdNumber = -1;
 
-    err = mbm_parseTlv(devId, end, &tlvDevId);
+    err = berTlvNext(it, &tlvDevId);
 
-    if ((tlvDevId.tag != 0x82) || (err < 0) || (refreshState->cmdNumber < 0x01) || (refreshState->cmdNumber > 0xFE))
+    if ((err <= 0) || ((tlvDevId.tag & 0x7F) != 0x02) || (refreshState->cmdNumber < 0x01) || (refreshState->cmdNumber > 0xFE))
         refreshState->cmdQualifier = -1;
 
     switch(refreshState->cmdQualifier) {
@@ -551,14 +531,17 @@ static void sendSimRefresh(struct tlv *tlvRefreshCmd, char *end)
         break;
     case SAT_FILE_CHANGE_NOTIFICATION:
     case SAT_NAA_SESSION_RESET:
-        err = mbm_parseTlv(tlvDevId.end, end, &tlvFileList);
+        err = berTlvNext(it, &tlvFileList);
 
-        if ((err >= 0) && (tlvFileList.tag == 0x12)) {
+        if ((err > 0) && ((tlvFileList.tag & 0x7F) == 0x12) &&
+            (tlvFileList.len >= 3)) {
             LOGD("%s() found File List tag", __func__);
             /* one or more files on SIM has been updated
              * but we assume one file for now
              */
-            efid = hex2int(tlvFileList.end - 4);
+            efid = berTlvByte(&tlvFileList, tlvFileList.len - 2) << 8 |
+                berTlvByte(&tlvFileList, tlvFileList.len - 1);
+            invalidateRefreshedFiles(&tlvFileList);
             response[0] = SIM_FILE_UPDATE;
             response[1] = efid;
             refreshState->Result = 3; /* success, EFs read */
@@ -578,6 +561,17 @@ static void sendSimRefresh(struct tlv *tlvRefreshCmd, char *end)
         break;
     }
 
+    /* All files may have changed, the framework reads them again. */
+    if (response[0] != SIM_FILE_UPDATE) {
+        simCacheFlush(1);
+        invalidateSimFileFormats();
+    }
+
+    /* The channel and the card type go with a reset of the card or USIM. */
+    if (response[0] == SIM_RESET ||
+        refreshState->cmdQualifier == SAT_NAA_APPLICATION_RESET)
+        invalidateSimCard();
+
     RIL_onUnsolicitedResponse(RIL_UNSOL_SIM_REFRESH, response, sizeof(response));
 
     if (response[0] != SIM_RESET) {
@@ -586,38 +580,46 @@ static void sendSimRefresh(struct tlv *tlvRefreshCmd, char *end)
     }
 }
 
-static int getCmd(char *s, struct tlv *tlvBer, struct tlv *tlvSimple)
+/*
+ * Returns the type of the proactive command in s, leaving the Command
+ * Details in tlvCmdDetails and the simple TLVs after them in it.
+ */
+static int getCmd(const char *s, struct berTlvIter *it, struct berTlv *tlvCmdDetails)
 {
+    struct berTlv tlvBer;
     int err, cmd = -1;
-    char *end = &s[strlen(s)];
-    err = mbm_parseTlv(s, end, tlvBer);
 
-    if (err < 0) {
+    berTlvInit(it, s, strlen(s), BER_TLV_HEX);
+    err = berTlvNext(it, &tlvBer);
+
+    if (err <= 0) {
         LOGD("%s() error parsing BER tlv", __func__);
         return cmd;
     }
 
-    if (tlvBer->tag == 0xD0) {
+    if (tlvBer.tag == 0xD0) {
         LOGD("%s() Found Proactive SIM command tag", __func__);
-        err = mbm_parseTlv(tlvBer->data, tlvBer->end, tlvSimple);
-        if (err < 0) {
+        berTlvEnter(it, &tlvBer, BER_TLV_COMPREHENSION);
+        err = berTlvNext(it, tlvCmdDetails);
+        if (err <= 0) {
             LOGD("%s() error parsing simple tlv", __func__);
             return cmd;
         }
 
-        if (tlvSimple->tag == 0x81) {
+        if ((tlvCmdDetails->tag & 0x7F) == 0x01 && tlvCmdDetails->len >= 2) {
             LOGD("%s() Found command details tag", __func__);
-            cmd = ((unsigned)char2nib(tlvSimple->data[2]) << 4)
-                | ((unsigned)char2nib(tlvSimple->data[3]) << 0);
+            cmd = berTlvByte(tlvCmdDetails, 1);
         }
     }
 
     return cmd;
 }
 
-static int getStkResponse(char *s, struct tlv *tlvBer, struct tlv *tlvSimple)
+static int getStkResponse(const char *s)
 {
-    int cmd = getCmd(s, tlvBer, tlvSimple);
+    struct berTlvIter it;
+    struct berTlv tlvCmdDetails;
+    int cmd = getCmd(s, &it, &tlvCmdDetails);
 
     switch (cmd){
         case 0x13:
@@ -673,7 +675,6 @@ void onStkProactiveCommand(const char *s)
     char *tok = NULL;
     int rilresponse;
     int err;
-    struct tlv tlvBer, tlvSimple;
 
     tok = line = strdup(s);
 
@@ -688,7 +689,7 @@ void onStkProactiveCommand(const char *s)
     if (err < 0)
         goto error;
 
-    rilresponse = getStkResponse(str, &tlvBer, &tlvSimple);
+    rilresponse = getStkResponse(str);
     if (rilresponse < 0)
         RIL_onUnsolicitedResponse(RIL_UNSOL_STK_PROACTIVE_COMMAND, str, sizeof(char *));
     else
@@ -707,9 +708,9 @@ void onStkEventNotify(const char *s)
     char *str = NULL;
     char *line = NULL;
     char *tok = NULL;
-    char *end;
     int err;
-    struct tlv tlvBer, tlvSimple;
+    struct berTlvIter it;
+    struct berTlv tlvCmdDetails;
     int cmd;
 
     tok = line = strdup(s);
@@ -725,12 +726,11 @@ void onStkEventNotify(const char *s)
     if (err < 0)
         goto error;
 
-    cmd = getCmd(str, &tlvBer, &tlvSimple);
+    cmd = getCmd(str, &it, &tlvCmdDetails);
 
-    if (cmd == SIM_REFRESH) {
-        end = (char *)&str[strlen(str)];
-        sendSimRefresh(&tlvSimple, end);
-    } else
+    if (cmd == SIM_REFRESH)
+        sendSimRefresh(&it, &tlvCmdDetails);
+    else
         RIL_onUnsolicitedResponse(RIL_UNSOL_STK_EVENT_NOTIFY, str, sizeof(char *));
 
     free(line);
@@ -48,6 +48,7 @@
 #include "u300-ril-config.h"
 #include "u300-ril-messaging.h"
 #include "u300-ril-network.h"
+#include "u300-ril-cellinfo.h"
 #include "u300-ril-pdp.h"
 #include "u300-ril-sim.h"
 #include "u300-ril-oem.h"
@@ -74,6 +75,9 @@
 #define TIMEOUT_EMRDY 10 /* Module should respond at least within 10s */
 #define MAX_BUF 1024
 
+/* Requests waiting longer than this in the queue are logged */
+#define REQUEST_QUEUE_WAIT_WARN_MSEC 1000
+
 /*** Global Variables ***/
 char* ril_iface;
 const struct RIL_Env *s_rilenv;
@@ -101,14 +105,22 @@ static const RIL_RadioFunctions s_callbacks = {
 static pthread_mutex_t s_screen_state_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t s_tid_queueRunner;
 static pthread_t s_tid_queueRunnerPrio;
+static pthread_t s_tid_queueRunnerScan;
 
 static int s_screenState = true;
 
+/*
+ * Unsolicited reporting profile last applied by requestScreenState,
+ * 1 = screen on, 0 = screen off and -1 = unknown.
+ */
+static int s_screenProfile = -1;
+
 typedef struct RILRequest {
     int request;
     void *data;
     size_t datalen;
     RIL_Token token;
+    struct timespec enqueued;
     struct RILRequest *next;
 } RILRequest;
 
@@ -147,9 +159,24 @@ static RequestQueue s_requestQueuePrio = {
     .closed = 1
 };
 
+/*
+ * Runs commands that take minutes, such as a network scan, on a channel
+ * of their own when one is given with -n, so that they hold up neither
+ * queue. Without it they go to the normal queue.
+ */
+static RequestQueue s_requestQueueScan = {
+    .queueMutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .requestList = NULL,
+    .eventList = NULL,
+    .enabled = 0,
+    .closed = 1
+};
+
 static RequestQueue *s_requestQueues[] = {
     &s_requestQueue,
-    &s_requestQueuePrio
+    &s_requestQueuePrio,
+    &s_requestQueueScan
 };
 
 static const struct timespec TIMEVAL_0 = { 0, 0 };
@@ -160,6 +187,8 @@ static const struct timespec TIMEVAL_0 = { 0, 0 };
  *
  * 0 = the "normal" queue, 1 = prio queue and 2 = both. If only one queue
  * is present, then the event will be inserted into that queue.
+ * RIL_EVENT_QUEUE_SCAN goes to the scan queue, or the normal queue
+ * without one.
  */
 void enqueueRILEvent(int isPrio, void (*callback) (void *param),
                      void *param, const struct timespec *relativeTime)
@@ -190,7 +219,9 @@ void enqueueRILEvent(int isPrio, void (*callback) (void *param),
         e->abstime.tv_nsec -= 1000000000;
     }
 
-    if (!s_requestQueuePrio.enabled ||
+    if (isPrio == RIL_EVENT_QUEUE_SCAN) {
+        q = s_requestQueueScan.enabled ? &s_requestQueueScan : &s_requestQueue;
+    } else if (!s_requestQueuePrio.enabled ||
         (isPrio == RIL_EVENT_QUEUE_NORMAL || isPrio == RIL_EVENT_QUEUE_ALL)) {
         q = &s_requestQueue;
     } else if (isPrio == RIL_EVENT_QUEUE_PRIO)
@@ -278,9 +309,19 @@ void releaseScreenStateLock(void)
 
 }
 
+/**
+ * Forgets the applied screen profile, for when the unsolicited
+ * reporting settings have been changed behind requestScreenState's back.
+ */
+void invalidateScreenProfile(void)
+{
+    getScreenStateLock();
+    s_screenProfile = -1;
+    releaseScreenStateLock();
+}
+
 static void requestScreenState(void *data, size_t datalen, RIL_Token t)
 {
-    (void) datalen;
     int err, screenState;
 
     getScreenStateLock();
@@ -290,43 +331,42 @@ static void requestScreenState(void *data, size_t datalen, RIL_Token t)
 
     screenState = s_screenState = ((int *) data)[0];
 
+    if (screenState != 0 && screenState != 1) {
+        /* Not a defined value - error. */
+        goto error;
+    }
+
+    if (screenState == s_screenProfile) {
+        LOGD("%s() Screen profile %d already applied", __func__,
+             screenState);
+        goto success;
+    }
+
+    /* Invalid until the module has acknowledged the new profile. */
+    s_screenProfile = -1;
+
     if (screenState == 1) {
         /* Screen is on - be sure to enable all unsolicited notifications again. */
-        err = at_send_command("AT+CREG=2");
-        if (err != AT_NOERROR)
-            goto error;
-        err = at_send_command("AT+CGREG=2");
-        if (err != AT_NOERROR)
-            goto error;
-        err = at_send_command("AT+CGEREP=1,0");
+        err = at_send_command("AT+CREG=2;+CGREG=2;+CGEREP=1,0;+CMER=3,0,0,1");
         if (err != AT_NOERROR)
             goto error;
 
         isSimSmsStorageFull(NULL);
-        pollSignalStrength((void *)-1);
+        prefetchNetworkState();
 
-        err = at_send_command("AT+CMER=3,0,0,1");
-        if (err != AT_NOERROR)
-            goto error;
-    } else if (screenState == 0) {
+        /* Trigger a rehash of network values, just to be sure. */
+        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
+                                  NULL, 0);
+    } else {
         /* Screen is off - disable all unsolicited notifications. */
-        err = at_send_command("AT+CREG=0");
-        if (err != AT_NOERROR)
-            goto error;
-        err = at_send_command("AT+CGREG=0");
+        err = at_send_command("AT+CREG=0;+CGREG=0;+CGEREP=0,0;+CMER=3,0,0,0");
         if (err != AT_NOERROR)
             goto error;
-        err = at_send_command("AT+CGEREP=0,0");
-        if (err != AT_NOERROR)
-            goto error;
-        err = at_send_command("AT+CMER=3,0,0,0");
-        if (err != AT_NOERROR)
-            goto error;
-    } else {
-        /* Not a defined value - error. */
-        goto error;
     }
 
+    s_screenProfile = screenState;
+
+success:
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 
 finally:
@@ -437,11 +477,6 @@ static void processRequest(int request, void *data, size_t datalen, RIL_Token t)
             break;
         case RIL_REQUEST_SCREEN_STATE:
             requestScreenState(data, datalen, t);
-            /* Trigger a rehash of network values, just to be sure. */
-            if (((int *)data)[0] == 1)
-                RIL_onUnsolicitedResponse(
-                                   RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
-                                   NULL, 0);
             break;
 
         /* Data Call Requests */
@@ -637,6 +672,7 @@ static void onRequest(int request, void *data, size_t datalen, RIL_Token t)
     r->data = dupRequestData(request, data, datalen);
     r->datalen = datalen;
     r->token = t;
+    clock_gettime(CLOCK_MONOTONIC, &r->enqueued);
 
     if ((err = pthread_mutex_lock(&q->queueMutex)) != 0)
         LOGE("%s() failed to take queue mutex: %s!", __func__, strerror(err));
@@ -695,6 +731,26 @@ static const char *getVersion(void)
     return RIL_VERSION_STRING;
 }
 
+/*
+ * Sets up the channel of the scan queue. It takes no unsolicited
+ * reporting, the other channels have that.
+ */
+static char initializeScanChannel(void)
+{
+    if (at_handshake() < 0) {
+        LOG_FATAL("Handshake failed!");
+        return 1;
+    }
+
+    if (at_send_command("ATE0V1") != AT_NOERROR)
+        return 1;
+
+    if (at_send_command("AT+CMEE=1") != AT_NOERROR)
+        return 1;
+
+    return 0;
+}
+
 static char initializeCommon(void)
 {
     int err = 0;
@@ -823,6 +879,10 @@ static char initializeChannel(void)
     if (err != AT_NOERROR)
         return 1;
 
+    invalidateScreenProfile();
+    invalidatePDPProvisioning();
+    startCellSampling();
+
     return 0;
 }
 
@@ -870,6 +930,7 @@ static void onUnsolicited(const char *s, const char *sms_pdu)
         onNetworkTimeReceived(s);
     } else if (strStartsWith(s, "*EPEV")) {
         /* Pin event, poll SIM State! */
+        invalidateSimStatus();
         enqueueRILEvent(RIL_EVENT_QUEUE_PRIO, pollSIMState, NULL, NULL);
     } else if (strStartsWith(s, "*ESIMSR"))
         onSimStateChanged(s);
@@ -884,6 +945,7 @@ static void onUnsolicited(const char *s, const char *sms_pdu)
 /*TODO: If only reporting back network change Android can sometimes hang!! */
         RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
                                   NULL, 0);
+        onNetworkRegistrationChanged(s);
     }
     else if (strStartsWith(s, "+CMT:"))
         onNewSms(sms_pdu);
@@ -957,7 +1019,9 @@ static void onATTimeout(void)
 
 static void usage(char *s)
 {
-    fprintf(stderr, "usage: %s [-z] [-p <tcp port>] [-d /dev/tty_device] [-x /dev/tty_device] [-i <network interface>]\n", s);
+    fprintf(stderr, "usage: %s [-z] [-p <tcp port>] [-d /dev/tty_device] [-x /dev/tty_device] [-n /dev/tty_device] [-i <network interface>[,<network interface>...]]\n", s);
+    fprintf(stderr, "  -x  tty for the prio queue, short commands\n"
+                    "  -n  tty for network scans, else they block the -d channel\n");
     exit(-1);
 }
 
@@ -967,6 +1031,7 @@ struct queueArgs {
     const char *device_path;
     char isPrio;
     char hasPrio;
+    char isScan;
 };
 
 static int safe_read(int fd, char *buf, int count)
@@ -1099,13 +1164,23 @@ static void *queueRunner(void *param)
 
         q = &s_requestQueue;
 
-        if(initializeCommon()) {
+        if (queueArgs->isScan) {
+            q = &s_requestQueueScan;
+            q->closed = 0;
+            if (initializeScanChannel()) {
+                LOGE("%s() Failed to initialize channel!", __func__);
+                at_close();
+                continue;
+            }
+        } else if(initializeCommon()) {
             LOGE("%s() Failed to initialize channel!", __func__);
             at_close();
             continue;
         }
 
-        if (queueArgs->isPrio == 0) {
+        if (queueArgs->isScan) {
+            /* Nothing but the long commands go here. */
+        } else if (queueArgs->isPrio == 0) {
             q->closed = 0;
             if (initializeChannel()) {
                 LOGE("%s() Failed to initialize channel!", __func__);
@@ -1119,7 +1194,7 @@ static void *queueRunner(void *param)
             at_set_timeout_msec(1000 * 30);
         }
 
-        if (queueArgs->hasPrio == 0 || queueArgs->isPrio)
+        if (!queueArgs->isScan && (queueArgs->hasPrio == 0 || queueArgs->isPrio))
             if (initializePrioChannel()) {
                 LOGE("%s() Failed to initialize channel!", __func__);
                 at_close();
@@ -1195,6 +1270,16 @@ static void *queueRunner(void *param)
             }
 
             if (r) {
+                long long waited;
+
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                waited = timespecDiffMsec(&r->enqueued, &ts);
+                if (waited > REQUEST_QUEUE_WAIT_WARN_MSEC)
+                    LOGW("%s() %s waited %lld ms in the %s queue", __func__,
+                         requestToString(r->request), waited,
+                         queueArgs->isScan ? "scan" :
+                         queueArgs->isPrio ? "prio" : "normal");
+
                 processRequest(r->request, r->data, r->datalen, r->token);
                 freeRequestData(r->request, r->data, r->datalen);
                 free(r);
@@ -1215,15 +1300,17 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
     char *loophost = NULL;
     const char *device_path = NULL;
     const char *priodevice_path = NULL;
+    const char *scandevice_path = NULL;
     struct queueArgs *queueArgs;
     struct queueArgs *prioQueueArgs;
+    struct queueArgs *scanQueueArgs;
     pthread_attr_t attr;
 
     s_rilenv = env;
 
     LOGD("%s() entering...", __func__);
 
-    while (-1 != (opt = getopt(argc, argv, "z:i:p:d:s:x:"))) {
+    while (-1 != (opt = getopt(argc, argv, "z:i:p:d:s:x:n:"))) {
         switch (opt) {
             case 'z':
                 loophost = optarg;
@@ -1232,7 +1319,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
 
             case 'i':
                 ril_iface = optarg;
-                LOGD("%s() Using network interface %s as primary data channel.",
+                LOGD("%s() Using network interface(s) %s as data channels.",
                      __func__, ril_iface);
                 break;
 
@@ -1254,6 +1341,11 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
                 priodevice_path = optarg;
                 LOGD("%s() Opening priority tty device %s", __func__, priodevice_path);
                 break;
+
+            case 'n':
+                scandevice_path = optarg;
+                LOGD("%s() Opening network scan tty device %s", __func__, scandevice_path);
+                break;
             default:
                 usage(argv[0]);
                 return NULL;
@@ -1265,6 +1357,8 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
         ril_iface = strdup("usb0\0");
     }
 
+    initPDPContexts(ril_iface);
+
     if (port < 0 && device_path == NULL) {
         usage(argv[0]);
         return NULL;
@@ -1293,6 +1387,20 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc,
         pthread_create(&s_tid_queueRunnerPrio, &attr, queueRunner, prioQueueArgs);
     }
 
+    if (scandevice_path != NULL) {
+        scanQueueArgs = malloc(sizeof(struct queueArgs));
+        memset(scanQueueArgs, 0, sizeof(struct queueArgs));
+        scanQueueArgs->device_path = scandevice_path;
+        scanQueueArgs->isScan = 1;
+        scanQueueArgs->hasPrio = 1;
+
+        s_requestQueueScan.enabled = 1;
+
+        pthread_create(&s_tid_queueRunnerScan, &attr, queueRunner, scanQueueArgs);
+    } else
+        LOGW("%s() No network scan tty (-n), scans will hold the normal queue",
+             __func__);
+
     pthread_create(&s_tid_queueRunner, &attr, queueRunner, queueArgs);
 
     return &s_callbacks;
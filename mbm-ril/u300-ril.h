@@ -28,6 +28,7 @@
 void getScreenStateLock(void);
 int getScreenState(void);
 void releaseScreenStateLock(void);
+void invalidateScreenProfile(void);
 
 extern char* ril_iface;
 extern const struct RIL_Env *s_rilenv;
@@ -45,6 +46,7 @@ void enqueueRILEvent(int isPrio, void (*callback) (void *param),
 #define RIL_EVENT_QUEUE_NORMAL 0
 #define RIL_EVENT_QUEUE_PRIO 1
 #define RIL_EVENT_QUEUE_ALL 2
+#define RIL_EVENT_QUEUE_SCAN 3
 
 #define RIL_CID_IP 1
 